@@ -0,0 +1,135 @@
+/*
+ * Host benchmark driver: cost of matching typed short codes through one
+ * lookup engine. It is linked against src/trie.c or src/flat_hash.c and the
+ * tables scripts/gen_trie.py generated for that engine; engines.py builds it
+ * once per encoding.
+ *
+ * Every query is typed the way the processor sees it: the cursor is reset,
+ * advanced one character at a time, and asked for the short code on the
+ * trigger. The same queries are then looked up whole with trie_search(), as
+ * the trie shell commands and the overlay do. The query file has one
+ * "H <short code>" or "M <text>" line per query, for text that is or is not a
+ * short code.
+ *
+ * Prints the ns per typed hit, typed miss, searched hit and searched miss.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <zmk/trie.h>
+
+#define MAX_QUERY_LEN 256
+// Lookups per measurement, spread over as many rounds as the queries need
+#define LOOKUPS_PER_RUN 2000000
+#define MIN_ROUNDS 3
+
+struct query_set {
+    char **texts;
+    int count;
+    int capacity;
+};
+
+typedef const struct trie_node *(*lookup_fn)(const char *text);
+
+static volatile uintptr_t sink;
+
+static const struct trie_node *type_short_code(const char *text) {
+    struct trie_cursor cursor;
+
+    trie_cursor_reset(&cursor);
+    for (const char *p = text; *p; p++) {
+        if (!trie_cursor_advance(&cursor, *p)) {
+            return NULL;
+        }
+    }
+    return trie_cursor_get_terminal(&cursor);
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static double time_queries(const struct query_set *set, lookup_fn lookup) {
+    if (set->count == 0) {
+        return 0;
+    }
+    int rounds = LOOKUPS_PER_RUN / set->count;
+    if (rounds < MIN_ROUNDS) {
+        rounds = MIN_ROUNDS;
+    }
+    double start = now_ns();
+    for (int round = 0; round < rounds; round++) {
+        for (int q = 0; q < set->count; q++) {
+            sink = (uintptr_t)lookup(set->texts[q]);
+        }
+    }
+    return (now_ns() - start) / ((double)rounds * set->count);
+}
+
+static bool add_query(struct query_set *set, const char *text) {
+    if (set->count == set->capacity) {
+        int capacity = set->capacity ? set->capacity * 2 : 1024;
+        char **texts = realloc(set->texts, capacity * sizeof(*texts));
+        if (!texts) {
+            fprintf(stderr, "Error: Out of memory for queries.\n");
+            return false;
+        }
+        set->texts = texts;
+        set->capacity = capacity;
+    }
+    if (!(set->texts[set->count] = strdup(text))) {
+        fprintf(stderr, "Error: Out of memory for queries.\n");
+        return false;
+    }
+    set->count++;
+    return true;
+}
+
+int main(int argc, char **argv) {
+    struct query_set hits = {0}, misses = {0};
+    char line[MAX_QUERY_LEN + 4];
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <query file>\n", argv[0]);
+        return 1;
+    }
+    FILE *f = fopen(argv[1], "r");
+    if (!f) {
+        fprintf(stderr, "Error: Cannot open %s.\n", argv[1]);
+        return 1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        if (!strchr(line, '\n') && !feof(f)) {
+            fprintf(stderr, "Error: A query is longer than %d characters.\n", MAX_QUERY_LEN - 1);
+            fclose(f);
+            return 1;
+        }
+        line[strcspn(line, "\n")] = '\0';
+        if (strlen(line) < 3 || line[1] != ' ') {
+            continue;
+        }
+        const char *text = line + 2;
+        bool expect_hit = line[0] == 'H';
+        // Every engine must agree with the build script on what is a short code
+        if ((type_short_code(text) != NULL) != expect_hit || (trie_search(text) != NULL) != expect_hit) {
+            fprintf(stderr, "Error: \"%s\" should %sbe a short code.\n", text, expect_hit ? "" : "not ");
+            fclose(f);
+            return 1;
+        }
+        if (!add_query(expect_hit ? &hits : &misses, text)) {
+            fclose(f);
+            return 1;
+        }
+    }
+    fclose(f);
+
+    printf("%.2f %.2f %.2f %.2f\n", time_queries(&hits, type_short_code), time_queries(&misses, type_short_code),
+           time_queries(&hits, trie_search), time_queries(&misses, trie_search));
+    return 0;
+}
@@ -0,0 +1,181 @@
+"""
+Host benchmark: flash footprint and lookup time of every lookup engine on the
+same dictionaries.
+
+Each dictionary is laid out by scripts/gen_trie.py in every encoding, and
+engine_lookup.c is built against the matching engine (src/trie.c, or
+src/flat_hash.c for the flat hash engine) with the host compiler. Two random
+dictionaries are generated at every size: "abbrev", short codes of 2 to 6
+letters as people pick them, and "typos", misspelt words that share long
+prefixes as in an autocorrect list. Dictionary files in any format the build
+imports (CSV, JSON, espanso YAML) are benchmarked as they are.
+
+Flash is what the generated tables take, as packed into a flash dictionary
+image, also per short code; "index" leaves out the string pool, which every
+engine stores the same way. Lookup times are ns per short code typed and
+triggered, for hits and for misses, and that hit time per character typed.
+"search" is the ns per short code looked up whole with trie_search().
+
+Usage: python3 engines.py [--sizes 100,1000,10000,100000] [--seed 1]
+                          [--dictionary FILE]... [--encodings hash,swar]
+"""
+import argparse
+import os
+import random
+import subprocess
+import sys
+import tempfile
+from pathlib import Path
+
+BENCH_DIR = Path(__file__).resolve().parent
+REPO_DIR = BENCH_DIR.parent
+sys.path.insert(0, str(REPO_DIR / "scripts"))
+
+import gen_trie  # noqa: E402
+
+CONFIG_BY_ENCODING = {
+    gen_trie.ENCODING_HASH: None,
+    gen_trie.ENCODING_DOUBLE_ARRAY: "CONFIG_ZMK_TEXT_EXPANDER_TRIE_DOUBLE_ARRAY",
+    gen_trie.ENCODING_PERFECT_HASH: "CONFIG_ZMK_TEXT_EXPANDER_TRIE_PERFECT_HASH",
+    gen_trie.ENCODING_BITMAP: "CONFIG_ZMK_TEXT_EXPANDER_TRIE_BITMAP",
+    gen_trie.ENCODING_SWAR: "CONFIG_ZMK_TEXT_EXPANDER_TRIE_SWAR",
+    gen_trie.ENCODING_FLAT_HASH: "CONFIG_ZMK_TEXT_EXPANDER_TRIE_FLAT_HASH",
+}
+
+SHORT_CODE_ALPHABET = "abcdefghijklmnopqrstuvwxyz"
+WORD_SYLLABLES = ("con", "pre", "ing", "tion", "ment", "re", "de", "st", "ar", "en", "ou", "al", "ly", "ter", "com", "pro", "ab", "ex")
+# Queries timed per dictionary; larger dictionaries are sampled
+MAX_QUERIES = 20000
+POOL_TABLES = (gen_trie.TABLE_STRING_POOL, gen_trie.TABLE_POOL_DICT, gen_trie.TABLE_POOL_DICT_OFFSETS)
+
+def abbrev_dictionary(size, rng):
+    """Short codes of 2 to 6 letters, skewed towards short ones as people pick them."""
+    expansions = {}
+    while len(expansions) < size:
+        short_code = "".join(rng.choice(SHORT_CODE_ALPHABET) for _ in range(rng.choice((2, 3, 3, 4, 4, 5, 6))))
+        words = [rng.choice(("the", "regards", "meeting", "address", "thanks", "tomorrow", "please")) for _ in range(rng.randint(1, 6))]
+        expansions[short_code] = {"text": " ".join(words), "preserve_trigger": False}
+    return expansions
+
+def typo_dictionary(size, rng):
+    """Words with two neighbouring letters swapped, corrected to the word."""
+    expansions = {}
+    while len(expansions) < size:
+        word = "".join(rng.choice(WORD_SYLLABLES) for _ in range(rng.randint(2, 5)))
+        swap = rng.randrange(len(word) - 1)
+        short_code = word[:swap] + word[swap + 1] + word[swap] + word[swap + 2:]
+        if short_code != word:
+            expansions[short_code] = {"text": word, "preserve_trigger": False}
+    return expansions
+
+def file_dictionary(path):
+    definitions = {}
+    gen_trie.import_dictionary_file(path, definitions, False)
+    if not definitions:
+        print(f"Error: The dictionary file '{path}' has no expansions.", file=sys.stderr)
+        sys.exit(1)
+    return gen_trie.rank_definitions(definitions)
+
+def random_misses(expansions, count, rng):
+    """Typed text that is not a short code: near misses of real ones, and random words."""
+    short_codes = list(expansions)
+    misses = []
+    while len(misses) < count:
+        if rng.random() < 0.5:
+            text = rng.choice(short_codes)[:-1] + rng.choice(SHORT_CODE_ALPHABET)
+        else:
+            text = "".join(rng.choice(SHORT_CODE_ALPHABET) for _ in range(rng.randint(2, 8)))
+        if text not in expansions:
+            misses.append(text)
+    return misses
+
+def flash_bytes(tables, index_bits, offset_bits):
+    total = index = 0
+    for table in tables:
+        size = len(gen_trie.pack_table(table, index_bits, offset_bits))
+        total += size
+        if table.table_id not in POOL_TABLES:
+            index += size
+    return total, index
+
+def run_engine(encoding, expansions, query_path, work_dir, cc):
+    """Generates the engine's tables, builds the driver against them and returns (total, index, hit, miss, search hit, search miss)."""
+    tables, num_nodes, index_max, pool_size, features = gen_trie.build_trie_tables(expansions, encoding)
+    index_bits = gen_trie.choose_uint_width(index_max, "Trie index")
+    offset_bits = gen_trie.choose_uint_width(pool_size, "String pool offset")
+    longest_short_len = max(len(short_code) for short_code in expansions)
+
+    out_dir = work_dir / encoding
+    out_dir.mkdir()
+    # Large tables compile far faster included as binary than as C initializers
+    blob = gen_trie.TableBlob(out_dir / "generated_trie.bin", tables, index_bits, offset_bits)
+    blob.path.write_bytes(blob.data)
+    (out_dir / "generated_trie.c").write_text(gen_trie.generate_static_trie_c_code(tables, num_nodes, blob), encoding="utf-8")
+    (out_dir / "generated_trie.h").write_text(gen_trie.generate_trie_header(longest_short_len, index_bits, offset_bits, num_nodes, features), encoding="utf-8")
+
+    engine_src = "flat_hash.c" if encoding == gen_trie.ENCODING_FLAT_HASH else "trie.c"
+    binary = out_dir / "engine_lookup"
+    config = CONFIG_BY_ENCODING[encoding]
+    command = [cc, "-O2", "-std=gnu11", "-I", str(BENCH_DIR / "host"), "-I", str(REPO_DIR / "include"), "-I", str(out_dir),
+               *([f"-D{config}"] if config else []), "-o", str(binary),
+               str(BENCH_DIR / "engine_lookup.c"), str(REPO_DIR / "src" / engine_src), str(out_dir / "generated_trie.c")]
+    subprocess.run(command, check=True, capture_output=True, text=True)
+    result = subprocess.run([str(binary), str(query_path)], check=True, capture_output=True, text=True)
+    times = [float(value) for value in result.stdout.split()]
+
+    total, index = flash_bytes(tables, index_bits, offset_bits)
+    return (total, index, *times)
+
+def bench_dictionary(name, expansions, encodings, rng, cc):
+    short_codes = list(expansions)
+    hits = rng.sample(short_codes, min(len(short_codes), MAX_QUERIES))
+    misses = random_misses(expansions, len(hits), rng)
+    chars_per_hit = sum(len(short_code) for short_code in hits) / len(hits)
+    with tempfile.TemporaryDirectory() as tmp:
+        work_dir = Path(tmp)
+        query_path = work_dir / "queries.txt"
+        query_path.write_text("".join(f"H {short_code}\n" for short_code in hits)
+                              + "".join(f"M {text}\n" for text in misses), encoding="utf-8")
+        for encoding in encodings:
+            try:
+                total, index, hit_ns, miss_ns, search_hit_ns, search_miss_ns = run_engine(encoding, expansions, query_path, work_dir, cc)
+            except subprocess.CalledProcessError as e:
+                print(f"Error: The {encoding} engine failed: {e.stderr or e}", file=sys.stderr)
+                sys.exit(1)
+            count = len(expansions)
+            print(f"{name:<12} {count:>7} {encoding:<13} {total:>9} {total / count:>7.1f} {index / count:>7.1f}"
+                  f" {hit_ns:>7.1f} {hit_ns / chars_per_hit:>7.2f} {miss_ns:>7.1f} {search_hit_ns:>7.1f} {search_miss_ns:>7.1f}", flush=True)
+
+def main():
+    parser = argparse.ArgumentParser(description="Compare flash footprint and lookup time of the lookup engines.")
+    parser.add_argument("--sizes", default="100,1000,10000,100000", help="Comma-separated random dictionary sizes (number of short codes), or empty for none")
+    parser.add_argument("--seed", type=int, default=1, help="Seed for the random dictionaries and query samples")
+    parser.add_argument("--dictionary", action="append", default=[], metavar="FILE", help="A CSV, JSON or espanso YAML dictionary to benchmark as well. Repeatable.")
+    parser.add_argument("--encodings", default=",".join(gen_trie.ENCODINGS), help="Comma-separated encodings to compare")
+    args = parser.parse_args()
+
+    try:
+        sizes = [int(size) for size in args.sizes.split(",") if size]
+    except ValueError:
+        print(f"Error: Invalid dictionary sizes '{args.sizes}'.", file=sys.stderr)
+        sys.exit(1)
+    encodings = args.encodings.split(",")
+    for encoding in encodings:
+        if encoding not in gen_trie.ENCODINGS:
+            print(f"Error: Unknown encoding '{encoding}'; choose from {', '.join(gen_trie.ENCODINGS)}.", file=sys.stderr)
+            sys.exit(1)
+    cc = os.environ.get("CC", "cc")
+    rng = random.Random(args.seed)
+
+    print("Flash in bytes, bytes per short code in all and in the index (without the string pool), then ns per short code typed and")
+    print("triggered, that per character typed, and ns per short code looked up whole with trie_search()")
+    print(f"{'dictionary':<12} {'codes':>7} {'encoding':<13} {'flash':>9} {'B/code':>7} {'index':>7}"
+          f" {'hit ns':>7} {'ns/char':>7} {'miss ns':>7} {'search':>7} {'s.miss':>7}")
+    for size in sizes:
+        bench_dictionary("abbrev", abbrev_dictionary(size, rng), encodings, rng, cc)
+        bench_dictionary("typos", typo_dictionary(size, rng), encodings, rng, cc)
+    for path in args.dictionary:
+        bench_dictionary(Path(path).stem, file_dictionary(path), encodings, rng, cc)
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,110 @@
+"""
+Host benchmark: worst-case cost of a typo correction
+(CONFIG_ZMK_TEXT_EXPANDER_FUZZY_MATCH) against the step budget.
+
+For each dictionary size the random "abbrev" and "typos" dictionaries of
+engines.py are laid out by scripts/gen_trie.py with --fuzzy, and
+fuzzy_lookup.c is built against src/trie.c without a practical budget.
+It corrects every key once per edit kind, at random positions, of sampled
+short codes. Steps are cursor steps, the unit of
+CONFIG_ZMK_TEXT_EXPANDER_FUZZY_MATCH_BUDGET, and do not depend on the
+machine; ns per step does, so on the keyboard read the time of each
+correction from the "Fuzzy lookup took" debug log instead.
+
+Usage: python3 fuzzy.py [--sizes 100,1000,10000] [--budget 4096] [--seed 1]
+                        [--encoding hash]
+"""
+import argparse
+import os
+import random
+import subprocess
+import sys
+import tempfile
+from pathlib import Path
+
+from engines import BENCH_DIR, REPO_DIR, CONFIG_BY_ENCODING, SHORT_CODE_ALPHABET, abbrev_dictionary, typo_dictionary, gen_trie
+
+# Longer than any search takes, so the driver sees the real worst case
+UNLIMITED_BUDGET = 1 << 30
+# Short codes whose misspellings are corrected
+MAX_SAMPLED_CODES = 2000
+# trie_search_fuzzy() leaves shorter keys alone
+FUZZY_MIN_KEY_LEN = 3
+
+def misspell(short_code, rng):
+    """The short code with one substitution, transposition, insertion and deletion each."""
+    keys = []
+    i = rng.randrange(len(short_code))
+    keys.append(short_code[:i] + rng.choice(SHORT_CODE_ALPHABET) + short_code[i + 1:])
+    if len(short_code) >= 2:
+        j = rng.randrange(len(short_code) - 1)
+        keys.append(short_code[:j] + short_code[j + 1] + short_code[j] + short_code[j + 2:])
+    k = rng.randrange(len(short_code) + 1)
+    keys.append(short_code[:k] + rng.choice(SHORT_CODE_ALPHABET) + short_code[k:])
+    keys.append(short_code[:i] + short_code[i + 1:])
+    return keys
+
+def fuzzy_keys(expansions, rng):
+    short_codes = rng.sample(list(expansions), min(len(expansions), MAX_SAMPLED_CODES))
+    keys = {key for short_code in short_codes for key in misspell(short_code, rng)}
+    return sorted(key for key in keys if key not in expansions and len(key) >= FUZZY_MIN_KEY_LEN)
+
+def run_dictionary(encoding, expansions, key_path, budget, work_dir, cc):
+    """Builds the driver against the dictionary and returns (max steps, mean steps, ns per step, slowest ns, keys over budget)."""
+    tables, num_nodes, index_max, pool_size, features = gen_trie.build_trie_tables(expansions, encoding, fuzzy=True)
+    index_bits = gen_trie.choose_uint_width(index_max, "Trie index")
+    offset_bits = gen_trie.choose_uint_width(pool_size, "String pool offset")
+    longest_short_len = max(len(short_code) for short_code in expansions)
+
+    blob = gen_trie.TableBlob(work_dir / "generated_trie.bin", tables, index_bits, offset_bits)
+    blob.path.write_bytes(blob.data)
+    (work_dir / "generated_trie.c").write_text(gen_trie.generate_static_trie_c_code(tables, num_nodes, blob), encoding="utf-8")
+    (work_dir / "generated_trie.h").write_text(gen_trie.generate_trie_header(longest_short_len, index_bits, offset_bits, num_nodes, features), encoding="utf-8")
+
+    binary = work_dir / "fuzzy_lookup"
+    config = CONFIG_BY_ENCODING[encoding]
+    command = [cc, "-O2", "-std=gnu11", "-I", str(BENCH_DIR / "host"), "-I", str(REPO_DIR / "include"), "-I", str(work_dir),
+               "-DCONFIG_ZMK_TEXT_EXPANDER_FUZZY_MATCH", f"-DCONFIG_ZMK_TEXT_EXPANDER_FUZZY_MATCH_BUDGET={UNLIMITED_BUDGET}",
+               *([f"-D{config}"] if config else []), "-o", str(binary),
+               str(BENCH_DIR / "fuzzy_lookup.c"), str(REPO_DIR / "src" / "trie.c"), str(work_dir / "generated_trie.c")]
+    subprocess.run(command, check=True, capture_output=True, text=True)
+    result = subprocess.run([str(binary), str(key_path), str(budget)], check=True, capture_output=True, text=True)
+    max_steps, mean_steps, ns_per_step, slowest_ns, over_budget = result.stdout.split()
+    return int(max_steps), float(mean_steps), float(ns_per_step), float(slowest_ns), int(over_budget)
+
+def main():
+    parser = argparse.ArgumentParser(description="Measure the worst-case cost of a typo correction.")
+    parser.add_argument("--sizes", default="100,1000,10000", help="Comma-separated dictionary sizes (number of short codes)")
+    parser.add_argument("--budget", type=int, default=4096, help="CONFIG_ZMK_TEXT_EXPANDER_FUZZY_MATCH_BUDGET to check the keys against")
+    parser.add_argument("--seed", type=int, default=1, help="Seed for the random dictionaries and misspellings")
+    parser.add_argument("--encoding", choices=[e for e in gen_trie.ENCODINGS if e != gen_trie.ENCODING_FLAT_HASH],
+                        default=gen_trie.ENCODING_HASH, help="Trie encoding to search")
+    args = parser.parse_args()
+
+    try:
+        sizes = [int(size) for size in args.sizes.split(",")]
+    except ValueError:
+        print(f"Error: Invalid dictionary sizes '{args.sizes}'.", file=sys.stderr)
+        sys.exit(1)
+    cc = os.environ.get("CC", "cc")
+    rng = random.Random(args.seed)
+
+    print(f"Cursor steps per correction, ns per step on this computer, and keys needing more than {args.budget} steps")
+    print(f"{'dictionary':<12} {'codes':>7} {'keys':>6} {'max':>7} {'mean':>7} {'ns/step':>7} {'slowest':>9} {'over':>5}")
+    for size in sizes:
+        for name, make_dictionary in (("abbrev", abbrev_dictionary), ("typos", typo_dictionary)):
+            expansions = make_dictionary(size, rng)
+            keys = fuzzy_keys(expansions, rng)
+            with tempfile.TemporaryDirectory() as tmp:
+                work_dir = Path(tmp)
+                key_path = work_dir / "keys.txt"
+                key_path.write_text("".join(f"{key}\n" for key in keys), encoding="utf-8")
+                try:
+                    max_steps, mean_steps, ns_per_step, slowest_ns, over_budget = run_dictionary(args.encoding, expansions, key_path, args.budget, work_dir, cc)
+                except subprocess.CalledProcessError as e:
+                    print(f"Error: The fuzzy lookup failed: {e.stderr or e}", file=sys.stderr)
+                    sys.exit(1)
+            print(f"{name:<12} {size:>7} {len(keys):>6} {max_steps:>7} {mean_steps:>7.1f} {ns_per_step:>7.2f} {slowest_ns:>7.0f}ns {over_budget:>5}", flush=True)
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,90 @@
+/*
+ * Host benchmark driver: cost of correcting a typo with trie_search_fuzzy().
+ * It is linked against src/trie.c, built with CONFIG_ZMK_TEXT_EXPANDER_FUZZY_MATCH
+ * and the largest budget, and the tables scripts/gen_trie.py --fuzzy
+ * generated; fuzzy.py builds it once per dictionary.
+ *
+ * The key file has one misspelt key per line. Every key is corrected
+ * NUM_ROUNDS times, and its cursor steps and fastest time are recorded.
+ *
+ * Prints the most steps a key took, the mean steps, the ns per step over all
+ * keys, the ns of the slowest key, and how many keys took more steps than
+ * the budget given on the command line.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <zmk/trie.h>
+
+#define MAX_KEY_LEN 256
+#define NUM_ROUNDS 20
+
+static volatile uintptr_t sink;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+    char key[MAX_KEY_LEN + 2];
+    uint32_t max_steps = 0;
+    uint64_t total_steps = 0;
+    double total_ns = 0, slowest_ns = 0;
+    int count = 0, over_budget = 0;
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <key file> <budget>\n", argv[0]);
+        return 1;
+    }
+    uint32_t budget = strtoul(argv[2], NULL, 10);
+    FILE *f = fopen(argv[1], "r");
+    if (!f) {
+        fprintf(stderr, "Error: Cannot open %s.\n", argv[1]);
+        return 1;
+    }
+    while (fgets(key, sizeof(key), f)) {
+        size_t len = strcspn(key, "\n");
+        key[len] = '\0';
+        if (len == 0) {
+            continue;
+        }
+
+        // The fastest round, so a stray interrupt does not make a key look slow
+        uint32_t steps;
+        double ns = 0;
+        for (int round = 0; round < NUM_ROUNDS; round++) {
+            double start = now_ns();
+            sink = (uintptr_t)trie_search_fuzzy(key, len, &steps);
+            double round_ns = now_ns() - start;
+            if (round == 0 || round_ns < ns) {
+                ns = round_ns;
+            }
+        }
+
+        if (steps > budget) {
+            over_budget++;
+        }
+        if (steps > max_steps) {
+            max_steps = steps;
+        }
+        if (ns > slowest_ns) {
+            slowest_ns = ns;
+        }
+        total_steps += steps;
+        total_ns += ns;
+        count++;
+    }
+    fclose(f);
+
+    if (count == 0 || total_steps == 0) {
+        fprintf(stderr, "Error: No key took a step.\n");
+        return 1;
+    }
+    printf("%u %.1f %.2f %.0f %d\n", max_steps, (double)total_steps / count, total_ns / total_steps, slowest_ns, over_budget);
+    return 0;
+}
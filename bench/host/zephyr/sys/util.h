@@ -0,0 +1,6 @@
+/* Host stand-in for the Zephyr utility macros, for the benchmarks in bench/ */
+#pragma once
+
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+#define ARRAY_SIZE(array) (sizeof(array) / sizeof((array)[0]))
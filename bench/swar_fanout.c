@@ -0,0 +1,243 @@
+/*
+ * Host benchmark: child lookup cost of the hash-chain and SWAR trie encodings
+ * across node fan-outs.
+ *
+ * For every fan-out one node is built in each layout the way
+ * scripts/gen_trie.py lays it out, and the same random stream of typed
+ * characters (hits and misses) is looked up through each. The lookup kernels
+ * mirror trie_get_child_index() in src/trie.c:
+ *
+ *   chain     default hash encoding, next_power_of_2(fan-out) buckets
+ *   chain-1   a single bucket, i.e. one linear walk over every entry
+ *   swar-4    CONFIG_ZMK_TEXT_EXPANDER_TRIE_SWAR, 4 keys per uint32_t
+ *   swar-8    the same with 8 keys per uint64_t, for 64-bit hosts
+ *
+ * Results are ns per lookup, followed by the bytes of child tables each
+ * layout stores for the node (with 16-bit indices). Only ratios carry over to
+ * the MCU, where every load from flash may add wait states.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef uint16_t trie_index_t;
+#define NULL_INDEX UINT16_MAX
+
+#define MAX_FANOUT 64
+#define NUM_QUERIES 4096
+#define NUM_ROUNDS 2000
+// One query in HIT_RATIO_DEN types a character without a child
+#define HIT_RATIO_DEN 4
+
+struct trie_hash_entry {
+    char key;
+    trie_index_t child_node_index;
+    trie_index_t next_entry_index;
+};
+
+struct chain_node {
+    trie_index_t buckets[MAX_FANOUT];
+    struct trie_hash_entry entries[MAX_FANOUT];
+    uint8_t num_buckets;
+};
+
+struct swar_node {
+    uint32_t keys32[MAX_FANOUT / 4];
+    uint64_t keys64[MAX_FANOUT / 8];
+    trie_index_t first_child_index;
+    uint8_t num_children;
+};
+
+// Short code characters, in the order the build script sorts siblings
+static const char alphabet[] = "'-0123456789;abcdefghijklmnopqrstuvwxyz";
+
+static volatile trie_index_t sink;
+
+static uint8_t next_power_of_2(uint8_t n) {
+    uint8_t p = 1;
+    while (p < n) {
+        p <<= 1;
+    }
+    return p;
+}
+
+/**
+ * @brief Picks fanout distinct keys for a node, sorted as the build script stores siblings.
+ */
+static void pick_keys(char *keys, int fanout) {
+    char pool[256];
+    int pool_len = 0;
+
+    for (int c = '!'; c <= '~'; c++) {
+        pool[pool_len++] = (char)c;
+    }
+    // Prefer the short code alphabet, then fill up with other printable ASCII
+    int n = 0;
+    for (const char *p = alphabet; *p && n < fanout; p++) {
+        keys[n++] = *p;
+    }
+    for (int i = 0; i < pool_len && n < fanout; i++) {
+        if (!strchr(alphabet, pool[i])) {
+            keys[n++] = pool[i];
+        }
+    }
+    for (int i = 1; i < n; i++) {
+        for (int j = i; j > 0 && (uint8_t)keys[j - 1] > (uint8_t)keys[j]; j--) {
+            char t = keys[j];
+            keys[j] = keys[j - 1];
+            keys[j - 1] = t;
+        }
+    }
+}
+
+static void build_chain(struct chain_node *node, const char *keys, int fanout, uint8_t num_buckets) {
+    node->num_buckets = num_buckets;
+    for (int b = 0; b < num_buckets; b++) {
+        node->buckets[b] = NULL_INDEX;
+    }
+    for (int i = 0; i < fanout; i++) {
+        uint8_t b = (uint8_t)keys[i] % num_buckets;
+        node->entries[i] = (struct trie_hash_entry){keys[i], (trie_index_t)(1 + i), node->buckets[b]};
+        node->buckets[b] = (trie_index_t)i;
+    }
+}
+
+static void build_swar(struct swar_node *node, const char *keys, int fanout) {
+    memset(node, 0, sizeof(*node));
+    node->first_child_index = 1;
+    node->num_children = (uint8_t)fanout;
+    for (int i = 0; i < fanout; i++) {
+        node->keys32[i / 4] |= (uint32_t)(uint8_t)keys[i] << (8 * (i % 4));
+        node->keys64[i / 8] |= (uint64_t)(uint8_t)keys[i] << (8 * (i % 8));
+    }
+}
+
+static trie_index_t chain_lookup(const struct chain_node *node, char c) {
+    trie_index_t entry_index = node->buckets[(uint8_t)c % node->num_buckets];
+    while (entry_index != NULL_INDEX) {
+        const struct trie_hash_entry *entry = &node->entries[entry_index];
+        if (entry->key == c) {
+            return entry->child_node_index;
+        }
+        entry_index = entry->next_entry_index;
+    }
+    return NULL_INDEX;
+}
+
+static trie_index_t swar32_lookup(const struct swar_node *node, char c) {
+    const uint32_t *keys = node->keys32;
+    uint32_t pattern = 0x01010101U * (uint8_t)c;
+    for (uint8_t lane = 0; lane < node->num_children; lane += 4) {
+        uint32_t x = *keys++ ^ pattern;
+        uint32_t zero_lanes = (x - 0x01010101U) & ~x & 0x80808080U;
+        if (zero_lanes) {
+            uint8_t rank = lane + (__builtin_ctz(zero_lanes) >> 3);
+            return rank < node->num_children ? (trie_index_t)(node->first_child_index + rank) : NULL_INDEX;
+        }
+    }
+    return NULL_INDEX;
+}
+
+static trie_index_t swar64_lookup(const struct swar_node *node, char c) {
+    const uint64_t *keys = node->keys64;
+    uint64_t pattern = 0x0101010101010101ULL * (uint8_t)c;
+    for (uint8_t lane = 0; lane < node->num_children; lane += 8) {
+        uint64_t x = *keys++ ^ pattern;
+        uint64_t zero_lanes = (x - 0x0101010101010101ULL) & ~x & 0x8080808080808080ULL;
+        if (zero_lanes) {
+            uint8_t rank = lane + (__builtin_ctzll(zero_lanes) >> 3);
+            return rank < node->num_children ? (trie_index_t)(node->first_child_index + rank) : NULL_INDEX;
+        }
+    }
+    return NULL_INDEX;
+}
+
+// Child table bytes of one node: its trie_hash_table, buckets and entries, or its key words
+static size_t chain_bytes(int fanout, uint8_t num_buckets) {
+    return 4 + num_buckets * sizeof(trie_index_t) + fanout * sizeof(struct trie_hash_entry);
+}
+
+static size_t swar_bytes(int fanout) {
+    return (fanout + 3) / 4 * sizeof(uint32_t);
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+#define TIME_LOOKUPS(result, lookup, node, queries)                                                        \
+    do {                                                                                                   \
+        double start = now_ns();                                                                           \
+        for (int round = 0; round < NUM_ROUNDS; round++) {                                                 \
+            for (int q = 0; q < NUM_QUERIES; q++) {                                                        \
+                sink = lookup(node, queries[q]);                                                           \
+            }                                                                                              \
+        }                                                                                                  \
+        (result) = (now_ns() - start) / ((double)NUM_ROUNDS * NUM_QUERIES);                                \
+    } while (0)
+
+/**
+ * @brief Checks that every layout finds the same child for every byte.
+ */
+static bool check_layouts(const struct chain_node *chain, const struct chain_node *chain1,
+                          const struct swar_node *swar) {
+    for (int c = 1; c < 256; c++) {
+        trie_index_t want = chain_lookup(chain, (char)c);
+        if (chain_lookup(chain1, (char)c) != want || swar32_lookup(swar, (char)c) != want ||
+            swar64_lookup(swar, (char)c) != want) {
+            fprintf(stderr, "Error: Layouts disagree on key 0x%02x.\n", c);
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(void) {
+    static const int fanouts[] = {1, 2, 3, 4, 6, 8, 12, 16, 24, 32, 40, 48, 64};
+    static char queries[NUM_QUERIES];
+    static struct chain_node chain, chain1;
+    static struct swar_node swar;
+    char keys[MAX_FANOUT];
+
+    srand(1);
+    printf("ns per lookup with 1 in %d misses, then child table bytes per node\n", HIT_RATIO_DEN);
+    printf("%7s %8s %8s %8s %8s %8s %8s\n", "fan-out", "chain", "chain-1", "swar-4", "swar-8", "B chain", "B swar");
+    for (size_t f = 0; f < sizeof(fanouts) / sizeof(fanouts[0]); f++) {
+        int fanout = fanouts[f];
+        pick_keys(keys, fanout);
+        uint8_t num_buckets = fanout > 1 ? next_power_of_2((uint8_t)fanout) : 1;
+        build_chain(&chain, keys, fanout, num_buckets);
+        build_chain(&chain1, keys, fanout, 1);
+        build_swar(&swar, keys, fanout);
+        if (!check_layouts(&chain, &chain1, &swar)) {
+            return 1;
+        }
+
+        for (int q = 0; q < NUM_QUERIES; q++) {
+            if (rand() % HIT_RATIO_DEN == 0) {
+                char c;
+                do {
+                    c = (char)('!' + rand() % ('~' - '!' + 1));
+                } while (memchr(keys, c, fanout));
+                queries[q] = c;
+            } else {
+                queries[q] = keys[rand() % fanout];
+            }
+        }
+
+        double t_chain, t_chain1, t_swar32, t_swar64;
+        TIME_LOOKUPS(t_chain, chain_lookup, &chain, queries);
+        TIME_LOOKUPS(t_chain1, chain_lookup, &chain1, queries);
+        TIME_LOOKUPS(t_swar32, swar32_lookup, &swar, queries);
+        TIME_LOOKUPS(t_swar64, swar64_lookup, &swar, queries);
+        printf("%7d %8.2f %8.2f %8.2f %8.2f %8zu %8zu\n", fanout, t_chain, t_chain1, t_swar32, t_swar64,
+               chain_bytes(fanout, num_buckets), swar_bytes(fanout));
+    }
+    return 0;
+}
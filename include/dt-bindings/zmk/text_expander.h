@@ -0,0 +1,13 @@
+/*
+ * Commands for the zmk,behavior-text-expander-dictionary behavior. The second
+ * parameter is a mask of dictionaries, built with TXT_DICT().
+ */
+
+#pragma once
+
+#define TXT_DICT_ON 0
+#define TXT_DICT_OFF 1
+#define TXT_DICT_TOGGLE 2
+#define TXT_DICT_SET 3
+
+#define TXT_DICT(n) (1 << (n))
@@ -5,15 +5,43 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <zmk/expansion_features.h>
+#include <zmk/expansion_ops.h>
 
-// Bytecode Opcodes (Must match scripts/gen_trie.py)
-#define EXP_OP_CMD_WIN   0x01
-#define EXP_OP_CMD_MAC   0x02
-#define EXP_OP_CMD_LINUX 0x03
+#if defined(CONFIG_ZMK_TEXT_EXPANDER_COMPRESS_STRING_POOL) || defined(CONFIG_ZMK_TEXT_EXPANDER_FRAGMENTS)
+// Pool entries hold references the reader resolves as it goes
+#define TEXT_READER_DECODES
+#endif
+
+// Enough lookahead for the longest UTF-8 sequence
+#define TEXT_READER_LOOKAHEAD 4
 
 // Forward declaration
 struct expansion_work;
 
+/**
+ * Streaming view of an expansion's bytecode. With a compressed string pool,
+ * dictionary references are decoded only a few bytes ahead of the typing
+ * position, so no RAM copy of the full text is ever made. Fragment calls are
+ * followed the same way, keeping where to resume after each fragment on a
+ * small return stack. Without either it is a plain pointer into the text.
+ */
+struct text_reader {
+  const char *src;
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_COMPRESS_STRING_POOL
+  const char *ref;
+  uint8_t ref_len;
+#endif
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_FRAGMENTS
+  const char *return_stack[CONFIG_ZMK_TEXT_EXPANDER_FRAGMENT_DEPTH];
+  uint8_t depth;
+#endif
+#ifdef TEXT_READER_DECODES
+  uint8_t lookahead[TEXT_READER_LOOKAHEAD];
+  uint8_t lookahead_len;
+#endif
+};
+
 struct os_typing_driver {
     void (*start_unicode_typing)(struct expansion_work *exp_work);
 };
@@ -48,28 +76,46 @@ enum expansion_state {
   EXPANSION_STATE_LINUX_UNI_TYPE_HEX_RELEASE,
   EXPANSION_STATE_LINUX_UNI_PRESS_TERMINATOR,
   EXPANSION_STATE_LINUX_UNI_RELEASE_TERMINATOR,
+
+  EXPANSION_STATE_COUNT,
+};
+
+// Capitalization carried over from the typed short code to the expansion's letters
+enum expansion_case {
+  EXPANSION_CASE_NONE,
+  EXPANSION_CASE_CAPITALIZE,
+  EXPANSION_CASE_UPPER,
 };
 
 struct expansion_work {
   struct k_work_delayable work;
-  const char *expanded_text;
+  struct text_reader text;
   uint16_t backspace_count;
-  size_t text_index;
   volatile enum expansion_state state;
   uint16_t current_keycode;
   bool current_char_needs_shift;
   bool shift_mod_active;
   uint16_t trigger_keycode_to_replay;
+  enum expansion_case case_mode;
 
+#if EXPANSION_TYPES_UNICODE
   uint32_t unicode_codepoint;
   char unicode_hex_buffer[9];
   uint8_t unicode_hex_index;
-  
+#endif
+
+
   uint16_t characters_typed;
 };
 
 void expansion_work_handler(struct k_work *work);
 int start_expansion(struct expansion_work *work_item, const char *expanded_text, uint16_t len_to_delete, uint16_t trigger_keycode);
+int start_expansion_from_reader(struct expansion_work *work_item, const struct text_reader *text, uint16_t len_to_delete, uint16_t trigger_keycode, enum expansion_case case_mode);
+
+void text_reader_init(struct text_reader *reader, const char *text);
+uint8_t text_reader_peek(struct text_reader *reader, uint8_t ahead);
+void text_reader_skip(struct text_reader *reader, uint8_t count);
+bool text_reader_consume_prefix(struct text_reader *reader, const char *prefix, size_t len);
 void cancel_current_expansion(struct expansion_work *work_item, bool partial_undo);
 
 #endif /* ZMK_EXPANSION_ENGINE_H */
@@ -0,0 +1,50 @@
+#ifndef ZMK_EXPANSION_FEATURES_H
+#define ZMK_EXPANSION_FEATURES_H
+
+#include "generated_trie.h"
+
+/*
+ * What the expansion engine has to be able to type. The build script records
+ * in generated_trie.h which features the dictionary's expansions use, so the
+ * typing paths they never take are left out of the firmware. A flash
+ * dictionary image or the runtime overlay can bring in any text after the
+ * build, so either keeps everything.
+ */
+#if defined(CONFIG_ZMK_TEXT_EXPANDER_FLASH_DICTIONARY) || defined(CONFIG_ZMK_TEXT_EXPANDER_OVERLAY)
+#define EXPANSION_TYPES_UNICODE 1
+#define EXPANSION_USES_CMD_WIN 1
+#define EXPANSION_USES_CMD_MAC 1
+#define EXPANSION_USES_CMD_LINUX 1
+#define EXPANSION_TYPES_NEWLINE 1
+#define EXPANSION_TYPES_TAB 1
+#else
+#define EXPANSION_TYPES_UNICODE ZMK_TEXT_EXPANDER_GENERATED_HAS_UNICODE
+#define EXPANSION_USES_CMD_WIN ZMK_TEXT_EXPANDER_GENERATED_HAS_CMD_WIN
+#define EXPANSION_USES_CMD_MAC ZMK_TEXT_EXPANDER_GENERATED_HAS_CMD_MAC
+#define EXPANSION_USES_CMD_LINUX ZMK_TEXT_EXPANDER_GENERATED_HAS_CMD_LINUX
+#define EXPANSION_TYPES_NEWLINE ZMK_TEXT_EXPANDER_GENERATED_HAS_NEWLINE
+#define EXPANSION_TYPES_TAB ZMK_TEXT_EXPANDER_GENERATED_HAS_TAB
+#endif
+
+#define EXPANSION_USES_OS_COMMANDS (EXPANSION_USES_CMD_WIN || EXPANSION_USES_CMD_MAC || EXPANSION_USES_CMD_LINUX)
+
+// Unicode input drivers: the default OS's, and any an expansion switches to
+#if defined(CONFIG_ZMK_TEXT_EXPANDER_DEFAULT_OS_LINUX)
+#define EXPANSION_DEFAULT_OS_WIN 0
+#define EXPANSION_DEFAULT_OS_MAC 0
+#define EXPANSION_DEFAULT_OS_LINUX 1
+#elif defined(CONFIG_ZMK_TEXT_EXPANDER_DEFAULT_OS_MACOS)
+#define EXPANSION_DEFAULT_OS_WIN 0
+#define EXPANSION_DEFAULT_OS_MAC 1
+#define EXPANSION_DEFAULT_OS_LINUX 0
+#else
+#define EXPANSION_DEFAULT_OS_WIN 1
+#define EXPANSION_DEFAULT_OS_MAC 0
+#define EXPANSION_DEFAULT_OS_LINUX 0
+#endif
+
+#define EXPANSION_DRIVER_WIN (EXPANSION_TYPES_UNICODE && (EXPANSION_USES_CMD_WIN || EXPANSION_DEFAULT_OS_WIN))
+#define EXPANSION_DRIVER_MAC (EXPANSION_TYPES_UNICODE && (EXPANSION_USES_CMD_MAC || EXPANSION_DEFAULT_OS_MAC))
+#define EXPANSION_DRIVER_LINUX (EXPANSION_TYPES_UNICODE && (EXPANSION_USES_CMD_LINUX || EXPANSION_DEFAULT_OS_LINUX))
+
+#endif /* ZMK_EXPANSION_FEATURES_H */
@@ -0,0 +1,23 @@
+#ifndef ZMK_EXPANSION_OPS_H
+#define ZMK_EXPANSION_OPS_H
+
+// Bytecode Opcodes (Must match scripts/gen_trie.py)
+#define EXP_OP_CMD_WIN   0x01
+#define EXP_OP_CMD_MAC   0x02
+#define EXP_OP_CMD_LINUX 0x03
+
+// Compressed string pool only: EXP_OP_DICT <index> stands for a dictionary
+// entry, and an index of EXP_DICT_LITERAL_ESCAPE for a literal EXP_OP_DICT byte.
+#define EXP_OP_DICT              0x10
+#define EXP_DICT_LITERAL_ESCAPE  0xFF
+
+// Shared fragments only: EXP_OP_CALL <index> types fragment <index> in place,
+// then carries on after the reference.
+#define EXP_OP_CALL              0x11
+
+// Autocorrect entries: a pool entry starting with EXP_OP_KEEP <n> leaves the
+// first n bytes of the typed short code on screen and holds only the rest of
+// the expansion. The processor reads this header; it is never typed.
+#define EXP_OP_KEEP              0x12
+
+#endif /* ZMK_EXPANSION_OPS_H */
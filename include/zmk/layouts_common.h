@@ -4,6 +4,7 @@
 #include <zephyr/kernel.h>
 #include <zmk/hid.h>
 #include <zmk/keymap_utils.h>
+#include <zmk/expansion_features.h>
 
 // --- SHARED DEFINITIONS ---
 
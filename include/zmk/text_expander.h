@@ -8,6 +8,9 @@
 
 #include <zmk/trie.h>
 #include <zmk/expansion_engine.h>
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_OVERLAY
+#include <zmk/trie_overlay.h>
+#endif
 #include "generated_trie.h"
 
 #if ZMK_TEXT_EXPANDER_GENERATED_MAX_SHORT_LEN > 0
@@ -33,6 +36,8 @@ enum text_expander_event_type {
 struct text_expander_event {
     enum text_expander_event_type type;
     uint16_t keycode;
+    // Implicit and explicit modifiers the key was sent with
+    uint8_t modifiers;
     bool pressed;
 };
 
@@ -40,6 +45,14 @@ struct text_expander_data {
   const struct trie_node *root;
   char current_short[MAX_SHORT_LEN];
   uint8_t current_short_len;
+  struct trie_cursor cursor;
+  // cursor_history[n] is the cursor as it was after the first n bytes of current_short
+  struct trie_cursor cursor_history[MAX_SHORT_LEN];
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_OVERLAY
+  // The same for the short codes added at runtime
+  struct trie_overlay_cursor overlay_cursor;
+  struct trie_overlay_cursor overlay_history[MAX_SHORT_LEN];
+#endif
   struct k_mutex mutex;
   struct expansion_work expansion_work_item;
   struct k_msgq event_msgq;
@@ -47,12 +60,20 @@ struct text_expander_data {
   const struct os_typing_driver *os_driver;
   int64_t backspace_press_time;
 
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_CASE_PRESERVING
+  // current_short_upper[n] is set if byte n of current_short was typed with Shift
+  bool current_short_upper[MAX_SHORT_LEN];
+  // Shift keys currently held (MOD_LSFT / MOD_RSFT)
+  uint8_t shift_held;
+#endif
+
 #if DT_INST_NODE_HAS_PROP(0, undo_keycodes)
   char last_short_code[MAX_SHORT_LEN];
   uint16_t last_expanded_len;
   uint16_t last_trigger_keycode;
   bool just_expanded;
-  bool last_expansion_was_completion;
+  // Bytes of last_short_code left on screen by a completion or autocorrect entry
+  uint8_t last_kept_len;
 #endif
 };
 
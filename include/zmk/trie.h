@@ -2,38 +2,292 @@
 #define ZMK_TRIE_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
-#define NULL_INDEX UINT16_MAX
+// Provides trie_index_t and trie_offset_t, sized by the build script to the
+// narrowest width that fits this dictionary.
+#include "generated_trie.h"
 
+#define NULL_INDEX ZMK_TEXT_EXPANDER_GENERATED_INDEX_MAX
+#define NULL_OFFSET ZMK_TEXT_EXPANDER_GENERATED_OFFSET_MAX
+
+// Double-array BASE values are stored with this bias so they can reach below zero (Must match scripts/gen_trie.py)
+#define TRIE_DA_BASE_BIAS 256
+
+// Bitmap encoding: characters with a bit are the 7-bit ASCII characters used in short codes (Must match scripts/gen_trie.py)
+#define TRIE_BITMAP_ALPHABET_SIZE 128
+#define TRIE_BITMAP_NO_BIT 0xFF
+
+// SWAR encoding: child key bytes per packed word, lowest byte first (Must match scripts/gen_trie.py)
+#define TRIE_SWAR_LANES 4
+
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_TRIE_RADIX
+// Radix trie: the characters of a node's incoming edge after the one that
+// selected it are stored in the string pool, without a terminator.
+#define TRIE_NODE_LABEL_FIELDS \
+    trie_offset_t label_offset; \
+    uint8_t label_len;
+#else
+#define TRIE_NODE_LABEL_FIELDS
+#endif
+
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_STACKED_DICTIONARIES
+// Number of dictionaries; a higher-numbered dictionary takes precedence (Must match scripts/gen_trie.py)
+#define TRIE_DICTIONARY_COUNT 8
+// Stacked dictionaries: a node's payload is the short code's definition in the
+// highest dictionary that has one. next_variant chains the definitions in
+// lower dictionaries, highest first, through rows that no edge leads to.
+// dictionary_mask has bit d set if dictionary d has a short code at or below the node.
+#define TRIE_NODE_DICTIONARY_FIELDS \
+    trie_index_t next_variant; \
+    uint8_t dictionary; \
+    uint8_t dictionary_mask;
+#else
+#define TRIE_NODE_DICTIONARY_FIELDS
+#endif
+
+#if defined(CONFIG_ZMK_TEXT_EXPANDER_TRIE_DOUBLE_ARRAY)
+
+struct trie_node {
+    trie_offset_t expanded_text_offset;
+    uint16_t expanded_len_chars;
+    bool is_terminal;
+    bool preserve_trigger;
+    TRIE_NODE_LABEL_FIELDS
+    TRIE_NODE_DICTIONARY_FIELDS
+};
+
+#elif defined(CONFIG_ZMK_TEXT_EXPANDER_TRIE_BITMAP)
+
+// Children of a node are stored contiguously in alphabet order, so the child
+// for the character with bit b is first_child_index + popcount(bits below b).
+// child_bitmap is forced to 8-byte alignment so the node layout, and with it
+// the flash dictionary image, is the same on 32-bit hosts as on the MCU.
+struct trie_node {
+    uint64_t child_bitmap __attribute__((aligned(8)));
+    trie_index_t first_child_index;
+    trie_offset_t expanded_text_offset;
+    uint16_t expanded_len_chars;
+    bool is_terminal;
+    bool preserve_trigger;
+    TRIE_NODE_LABEL_FIELDS
+    TRIE_NODE_DICTIONARY_FIELDS
+};
+
+#elif defined(CONFIG_ZMK_TEXT_EXPANDER_TRIE_SWAR)
+
+// Children of a node are stored contiguously in character order, and their
+// keys are packed TRIE_SWAR_LANES to a word starting at child_keys_index, so
+// the child whose key sits in lane l of the packed run is first_child_index + l.
+struct trie_node {
+    trie_index_t first_child_index;
+    trie_index_t child_keys_index;
+    uint8_t num_children;
+    trie_offset_t expanded_text_offset;
+    uint16_t expanded_len_chars;
+    bool is_terminal;
+    bool preserve_trigger;
+    TRIE_NODE_LABEL_FIELDS
+    TRIE_NODE_DICTIONARY_FIELDS
+};
+
+#elif defined(CONFIG_ZMK_TEXT_EXPANDER_TRIE_FLAT_HASH)
+
+// Flat hash engine: no trie, only one row per short code in an open-addressing
+// table of zmk_text_expander_trie_num_nodes slots, keyed on the hash of the
+// whole short code. key_hash and key_len identify the short code; a key_len
+// of 0 marks an empty slot.
+struct trie_node {
+    uint32_t key_hash;
+    uint8_t key_len;
+    trie_offset_t expanded_text_offset;
+    uint16_t expanded_len_chars;
+    bool is_terminal;
+    bool preserve_trigger;
+};
+
+#elif defined(CONFIG_ZMK_TEXT_EXPANDER_TRIE_PERFECT_HASH)
+
+// A key of '\0' marks a slot that no child hashes to.
 struct trie_hash_entry {
     char key;
-    uint16_t child_node_index;
-    uint16_t next_entry_index;
+    trie_index_t child_node_index;
 };
 
+// Perfect-hash child table: the slot of key c is ((uint16_t)(c * seed) * num_slots) >> 16.
 struct trie_hash_table {
-    uint16_t buckets_start_index;
+    trie_index_t entries_start_index;
+    uint16_t seed;
+    uint8_t num_slots;
+};
+
+struct trie_node {
+    trie_index_t hash_table_index;
+    trie_offset_t expanded_text_offset;
+    uint16_t expanded_len_chars;
+    bool is_terminal;
+    bool preserve_trigger;
+    TRIE_NODE_LABEL_FIELDS
+    TRIE_NODE_DICTIONARY_FIELDS
+};
+
+#else
+
+struct trie_hash_entry {
+    char key;
+    trie_index_t child_node_index;
+    trie_index_t next_entry_index;
+};
+
+struct trie_hash_table {
+    trie_index_t buckets_start_index;
     uint8_t num_buckets;
 };
 
 struct trie_node {
-    uint16_t hash_table_index;
-    uint16_t expanded_text_offset;
+    trie_index_t hash_table_index;
+    trie_offset_t expanded_text_offset;
     uint16_t expanded_len_chars;
     bool is_terminal;
     bool preserve_trigger;
+    TRIE_NODE_LABEL_FIELDS
+    TRIE_NODE_DICTIONARY_FIELDS
+};
+
+#endif
+
+/**
+ * @brief Incremental match state for the short code currently being typed.
+ *
+ * node_index is the node reached by the characters consumed so far, or
+ * NULL_INDEX once they no longer spell a prefix of any short code. depth
+ * counts every consumed character, whether it matched or not. In a radix
+ * trie, label_pos counts how much of node_index's edge label has been
+ * matched; the cursor sits on the node itself only once all of it has.
+ * In Aho-Corasick mode the cursor never falls off: node_index is the node for
+ * the longest suffix of the typed text that is a prefix of some short code.
+ */
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_TRIE_FLAT_HASH
+// The flat hash engine cannot tell prefixes apart from other text: the cursor
+// only carries the hash of the characters consumed so far, updated in O(1).
+struct trie_cursor {
+    uint32_t hash;
+    uint8_t depth;
 };
+#else
+struct trie_cursor {
+    trie_index_t node_index;
+    uint8_t depth;
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_TRIE_RADIX
+    uint8_t label_pos;
+#endif
+};
+#endif
+
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_FLASH_DICTIONARY
+// The tables live in the flash dictionary image and are bound by trie_image_load().
+#define TRIE_TABLE(type, name) extern const type *name
+#define TRIE_SCALAR(type, name) extern type name
+#else
+#define TRIE_TABLE(type, name) extern const type name[]
+#define TRIE_SCALAR(type, name) extern const type name
+#endif
 
-extern const uint16_t zmk_text_expander_trie_num_nodes;
-extern const struct trie_node zmk_text_expander_trie_nodes[];
-extern const struct trie_hash_table zmk_text_expander_hash_tables[];
-extern const struct trie_hash_entry zmk_text_expander_hash_entries[];
-extern const uint16_t zmk_text_expander_hash_buckets[];
-extern const char zmk_text_expander_string_pool[];
+TRIE_SCALAR(trie_index_t, zmk_text_expander_trie_num_nodes);
+TRIE_TABLE(struct trie_node, zmk_text_expander_trie_nodes);
+#if defined(CONFIG_ZMK_TEXT_EXPANDER_TRIE_DOUBLE_ARRAY)
+TRIE_TABLE(trie_index_t, zmk_text_expander_da_base);
+TRIE_TABLE(trie_index_t, zmk_text_expander_da_check);
+#elif defined(CONFIG_ZMK_TEXT_EXPANDER_TRIE_BITMAP)
+// TRIE_BITMAP_ALPHABET_SIZE entries
+TRIE_TABLE(uint8_t, zmk_text_expander_bitmap_bit_of);
+#elif defined(CONFIG_ZMK_TEXT_EXPANDER_TRIE_SWAR)
+TRIE_TABLE(uint32_t, zmk_text_expander_swar_keys);
+#elif defined(CONFIG_ZMK_TEXT_EXPANDER_TRIE_FLAT_HASH)
+// The node table is the whole dictionary
+#elif defined(CONFIG_ZMK_TEXT_EXPANDER_TRIE_PERFECT_HASH)
+TRIE_TABLE(struct trie_hash_table, zmk_text_expander_hash_tables);
+TRIE_TABLE(struct trie_hash_entry, zmk_text_expander_hash_entries);
+#else
+TRIE_TABLE(struct trie_hash_table, zmk_text_expander_hash_tables);
+TRIE_TABLE(struct trie_hash_entry, zmk_text_expander_hash_entries);
+TRIE_TABLE(trie_index_t, zmk_text_expander_hash_buckets);
+#endif
+TRIE_TABLE(char, zmk_text_expander_string_pool);
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_AHO_CORASICK
+TRIE_TABLE(trie_index_t, zmk_text_expander_ac_fail);
+TRIE_TABLE(trie_index_t, zmk_text_expander_ac_output);
+TRIE_TABLE(uint8_t, zmk_text_expander_ac_depth);
+#endif
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_PREFIX_COMPLETION
+// Node n's best completions are entries [n * TRIE_TOP_K, (n + 1) * TRIE_TOP_K), best first, padded with NULL_INDEX
+#define TRIE_TOP_K CONFIG_ZMK_TEXT_EXPANDER_PREFIX_COMPLETION_TOP_K
+TRIE_TABLE(trie_index_t, zmk_text_expander_top_completions);
+#endif
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_FUZZY_MATCH
+// Every byte used in a short code, NUL-terminated
+TRIE_TABLE(char, zmk_text_expander_short_code_alphabet);
+#endif
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_COMPRESS_STRING_POOL
+TRIE_TABLE(char, zmk_text_expander_pool_dict);
+TRIE_TABLE(uint16_t, zmk_text_expander_pool_dict_offsets);
+TRIE_SCALAR(uint8_t, zmk_text_expander_pool_dict_count);
+#endif
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_FRAGMENTS
+// String pool offset of every fragment EXP_OP_CALL can reference
+TRIE_TABLE(trie_offset_t, zmk_text_expander_fragment_offsets);
+TRIE_SCALAR(uint16_t, zmk_text_expander_fragment_count);
+#endif
 
-const char *zmk_text_expander_get_string(uint16_t offset);
+const char *zmk_text_expander_get_string(trie_offset_t offset);
 const struct trie_node *trie_search(const char *key);
 const struct trie_node *trie_get_node_for_key(const char *key);
+#ifndef CONFIG_ZMK_TEXT_EXPANDER_TRIE_FLAT_HASH
+trie_index_t trie_get_child_index(trie_index_t node_index, char c);
+#endif
+
+void trie_cursor_reset(struct trie_cursor *cursor);
+bool trie_cursor_advance(struct trie_cursor *cursor, char c);
+const struct trie_node *trie_cursor_get_terminal(const struct trie_cursor *cursor);
+uint8_t trie_cursor_get_match_len(const struct trie_cursor *cursor);
+uint8_t trie_cursor_get_prefix_len(const struct trie_cursor *cursor);
+
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_STACKED_DICTIONARIES
+void trie_set_enabled_dictionaries(uint8_t mask);
+uint8_t trie_get_enabled_dictionaries(void);
+#endif
+
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_PREFIX_COMPLETION
+uint8_t trie_get_completions(const char *prefix, const struct trie_node **results, uint8_t max_results);
+uint8_t trie_cursor_get_completions(const struct trie_cursor *cursor, const struct trie_node **results, uint8_t max_results);
+#endif
+
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_FUZZY_MATCH
+const struct trie_node *trie_search_fuzzy(const char *key, size_t key_len, uint32_t *steps);
+#endif
+
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_USAGE_COUNTERS
+typedef void (*trie_usage_cb)(const char *prefix, size_t prefix_len, uint16_t visits, uint16_t hits, void *user);
+
+void trie_usage_record_step(const struct trie_cursor *cursor);
+void trie_usage_record_expansion(const struct trie_node *node);
+void trie_usage_reset(void);
+void trie_usage_foreach(trie_usage_cb cb, void *user);
+#endif
+
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_NODE_CACHE
+// hits and misses count edge lookups from a cached and an uncached node
+struct trie_node_cache_stats {
+    uint32_t hits;
+    uint32_t misses;
+    uint16_t nodes;
+    uint16_t edges;
+};
+
+void trie_node_cache_init(void);
+void trie_node_cache_get_stats(struct trie_node_cache_stats *stats);
+void trie_node_cache_reset_stats(void);
+#endif
 
 #endif /* ZMK_TRIE_H */
@@ -0,0 +1,121 @@
+#ifndef ZMK_TRIE_IMAGE_H
+#define ZMK_TRIE_IMAGE_H
+
+#include <stdint.h>
+#include <zephyr/sys/util.h>
+
+#include <zmk/trie.h>
+
+/*
+ * Flash dictionary image, written by scripts/gen_trie.py --image and read in
+ * place from the text_expander_partition fixed partition. The image is a
+ * header followed by the generated tables; each table is found through the
+ * header's directory at an 8-byte aligned offset from the start of the image
+ * and has exactly the layout of the matching C declaration, so the image can
+ * be flashed at any partition address. All fields are little-endian.
+ * (Must match scripts/gen_trie.py)
+ */
+
+#define TRIE_IMAGE_MAGIC 0x45585A54 // "TZXE"
+#define TRIE_IMAGE_VERSION 4
+#define TRIE_IMAGE_TABLE_ALIGN 8
+
+enum trie_image_table_id {
+    TRIE_TABLE_NODES,
+    TRIE_TABLE_STRING_POOL,
+    TRIE_TABLE_DA_BASE,
+    TRIE_TABLE_DA_CHECK,
+    TRIE_TABLE_HASH_TABLES,
+    TRIE_TABLE_HASH_ENTRIES,
+    TRIE_TABLE_HASH_BUCKETS,
+    TRIE_TABLE_BITMAP_ALPHABET,
+    TRIE_TABLE_POOL_DICT,
+    TRIE_TABLE_POOL_DICT_OFFSETS,
+    TRIE_TABLE_AC_FAIL,
+    TRIE_TABLE_AC_OUTPUT,
+    TRIE_TABLE_AC_DEPTH,
+    TRIE_TABLE_TOP_COMPLETIONS,
+    TRIE_TABLE_SHORT_CODE_ALPHABET,
+    TRIE_TABLE_SWAR_KEYS,
+    TRIE_TABLE_FRAGMENT_OFFSETS,
+    TRIE_TABLE_COUNT,
+};
+
+// A table absent from this configuration has size 0.
+struct trie_image_table {
+    uint32_t offset;
+    uint32_t size;
+};
+
+struct trie_image_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t header_size;
+    // Encoding, feature flags and field widths the tables were laid out for; see TRIE_IMAGE_LAYOUT
+    uint32_t layout;
+    uint32_t image_size;
+    uint32_t num_nodes;
+    uint8_t max_short_len;
+    uint8_t top_k;
+    uint16_t reserved;
+    // CRC-32 (IEEE) of the bytes from header_size to image_size
+    uint32_t payload_crc;
+    struct trie_image_table tables[TRIE_TABLE_COUNT];
+    // CRC-32 (IEEE) of every header byte before this field
+    uint32_t header_crc;
+};
+
+#define TRIE_IMAGE_ENCODING_HASH 0
+#define TRIE_IMAGE_ENCODING_DOUBLE_ARRAY 1
+#define TRIE_IMAGE_ENCODING_PERFECT_HASH 2
+#define TRIE_IMAGE_ENCODING_BITMAP 3
+#define TRIE_IMAGE_ENCODING_SWAR 4
+#define TRIE_IMAGE_ENCODING_FLAT_HASH 5
+
+#define TRIE_IMAGE_FLAG_RADIX BIT(0)
+#define TRIE_IMAGE_FLAG_AHO_CORASICK BIT(1)
+#define TRIE_IMAGE_FLAG_COMPRESSED_POOL BIT(2)
+#define TRIE_IMAGE_FLAG_PREFIX_COMPLETION BIT(3)
+#define TRIE_IMAGE_FLAG_STACKED_DICTIONARIES BIT(4)
+#define TRIE_IMAGE_FLAG_FUZZY_MATCH BIT(5)
+#define TRIE_IMAGE_FLAG_FRAGMENTS BIT(6)
+
+#if defined(CONFIG_ZMK_TEXT_EXPANDER_TRIE_DOUBLE_ARRAY)
+#define TRIE_IMAGE_ENCODING TRIE_IMAGE_ENCODING_DOUBLE_ARRAY
+#elif defined(CONFIG_ZMK_TEXT_EXPANDER_TRIE_PERFECT_HASH)
+#define TRIE_IMAGE_ENCODING TRIE_IMAGE_ENCODING_PERFECT_HASH
+#elif defined(CONFIG_ZMK_TEXT_EXPANDER_TRIE_BITMAP)
+#define TRIE_IMAGE_ENCODING TRIE_IMAGE_ENCODING_BITMAP
+#elif defined(CONFIG_ZMK_TEXT_EXPANDER_TRIE_SWAR)
+#define TRIE_IMAGE_ENCODING TRIE_IMAGE_ENCODING_SWAR
+#elif defined(CONFIG_ZMK_TEXT_EXPANDER_TRIE_FLAT_HASH)
+#define TRIE_IMAGE_ENCODING TRIE_IMAGE_ENCODING_FLAT_HASH
+#else
+#define TRIE_IMAGE_ENCODING TRIE_IMAGE_ENCODING_HASH
+#endif
+
+#define TRIE_IMAGE_FLAGS                                                                                     \
+    ((IS_ENABLED(CONFIG_ZMK_TEXT_EXPANDER_TRIE_RADIX) ? TRIE_IMAGE_FLAG_RADIX : 0) |                         \
+     (IS_ENABLED(CONFIG_ZMK_TEXT_EXPANDER_AHO_CORASICK) ? TRIE_IMAGE_FLAG_AHO_CORASICK : 0) |                \
+     (IS_ENABLED(CONFIG_ZMK_TEXT_EXPANDER_COMPRESS_STRING_POOL) ? TRIE_IMAGE_FLAG_COMPRESSED_POOL : 0) |     \
+     (IS_ENABLED(CONFIG_ZMK_TEXT_EXPANDER_PREFIX_COMPLETION) ? TRIE_IMAGE_FLAG_PREFIX_COMPLETION : 0) |      \
+     (IS_ENABLED(CONFIG_ZMK_TEXT_EXPANDER_STACKED_DICTIONARIES) ? TRIE_IMAGE_FLAG_STACKED_DICTIONARIES : 0) | \
+     (IS_ENABLED(CONFIG_ZMK_TEXT_EXPANDER_FUZZY_MATCH) ? TRIE_IMAGE_FLAG_FUZZY_MATCH : 0) |                  \
+     (IS_ENABLED(CONFIG_ZMK_TEXT_EXPANDER_FRAGMENTS) ? TRIE_IMAGE_FLAG_FRAGMENTS : 0))
+
+// The layout word this firmware was built for; an image is only usable if its header matches.
+#define TRIE_IMAGE_LAYOUT                                                                          \
+    ((uint32_t)TRIE_IMAGE_ENCODING | ((uint32_t)TRIE_IMAGE_FLAGS << 8) |                           \
+     ((uint32_t)(sizeof(trie_index_t) * 8) << 16) | ((uint32_t)(sizeof(trie_offset_t) * 8) << 24))
+
+/**
+ * @brief Validates the dictionary image in the text expander partition and binds the trie tables to it.
+ *
+ * Must run before any trie lookup. On failure the tables stay empty, so the
+ * expander sees a dictionary without short codes.
+ *
+ * @return 0 on success, or a negative errno if the image is missing, corrupt or built for another configuration.
+ */
+int trie_image_load(void);
+
+#endif /* ZMK_TRIE_IMAGE_H */
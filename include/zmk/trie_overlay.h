@@ -0,0 +1,52 @@
+#ifndef ZMK_TRIE_OVERLAY_H
+#define ZMK_TRIE_OVERLAY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Expansions added at runtime, kept in RAM next to the generated dictionary
+ * and saved with the settings subsystem. Entries are sorted by short code, so
+ * the short codes that start with the typed text are always a contiguous run
+ * of entries; a cursor narrows that run by one binary search per character.
+ */
+
+// Short codes starting with the consumed text are entries [lo, hi)
+struct trie_overlay_cursor {
+    uint8_t lo;
+    uint8_t hi;
+    uint8_t depth;
+    // Overlay version the range was computed for; a cursor from before a change matches nothing
+    uint8_t generation;
+};
+
+struct trie_overlay_match {
+    const char *expanded_text;
+    uint16_t expanded_len_chars;
+    uint8_t short_len;
+    bool preserve_trigger;
+};
+
+struct trie_overlay_stats {
+    uint16_t entries;
+    uint16_t pool_used;
+    // Bytes of removed entries, reclaimed by the next compaction
+    uint16_t pool_free;
+};
+
+typedef void (*trie_overlay_cb)(const char *short_code, const char *expanded_text, bool preserve_trigger, void *user);
+
+void trie_overlay_cursor_reset(struct trie_overlay_cursor *cursor);
+void trie_overlay_cursor_advance(struct trie_overlay_cursor *cursor, char c);
+bool trie_overlay_cursor_is_prefix(const struct trie_overlay_cursor *cursor);
+bool trie_overlay_cursor_get_match(const struct trie_overlay_cursor *cursor, struct trie_overlay_match *match);
+
+int trie_overlay_add(const char *short_code, const char *expanded_text, bool preserve_trigger);
+int trie_overlay_remove(const char *short_code);
+void trie_overlay_clear(void);
+void trie_overlay_foreach(trie_overlay_cb cb, void *user);
+void trie_overlay_get_stats(struct trie_overlay_stats *stats);
+int trie_overlay_save(void);
+
+#endif /* ZMK_TRIE_OVERLAY_H */
@@ -2,32 +2,129 @@ import sys
 import argparse
 from pathlib import Path
 import re
+from functools import lru_cache
+import heapq
+import struct
+import zlib
+import json
+import csv
 
-try:
-    from devicetree import dtlib
-except ImportError:
-    print("Error: The 'dtlib' library is required but could not be imported.", file=sys.stderr)
-    print("       This may be an issue with the PYTHONPATH environment for the build command.", file=sys.stderr)
-    sys.exit(1)
+# Sentinels for a null index or string offset. They are emitted as the NULL_INDEX and
+# NULL_OFFSET macros, whose values depend on the widths picked for the dictionary.
+NULL_INDEX = -1
+NULL_OFFSET = -1
+
+# Candidate widths for trie_index_t and trie_offset_t; the all-ones value of each is reserved as its sentinel.
+UINT_WIDTHS = (8, 16, 32)
+
+# Bitmap encoding: width of the per-node child bitmap, and the alphabet table value for
+# characters outside the alphabet (Must match include/zmk/trie.h)
+BITMAP_BITS = 64
+BITMAP_NO_BIT = 0xFF
+BITMAP_ALPHABET_SIZE = 128
 
-# Sentinel value for a null/invalid index in the generated C code.
-NULL_INDEX = 0xFFFF
+# Flat hash engine: FNV-1a over the bytes of a whole short code (Must match src/flat_hash.c)
+FLAT_HASH_OFFSET_BASIS = 0x811C9DC5
+FLAT_HASH_PRIME = 0x01000193
+FLAT_HASH_MIX = 0x85EBCA6B
+# Largest share of the flat hash table's slots that hold a short code
+FLAT_HASH_LOAD_PERCENT = 70
 
-# Opcodes for expansion engine (Must match include/zmk/expansion_engine.h)
+# SWAR encoding: child key bytes packed per 32-bit word, lowest byte first (Must match include/zmk/trie.h)
+SWAR_LANES = 4
+
+# Bias added to every stored double-array BASE so that bases may be negative (Must match include/zmk/trie.h)
+DA_BASE_BIAS = 256
+
+# Opcodes for expansion engine (Must match include/zmk/expansion_ops.h)
 OP_CMD_WIN   = 0x01
 OP_CMD_MAC   = 0x02
 OP_CMD_LINUX = 0x03
+OP_DICT      = 0x10
+OP_CALL      = 0x11
+OP_KEEP      = 0x12
+DICT_LITERAL_ESCAPE = 0xFF
+
+# Shared fragments: OP_CALL takes a one-byte fragment index. Repeats shorter than
+# FRAGMENT_MIN_LEN are not factored out; the compressed pool's dictionary covers those.
+FRAGMENT_MAX_COUNT = 256
+FRAGMENT_MIN_LEN = 16
+
+# Stacked dictionaries: number of dictionaries, one bit each in the per-node mask (Must match include/zmk/trie.h)
+DICTIONARY_COUNT = 8
+
+# Tables the generated C source includes from a binary file instead of writing them out (--blob)
+BLOB_MIN_TABLE_BYTES = 1024
+BLOB_TABLE_ALIGN = 8
+
+# Expansion engine timing (Must match src/expansion_engine.c)
+EXPANSION_START_DELAY_MS = 10
+CHAR_PRESS_DELAY_MS = 1
+MIN_TYPING_DELAY_MS = 1
+MAX_TYPING_DELAY_MS = 1000
+
+# Unicode input method per OS command, and the default OS names used by --default-os
+OS_WIN, OS_MAC, OS_LINUX = "win", "mac", "linux"
+OS_BY_COMMAND = {chr(OP_CMD_WIN): OS_WIN, chr(OP_CMD_MAC): OS_MAC, chr(OP_CMD_LINUX): OS_LINUX}
+
+# RAM of struct text_expander_data that the dictionary and configuration size (Must match include/zmk/text_expander.h)
+DEFAULT_MAX_SHORT_LEN = 16
+TEXT_EXPANDER_EVENT_SIZE = 8
+OVERLAY_CURSOR_SIZE = 4
+
+# Characters every layout types outside its keycode_lut (Must match char_to_keycode() in src/layouts/)
+LAYOUT_EXTRA_CHARS = ("\n", "\t", "\b")
 
 class TrieNode:
     """Represents a node in the trie during the Python build process."""
+    # Slots keep the build lean: a dictionary of 100k short codes has hundreds of thousands of nodes
+    __slots__ = ("children", "is_terminal", "expanded_text", "preserve_trigger", "expanded_len_chars", "short_code",
+                 "weight", "edge_label", "dictionary", "variants", "heat", "bytecode", "autocorrect", "keep_len",
+                 "c_struct_data", "ac_fail", "ac_output", "ac_depth", "top_completions", "dictionary_mask")
+
     def __init__(self):
         self.children = {}
         self.is_terminal = False
         self.expanded_text = None
         self.preserve_trigger = True 
         self.expanded_len_chars = 0
+        self.short_code = None
+        self.weight = 0
+        # Radix mode: characters of the incoming edge after the one that selects this node
+        self.edge_label = ""
+        # Stacked dictionaries: the dictionary this definition belongs to, and the
+        # same short code's definitions in lower-priority dictionaries, highest first
+        self.dictionary = 0
+        self.variants = ()
+        # Usage profile: how often this node was reached plus how often it expanded
+        self.heat = 0
+        # Compiled expansion text, with fragment references resolved
+        self.bytecode = b""
+        # Autocorrect entries: bytes of the short code the expansion starts with,
+        # left on screen and dropped from the stored text
+        self.autocorrect = False
+        self.keep_len = 0
+
+class Fragment:
+    """
+    A passage of expansion text stored once: defined in DT and included with
+    {{ref:name}}, or a repeat factored out of several expansions (name None).
+    """
+    def __init__(self, name, text=None):
+        self.name = name
+        self.text = text
+        self.bytecode = None
+        self.logical_len = 0
+        # Set when the fragment is stored once and called; otherwise references copy it in
+        self.index = None
+        # Return positions the expansion engine needs to type the fragment
+        self.depth = 1
+        self.compiling = False
 
-def compile_text_to_bytecode(text):
+# A run of text without anything compile_text_to_bytecode() has to look at more closely
+PLAIN_TEXT_RUN = re.compile("[^{\\\\%c%c]+" % (OP_CALL, OP_KEEP))
+
+def compile_text_to_bytecode(text, fragments=None):
     """
     Compiles user text into bytecode and returns (bytecode, logical_char_count).
     Handles:
@@ -35,6 +132,8 @@ def compile_text_to_bytecode(text):
     - Single escapes: \{
     - OS Commands: {{cmd:win}}, etc. (Zero logical length)
     - Unicode Codepoints: {{u:XXXX}} (One logical char)
+    - Fragment references: {{ref:name}} (The fragment's logical length), looked
+      up in fragments ({name: Fragment}); see compile_fragments()
     """
     if text is None:
         return b"", 0
@@ -51,6 +150,13 @@ def compile_text_to_bytecode(text):
     length = len(text)
     
     while i < length:
+        run = PLAIN_TEXT_RUN.match(text, i)
+        if run:
+            result.extend(run.group().encode('utf-8'))
+            logical_len += run.end() - i
+            i = run.end()
+            continue
+
         # 1. Handle Literal Blocks: {{{ content }}}
         if text.startswith("{{{", i):
             end_idx = text.find("}}}", i + 3)
@@ -86,7 +192,22 @@ def compile_text_to_bytecode(text):
         if match_found:
             continue
 
-        # 4. Handle Unicode Escapes: {{u:XXXX}}
+        # 4. Handle Fragment References: {{ref:name}}
+        if text.startswith("{{ref:", i):
+            end_ref = text.find("}}", i + 6)
+            if end_ref == -1:
+                print(f"Error: Unclosed {{{{ref: tag at index {i} of '{text}'.", file=sys.stderr)
+                sys.exit(1)
+            fragment = get_fragment(fragments or {}, text[i+6:end_ref])
+            if fragment.index is None:
+                result.extend(fragment.bytecode)
+            else:
+                result.extend(bytes([OP_CALL, fragment.index]))
+            logical_len += fragment.logical_len
+            i = end_ref + 2
+            continue
+
+        # 5. Handle Unicode Escapes: {{u:XXXX}}
         if text.startswith("{{u:", i):
             end_u = text.find("}}", i + 4)
             if end_u != -1:
@@ -104,14 +225,121 @@ def compile_text_to_bytecode(text):
             else:
                  print(f"Warning: Unclosed {{u: tag at index {i}.", file=sys.stderr)
 
-        # 5. Standard Character
+        # 6. Standard Character
         char_bytes = text[i].encode('utf-8')
+        if char_bytes in (bytes([OP_CALL]), bytes([OP_KEEP])):
+            print(f"Warning: Control character 0x{char_bytes[0]:02x} at index {i} cannot be typed. Skipping.", file=sys.stderr)
+            i += 1
+            continue
         result.extend(char_bytes)
         logical_len += 1
         i += 1
         
     return result, logical_len
 
+def get_fragment(fragments, name):
+    """Returns a referenced fragment, compiling it (and what it references) on first use."""
+    fragment = fragments.get(name)
+    if fragment is None:
+        print(f"Error: Unknown fragment '{name}'. Define it in a child node with fragment = \"{name}\".", file=sys.stderr)
+        sys.exit(1)
+    if fragment.bytecode is None:
+        if fragment.compiling:
+            print(f"Error: The fragment '{name}' references itself.", file=sys.stderr)
+            sys.exit(1)
+        fragment.compiling = True
+        fragment.bytecode, fragment.logical_len = compile_text_to_bytecode(fragment.text, fragments)
+        fragment.compiling = False
+        if fragment.index is not None:
+            fragment.depth = 1 + fragment_call_depth(fragment.bytecode, fragments)
+    return fragment
+
+def compile_fragments(fragment_texts, share):
+    """
+    Compiles the fragments defined in DT ({name: text}). With share, each one
+    gets an index, in name order, and references call it; otherwise they copy
+    the fragment into the expansion. Returns {name: Fragment}.
+    """
+    if share and len(fragment_texts) > FRAGMENT_MAX_COUNT:
+        print(f"Error: {len(fragment_texts)} fragments are defined; at most {FRAGMENT_MAX_COUNT} are supported.", file=sys.stderr)
+        sys.exit(1)
+    fragments = {name: Fragment(name, text) for name, text in fragment_texts.items()}
+    if share:
+        for index, name in enumerate(sorted(fragments)):
+            fragments[name].index = index
+    for name in sorted(fragments):
+        get_fragment(fragments, name)
+    return fragments
+
+class TextFeatures:
+    """What typing a dictionary's expansions takes; see generate_trie_header() and typing_cost()."""
+    def __init__(self):
+        self.unicode = False
+        self.os_commands = set()
+        self.newline = False
+        self.tab = False
+        self.max_expansion_len = 0
+        self.expansions = []
+
+class TypedExpansion:
+    """One expansion as the expansion engine types it, with fragment calls resolved."""
+    def __init__(self, short_code, dictionary, text, keep_len, preserve_trigger):
+        self.short_code = short_code
+        self.dictionary = dictionary
+        self.text = text
+        self.keep_len = keep_len
+        self.preserve_trigger = preserve_trigger
+
+def split_fragment_calls(bytecode):
+    """Splits bytecode into its plain runs (bytes) and the fragment indices it calls (int), in order."""
+    segments, start, i = [], 0, 0
+    while i < len(bytecode):
+        if bytecode[i] == OP_CALL:
+            if i > start:
+                segments.append(bytes(bytecode[start:i]))
+            segments.append(bytecode[i + 1])
+            i += 2
+            start = i
+        else:
+            i += 1
+    if start < len(bytecode):
+        segments.append(bytes(bytecode[start:]))
+    return segments
+
+def join_fragment_calls(segments):
+    return b"".join(bytes([OP_CALL, segment]) if isinstance(segment, int) else segment for segment in segments)
+
+def fragment_call_depth(bytecode, fragments):
+    """Return positions needed to type the fragments bytecode calls; 0 if it calls none."""
+    depth_by_index = {fragment.index: fragment.depth for fragment in fragments.values()}
+    return max((depth_by_index[segment] for segment in split_fragment_calls(bytecode) if isinstance(segment, int)), default=0)
+
+def inline_fragment_calls(bytecode, fragments_by_index):
+    """Returns bytecode with every fragment call replaced by the fragment's text."""
+    if OP_CALL not in bytecode:
+        return bytes(bytecode)
+    return b"".join(inline_fragment_calls(fragments_by_index[segment].bytecode, fragments_by_index) if isinstance(segment, int) else segment
+                    for segment in split_fragment_calls(bytecode))
+
+def scan_text_features(terminals, fragment_list):
+    """
+    Records what the expansion engine needs to type the compiled expansions,
+    fragments included. Autocorrect entries count without the part they keep
+    on screen, which is never typed. Returns a TextFeatures.
+    """
+    features = TextFeatures()
+    fragments_by_index = {fragment.index: fragment for fragment in fragment_list}
+    for py_node in terminals:
+        text = inline_fragment_calls(py_node.bytecode, fragments_by_index)
+        features.unicode |= max(text, default=0) >= 0x80
+        features.os_commands |= {opcode for opcode in (OP_CMD_WIN, OP_CMD_MAC, OP_CMD_LINUX) if opcode in text}
+        features.newline |= ord("\n") in text
+        features.tab |= ord("\t") in text
+        features.max_expansion_len = max(features.max_expansion_len, py_node.expanded_len_chars)
+        features.expansions.append(TypedExpansion(py_node.short_code, py_node.dictionary, text.decode("utf-8"),
+                                                  py_node.keep_len, py_node.preserve_trigger))
+    return features
+
 def build_trie_from_expansions(expansions):
     """Builds a Python-based trie from the dictionary of expansions."""
     root = TrieNode()
@@ -124,37 +352,224 @@ def build_trie_from_expansions(expansions):
         node.is_terminal = True
         node.expanded_text = expansion_data['text']
         node.preserve_trigger = expansion_data['preserve_trigger']
+        node.autocorrect = expansion_data.get('autocorrect', False)
+        node.short_code = short_code
+        node.weight = expansion_data.get('weight', 0)
+        node.dictionary = expansion_data.get('dictionary', 0)
+        node.variants = []
+        for variant_data in expansion_data.get('variants', []):
+            variant = TrieNode()
+            variant.is_terminal = True
+            variant.expanded_text = variant_data['text']
+            variant.preserve_trigger = variant_data['preserve_trigger']
+            variant.autocorrect = variant_data.get('autocorrect', False)
+            variant.short_code = short_code
+            variant.dictionary = variant_data['dictionary']
+            node.variants.append(variant)
     return root
 
-def parse_dts_for_expansions(dts_path_str):
-    """Parses the given DTS file to find and extract text expansion definitions."""
+def collapse_single_child_chains(root):
+    """
+    Radix mode: folds every run of non-terminal nodes with a single child into
+    the edge above it. The first character of an edge still selects the child;
+    the rest becomes the child's edge_label.
+    """
+    stack = [root]
+    while stack:
+        py_node = stack.pop()
+        for char, child in list(py_node.children.items()):
+            label = ""
+            while not child.is_terminal and len(child.children) == 1:
+                (next_char, grandchild), = child.children.items()
+                label += next_char
+                child = grandchild
+            child.edge_label = label
+            py_node.children[char] = child
+            stack.append(child)
+
+def add_definition(definitions, short_code, text, preserve_trigger, weight=0, autocorrect=False, dictionary=0):
+    """
+    Adds one expansion to definitions ({short_code: {dictionary: definition}}),
+    replacing an earlier one for the same short code and dictionary.
+    """
+    short_code = short_code.lower()
+    if ' ' in short_code:
+        print(f"Warning: The short code '{short_code}' contains a space. Skipping.", file=sys.stderr)
+        return
+    if not 0 <= dictionary < DICTIONARY_COUNT:
+        print(f"Error: The short code '{short_code}' is in dictionary {dictionary}; dictionaries are numbered 0 to {DICTIONARY_COUNT - 1}.", file=sys.stderr)
+        sys.exit(1)
+    definitions.setdefault(short_code, {})[dictionary] = {
+        "text": text,
+        "preserve_trigger": preserve_trigger,
+        "weight": weight,
+        "autocorrect": autocorrect,
+        "dictionary": dictionary,
+    }
+
+def rank_definitions(definitions):
+    """
+    The expansions to build the trie from: each short code's definition in its
+    highest dictionary, with those in lower dictionaries as its variants.
+    """
     expansions = {}
+    for short_code, by_dictionary in definitions.items():
+        ranked = [by_dictionary[d] for d in sorted(by_dictionary, reverse=True)]
+        expansions[short_code] = dict(ranked[0], variants=ranked[1:])
+    return expansions
+
+def parse_flag(value):
+    """A boolean column of an imported dictionary: true/false, yes/no, 1/0, or empty for false."""
+    if isinstance(value, bool):
+        return value
+    text = str(value).strip().lower()
+    if text in ("1", "true", "yes", "y"):
+        return True
+    if text in ("", "0", "false", "no", "n"):
+        return False
+    raise ValueError(f"'{value}' is not a boolean")
+
+def read_csv_entries(path):
+    """Rows of a CSV file whose header names the columns after the child node properties."""
+    with open(path, newline='', encoding='utf-8') as f:
+        reader = csv.DictReader(f)
+        missing = {"short-code", "expanded-text"} - set(reader.fieldnames or [])
+        if missing:
+            raise ValueError(f"missing the column(s) {', '.join(sorted(missing))}")
+        for row in reader:
+            yield f"line {reader.line_num}", row
+
+def read_json_entries(path):
+    """A list of objects keyed like the child node properties, or an object mapping short codes to texts."""
+    with open(path, encoding='utf-8') as f:
+        document = json.load(f)
+    if isinstance(document, dict):
+        for short_code, text in document.items():
+            yield f"'{short_code}'", {"short-code": short_code, "expanded-text": text}
+    elif isinstance(document, list):
+        for i, entry in enumerate(document):
+            if not isinstance(entry, dict):
+                raise ValueError(f"entry {i} is not an object")
+            yield f"entry {i}", entry
+    else:
+        raise ValueError("expected a list of objects or an object")
+
+def read_espanso_entries(path):
+    """
+    The plain text matches of an espanso match file. The leading ':' espanso
+    triggers conventionally start with is dropped, as is the $|$ cursor hint;
+    matches with variables, forms or images are skipped.
+    """
+    try:
+        import yaml
+    except ImportError:
+        raise ValueError("reading YAML needs PyYAML (pip install pyyaml)")
+    with open(path, encoding='utf-8') as f:
+        try:
+            document = yaml.safe_load(f) or {}
+        except yaml.YAMLError as e:
+            raise ValueError(str(e)) from e
+    if not isinstance(document, dict):
+        raise ValueError("expected a mapping with a 'matches' list")
+    for i, match in enumerate(document.get("matches") or []):
+        triggers = match.get("triggers") or [match.get("trigger")]
+        text = match.get("replace")
+        if not isinstance(text, str) or "vars" in match:
+            print(f"Warning: Skipping espanso match {i} in '{path}': only plain 'replace' texts can be imported.", file=sys.stderr)
+            continue
+        for trigger in triggers:
+            if isinstance(trigger, str) and trigger:
+                yield f"match {i}", {"short-code": trigger[1:] if trigger.startswith(":") else trigger,
+                                     "expanded-text": text.replace("$|$", "")}
+
+def import_dictionary_file(path, definitions, preserve_default):
+    """
+    Adds the expansions of a CSV, JSON or espanso YAML file to definitions.
+    Entries use the child node property names; preserve_default applies to
+    those that set neither preserve-trigger nor disable-preserve-trigger.
+    """
+    readers = {".csv": read_csv_entries, ".json": read_json_entries, ".yml": read_espanso_entries, ".yaml": read_espanso_entries}
+    reader = readers.get(Path(path).suffix.lower())
+    if reader is None:
+        print(f"Error: The dictionary file '{path}' is not a .csv, .json, .yml or .yaml file.", file=sys.stderr)
+        sys.exit(1)
+    try:
+        for where, entry in reader(path):
+            try:
+                short_code, text = entry.get("short-code"), entry.get("expanded-text")
+                if not isinstance(short_code, str) or not short_code or not isinstance(text, str):
+                    raise ValueError("a short-code and an expanded-text are required")
+                preserve_trigger = preserve_default
+                if parse_flag(entry.get("preserve-trigger", False)):
+                    preserve_trigger = True
+                elif parse_flag(entry.get("disable-preserve-trigger", False)):
+                    preserve_trigger = False
+                add_definition(definitions, short_code, text, preserve_trigger, int(entry.get("weight") or 0),
+                               parse_flag(entry.get("autocorrect", False)), int(entry.get("dictionary") or 0))
+            except (TypeError, ValueError) as e:
+                raise ValueError(f"{where}: {e}") from e
+    except (OSError, ValueError, csv.Error) as e:
+        print(f"Error: Cannot import the dictionary file '{path}': {e}", file=sys.stderr)
+        sys.exit(1)
+
+def parse_dts_for_expansions(dts_path_str, import_paths=(), import_base="."):
+    """
+    Parses the given DTS file to find and extract text expansion definitions,
+    and imports the dictionary files given in import_paths and the expander
+    node's dictionary-files property (relative to import_base), in that order.
+    A later file replaces an earlier file's entry for the same short code and
+    dictionary, and a child node replaces any imported one.
+    A short code defined in several dictionaries maps to its definition in the
+    highest one, with the others listed under "variants", highest first.
+    Returns (expansions, fragments, properties, imported): fragments maps each
+    fragment name to its text, properties holds the names of the properties
+    set on the text expander node and imported lists the files read.
+    """
+    # Imported here so the table builders can be used without Zephyr's scripts, e.g. by bench/engines.py
+    try:
+        from devicetree import dtlib
+    except ImportError:
+        print("Error: The 'dtlib' library is required but could not be imported.", file=sys.stderr)
+        print("       This may be an issue with the PYTHONPATH environment for the build command.", file=sys.stderr)
+        sys.exit(1)
+
+    definitions = {}
+    fragments = {}
+    properties = set()
+    imported = list(import_paths)
+    preserve_default = True
     try:
         dt = dtlib.DT(dts_path_str)
 
         def process_expander_node(expander_node):
+            nonlocal preserve_default
             global_preserve_default = "disable-preserve-trigger" not in expander_node.props
+            preserve_default = global_preserve_default
+            properties.update(expander_node.props)
+            if "dictionary-files" in expander_node.props:
+                imported.extend(str(Path(import_base) / path) for path in expander_node.props["dictionary-files"].to_strings())
 
             for child in expander_node.nodes.values():
-                if "short-code" in child.props and "expanded-text" in child.props:
-                    short_code = child.props["short-code"].to_string().lower()
-                    
-                    if ' ' in short_code:
-                        print(f"Warning: The short code '{short_code}' contains a space. Skipping.", file=sys.stderr)
-                        continue
-
-                    expanded_text = child.props["expanded-text"].to_string()
+                if "fragment" in child.props and "expanded-text" in child.props:
+                    name = child.props["fragment"].to_string()
+                    if name in fragments:
+                        print(f"Error: The fragment '{name}' is defined more than once.", file=sys.stderr)
+                        sys.exit(1)
+                    fragments[name] = child.props["expanded-text"].to_string()
+                    continue
 
+                if "short-code" in child.props and "expanded-text" in child.props:
                     final_preserve_setting = global_preserve_default
                     if "preserve-trigger" in child.props:
                         final_preserve_setting = True
                     elif "disable-preserve-trigger" in child.props:
                         final_preserve_setting = False
 
-                    expansions[short_code] = {
-                        "text": expanded_text, 
-                        "preserve_trigger": final_preserve_setting
-                    }
+                    add_definition(definitions, child.props["short-code"].to_string(), child.props["expanded-text"].to_string(),
+                                   final_preserve_setting,
+                                   child.props["weight"].to_num() if "weight" in child.props else 0,
+                                   "autocorrect" in child.props,
+                                   child.props["dictionary"].to_num() if "dictionary" in child.props else 0)
 
         for node in dt.node_iter():
             if "compatible" not in node.props:
@@ -173,7 +588,14 @@ def parse_dts_for_expansions(dts_path_str):
     except Exception as e:
         print(f"Error parsing DTS file with dtlib: {e}", file=sys.stderr)
 
-    return expansions
+    if imported:
+        node_definitions, definitions = definitions, {}
+        for path in imported:
+            import_dictionary_file(path, definitions, preserve_default)
+        for short_code, by_dictionary in node_definitions.items():
+            definitions.setdefault(short_code, {}).update(by_dictionary)
+
+    return rank_definitions(definitions), fragments, properties, imported
 
 def get_next_power_of_2(n):
     if n == 0: return 1
@@ -194,38 +616,517 @@ def escape_for_c_string(byte_data):
         else: result.append(f'\\{byte:03o}')
     return "".join(result)
 
-def generate_static_trie_c_code(expansions):
-    if not expansions:
-        return """
-#include <zmk/trie.h>
-#include <stddef.h>
-const uint16_t zmk_text_expander_trie_num_nodes = 0;
-const struct trie_node zmk_text_expander_trie_nodes[] = {};
-const struct trie_hash_table zmk_text_expander_hash_tables[] = {};
-const struct trie_hash_entry zmk_text_expander_hash_entries[] = {};
-const uint16_t zmk_text_expander_hash_buckets[] = {};
-const char zmk_text_expander_string_pool[] = "";
-const char *zmk_text_expander_get_string(uint16_t offset) { return NULL; }
-"""
-    root = build_trie_from_expansions(expansions)
+ENCODING_HASH = "hash"
+ENCODING_DOUBLE_ARRAY = "double-array"
+ENCODING_PERFECT_HASH = "perfect-hash"
+ENCODING_BITMAP = "bitmap"
+ENCODING_SWAR = "swar"
+ENCODING_FLAT_HASH = "flat-hash"
+ENCODINGS = [ENCODING_HASH, ENCODING_DOUBLE_ARRAY, ENCODING_PERFECT_HASH, ENCODING_BITMAP, ENCODING_SWAR, ENCODING_FLAT_HASH]
 
-    string_pool_builder = bytearray()
-    c_trie_nodes, c_hash_tables, c_hash_buckets, c_hash_entries = [], [], [], []
-    node_q, node_map = [root], {id(root): 0}
+# Flash dictionary image (Must match include/zmk/trie_image.h). The image is a
+# header followed by the generated tables, each at an 8-byte aligned offset
+# from the start of the image and laid out exactly as the C declarations.
+IMAGE_MAGIC = 0x45585A54  # "TZXE" in little-endian byte order
+IMAGE_VERSION = 4
+IMAGE_TABLE_ALIGN = 8
+IMAGE_ENCODING_IDS = {ENCODING_HASH: 0, ENCODING_DOUBLE_ARRAY: 1, ENCODING_PERFECT_HASH: 2, ENCODING_BITMAP: 3, ENCODING_SWAR: 4,
+                      ENCODING_FLAT_HASH: 5}
+IMAGE_FLAG_RADIX = 0x01
+IMAGE_FLAG_AHO_CORASICK = 0x02
+IMAGE_FLAG_COMPRESSED_POOL = 0x04
+IMAGE_FLAG_PREFIX_COMPLETION = 0x08
+IMAGE_FLAG_STACKED_DICTIONARIES = 0x10
+IMAGE_FLAG_FUZZY_MATCH = 0x20
+IMAGE_FLAG_FRAGMENTS = 0x40
+
+TABLE_NODES = 0
+TABLE_STRING_POOL = 1
+TABLE_DA_BASE = 2
+TABLE_DA_CHECK = 3
+TABLE_HASH_TABLES = 4
+TABLE_HASH_ENTRIES = 5
+TABLE_HASH_BUCKETS = 6
+TABLE_BITMAP_ALPHABET = 7
+TABLE_POOL_DICT = 8
+TABLE_POOL_DICT_OFFSETS = 9
+TABLE_AC_FAIL = 10
+TABLE_AC_OUTPUT = 11
+TABLE_AC_DEPTH = 12
+TABLE_TOP_COMPLETIONS = 13
+TABLE_SHORT_CODE_ALPHABET = 14
+TABLE_SWAR_KEYS = 15
+TABLE_FRAGMENT_OFFSETS = 16
+TABLE_COUNT = 17
+
+# magic, version, header_size, layout, image_size, num_nodes, max_short_len, top_k,
+# reserved, payload_crc, then (offset, size) per table and finally header_crc.
+IMAGE_HEADER_FORMAT = "<IHHIIIBBHI" + "II" * TABLE_COUNT + "I"
+
+# Sizes of the scalar field types of the generated tables. "index" and "offset"
+# stand for trie_index_t and trie_offset_t, whose widths depend on the dictionary.
+SCALAR_SIZES = {"char": 1, "bool": 1, "uint8_t": 1, "uint16_t": 2, "uint32_t": 4, "uint64_t": 8}
+PACK_CODES = {1: "B", 2: "H", 4: "I", 8: "Q"}
 
+# Upper bound on multipliers tried per table size before the perfect-hash search grows the table.
+PERFECT_HASH_SEED_ATTEMPTS = 4096
+
+# Substring lengths considered for the string pool dictionary. Entries are capped
+# at 32 bytes so the decoder only needs a one-byte remaining-length counter.
+POOL_DICT_CANDIDATE_LENGTHS = (3, 4, 5, 6, 7, 8, 10, 12, 14, 16, 20, 24, 28, 32)
+# One index value is reserved for escaping a literal OP_DICT byte.
+POOL_DICT_MAX_ENTRIES = DICT_LITERAL_ESCAPE
+POOL_DICT_PARSE_ROUNDS = 3
+
+def dict_entry_gain(length, uses):
+    """Bytes saved by a dictionary entry: each use costs a 2-byte reference, the entry costs its bytes plus an offset."""
+    return uses * (length - 2) - (length + 2)
+
+def build_pool_dictionary(bytecodes):
+    """
+    Selects repeated substrings of the expansion bytecodes for the compressed string pool.
+    Candidates are picked greedily by estimated gain over the text not yet covered
+    by earlier picks; gains only shrink as coverage grows, so stale heap entries
+    are re-scored lazily. Returns a list of bytes objects.
+    """
+    buf = bytes(b"\0".join(bytecodes))
+    positions = {}
+    for length in POOL_DICT_CANDIDATE_LENGTHS:
+        for start in range(len(buf) - length + 1):
+            sub = buf[start:start + length]
+            if 0 in sub:
+                continue
+            positions.setdefault(sub, []).append(start)
+
+    heap = []
+    for sub, starts in positions.items():
+        gain = dict_entry_gain(len(sub), len(starts))
+        if len(starts) > 1 and gain > 0:
+            heap.append((-gain, sub))
+    heapq.heapify(heap)
+
+    covered = bytearray(len(buf))
+    selected = []
+    while heap and len(selected) < POOL_DICT_MAX_ENTRIES:
+        _, sub = heapq.heappop(heap)
+        length = len(sub)
+        uses, next_free, free_starts = 0, 0, []
+        for start in positions[sub]:
+            if start >= next_free and covered.find(1, start, start + length) == -1:
+                uses += 1
+                next_free = start + length
+                free_starts.append(start)
+        gain = dict_entry_gain(length, uses)
+        if gain <= 0:
+            continue
+        if heap and gain < -heap[0][0]:
+            heapq.heappush(heap, (-gain, sub))
+            continue
+        selected.append(sub)
+        for start in free_starts:
+            covered[start:start + length] = b"\1" * length
+    return selected
+
+def compress_bytecode(bytecode, dictionary):
+    """
+    Encodes one expansion with the dictionary using a minimal-size parse.
+    Returns (encoded_bytes, used_entry_indices).
+    """
+    lookup = {sub: i for i, sub in enumerate(dictionary)}
+    lengths = sorted({len(sub) for sub in dictionary})
+    n = len(bytecode)
+    cost = [0] * (n + 1)
+    choice = [None] * (n + 1)
+    for i in range(n - 1, -1, -1):
+        cost[i] = cost[i + 1] + (2 if bytecode[i] == OP_DICT else 1)
+        choice[i] = None
+        for length in lengths:
+            if i + length > n:
+                break
+            index = lookup.get(bytes(bytecode[i:i + length]))
+            if index is not None and cost[i + length] + 2 < cost[i]:
+                cost[i] = cost[i + length] + 2
+                choice[i] = index
+
+    encoded, used = bytearray(), []
+    i = 0
+    while i < n:
+        if choice[i] is not None:
+            encoded += bytes([OP_DICT, choice[i]])
+            used.append(choice[i])
+            i += len(dictionary[choice[i]])
+        elif bytecode[i] == OP_DICT:
+            encoded += bytes([OP_DICT, DICT_LITERAL_ESCAPE])
+            i += 1
+        else:
+            encoded.append(bytecode[i])
+            i += 1
+    return bytes(encoded), used
+
+def finalize_pool_dictionary(bytecodes):
+    """
+    Builds the dictionary, then drops entries the actual parse does not use
+    often enough to pay for themselves and re-parses.
+    """
+    dictionary = build_pool_dictionary(bytecodes)
+    for _ in range(POOL_DICT_PARSE_ROUNDS):
+        uses = [0] * len(dictionary)
+        for bytecode in bytecodes:
+            for index in compress_bytecode(bytecode, dictionary)[1]:
+                uses[index] += 1
+        kept = [sub for sub, count in zip(dictionary, uses) if dict_entry_gain(len(sub), count) > 0]
+        if len(kept) == len(dictionary):
+            break
+        dictionary = kept
+    return dictionary
+
+def fragment_gain(length, uses):
+    """Bytes saved by a fragment: each use costs a 2-byte call, the fragment its bytes, a terminator and a (at most 4-byte) offset."""
+    return uses * (length - 2) - (length + 1 + 4)
+
+def find_repeated_passages(runs):
+    """
+    Lists the passages of at least FRAGMENT_MIN_LEN bytes that occur more
+    than once in runs (plain bytes), each grown as far as all its
+    occurrences agree. A seed whose occurrences all follow the same byte
+    lies inside a longer repeat, so only left-maximal seeds are grown.
+    Returns {passage: occurrences}, counting overlapping ones.
+    """
+    seeds = {}
+    for r, run in enumerate(runs):
+        for start in range(len(run) - FRAGMENT_MIN_LEN + 1):
+            seeds.setdefault(run[start:start + FRAGMENT_MIN_LEN], []).append((r, start))
+
+    passages = {}
+    for places in seeds.values():
+        if len(places) < 2:
+            continue
+        before = {runs[r][start - 1] if start > 0 else None for r, start in places}
+        if len(before) == 1 and None not in before:
+            continue
+        r0, start0 = places[0]
+        length = FRAGMENT_MIN_LEN
+        while all(start + length < len(runs[r]) and runs[r][start + length] == runs[r0][start0 + length] for r, start in places):
+            length += 1
+        passage = runs[r0][start0:start0 + length]
+        passages[passage] = max(passages.get(passage, 0), len(places))
+    return passages
+
+def factor_repeated_fragments(py_nodes, fragments):
+    """
+    Moves passages repeated across the expansions into fragments of their
+    own, best saving first, while one still pays for itself and fragment
+    indices remain. Like the pool dictionary, savings only shrink as
+    passages are taken out, so stale candidates are re-scored lazily. Only
+    the expansions are factored, so a new fragment is called from the top
+    level and never nests. Returns the new fragments.
+    """
+    texts = [split_fragment_calls(py_node.bytecode) for py_node in py_nodes]
+
+    def plain_runs():
+        return [segment for segments in texts for segment in segments if isinstance(segment, bytes)]
+
+    # Plain runs never contain a 0, so a passage found in the joined runs lies within one of them
+    runs = plain_runs()
+    joined_runs = b"\0".join(runs)
+    # Occurrence counts only overestimate the uses, so they are fine as first scores
+    heap = [(-fragment_gain(len(passage), occurrences), passage) for passage, occurrences in find_repeated_passages(runs).items()]
+    heap = [entry for entry in heap if entry[0] < 0]
+    heapq.heapify(heap)
+
+    added = []
+    while heap and len(fragments) + len(added) < FRAGMENT_MAX_COUNT:
+        _, passage = heapq.heappop(heap)
+        gain = fragment_gain(len(passage), joined_runs.count(passage))
+        if gain <= 0:
+            continue
+        if heap and gain < -heap[0][0]:
+            heapq.heappush(heap, (-gain, passage))
+            continue
+
+        fragment = Fragment(None)
+        fragment.bytecode = passage
+        fragment.index = len(fragments) + len(added)
+        added.append(fragment)
+        for segments in texts:
+            factored = []
+            for segment in segments:
+                if isinstance(segment, int):
+                    factored.append(segment)
+                    continue
+                for i, piece in enumerate(segment.split(passage)):
+                    if i > 0:
+                        factored.append(fragment.index)
+                    if piece:
+                        factored.append(piece)
+            segments[:] = factored
+        joined_runs = b"\0".join(plain_runs())
+
+    for py_node, segments in zip(py_nodes, texts):
+        py_node.bytecode = join_fragment_calls(segments)
+    return added
+
+def order_nodes_bfs(root):
+    """
+    Returns all nodes in breadth-first order, root first, with the children of
+    each node in character order so the layout only depends on the dictionary.
+    """
+    node_q, seen = [root], {id(root)}
     head = 0
     while head < len(node_q):
         py_node = node_q[head]
         head += 1
-        for child in sorted(py_node.children.values(), key=id): 
-            if id(child) not in node_map:
-                node_map[id(child)] = len(node_map)
+        for _, child in sorted(py_node.children.items()):
+            if id(child) not in seen:
+                seen.add(id(child))
                 node_q.append(child)
+    return node_q
+
+def parse_usage_profile(path):
+    """
+    Reads a usage profile as printed by the "text_expander profile dump" shell
+    command: one "<prefix> <visits> <hits>" line per trie node, where prefix is
+    the characters that lead to the node with bytes outside printable ASCII and
+    backslashes written as \\xHH. Lines starting with # are comments.
+    Returns {prefix: visits + hits}.
+    """
+    profile = {}
+    try:
+        with open(path, encoding='ascii') as f:
+            for line_number, line in enumerate(f, 1):
+                line = line.strip()
+                if not line or line.startswith('#'):
+                    continue
+                fields = line.split()
+                try:
+                    if len(fields) != 3:
+                        raise ValueError
+                    prefix = re.sub(r'\\x([0-9a-fA-F]{2})', lambda m: chr(int(m.group(1), 16)), fields[0])
+                    prefix = prefix.encode('latin-1').decode('utf-8')
+                    profile[prefix] = profile.get(prefix, 0) + int(fields[1]) + int(fields[2])
+                except ValueError:
+                    print(f"Error: {path}:{line_number}: expected '<prefix> <visits> <hits>'.", file=sys.stderr)
+                    sys.exit(1)
+    except OSError as e:
+        print(f"Error: Cannot read usage profile: {e}", file=sys.stderr)
+        sys.exit(1)
+    return profile
+
+def assign_node_heat(root, profile):
+    """Records each node's count from the profile; prefixes no longer in the dictionary are ignored."""
+    stack = [(root, "")]
+    while stack:
+        py_node, prefix = stack.pop()
+        py_node.heat = profile.get(prefix, 0)
+        for char, child in py_node.children.items():
+            stack.append((child, prefix + char + child.edge_label))
+
+def order_nodes_by_heat(bfs_nodes):
+    """
+    Profile-guided layout: the nodes the profile saw, depth first with the
+    hottest child first so that the path of a frequently typed short code
+    occupies consecutive rows, followed by the other nodes in breadth-first
+    order. Parents still come before their children, and equally hot
+    siblings stay in character order.
+    """
+    hot, stack = [], [bfs_nodes[0]]
+    while stack:
+        py_node = stack.pop()
+        hot.append(py_node)
+        children = sorted((item for item in py_node.children.items() if item[1].heat > 0),
+                          key=lambda item: (-item[1].heat, item[0]))
+        stack.extend(child for _, child in reversed(children))
+    hot_ids = {id(py_node) for py_node in hot}
+    return hot + [py_node for py_node in bfs_nodes if id(py_node) not in hot_ids]
+
+def shared_prefix_len(short_code, bytecode):
+    """
+    Autocorrect entries: returns how many bytes of the short code the compiled
+    expansion starts with, ending on a character boundary and at most 255.
+    """
+    typed = short_code.encode('utf-8')
+    keep = 0
+    while keep < min(len(typed), len(bytecode), 255) and typed[keep] == bytecode[keep]:
+        keep += 1
+    # Never keep part of a multi-byte character
+    while 0 < keep < len(bytecode) and (bytecode[keep] & 0xC0) == 0x80:
+        keep -= 1
+    return keep
+
+def compile_terminals(py_nodes, fragments):
+    """
+    Compiles each terminal's expansion. Autocorrect entries drop the part
+    they share with the short code; expanded_len_chars still counts the whole
+    expansion, which is what undo has to take back.
+    """
+    for py_node in py_nodes:
+        if py_node.is_terminal:
+            py_node.bytecode, py_node.expanded_len_chars = compile_text_to_bytecode(py_node.expanded_text, fragments)
+            if py_node.autocorrect:
+                py_node.keep_len = shared_prefix_len(py_node.short_code, py_node.bytecode)
+                py_node.bytecode = py_node.bytecode[py_node.keep_len:]
+
+def add_to_string_pool(bytecode, string_pool_builder, pool_offsets, pool_dictionary=None, keep_len=None):
+    """
+    Appends one entry to the string pool and returns its offset. With a
+    pool_dictionary, the plain runs between fragment calls are stored
+    compressed. An autocorrect entry (one with a keep_len, even 0) starts
+    with OP_KEEP <keep_len>, stored as is, which also tells the firmware not
+    to offer it as a typo correction. Identical entries share one copy.
+    """
+    if pool_dictionary is not None:
+        bytecode = join_fragment_calls(segment if isinstance(segment, int) else compress_bytecode(segment, pool_dictionary)[0]
+                                       for segment in split_fragment_calls(bytecode))
+    bytecode = bytes(bytecode)
+    if keep_len is not None:
+        bytecode = bytes([OP_KEEP, keep_len]) + bytecode
+    if bytecode not in pool_offsets:
+        pool_offsets[bytecode] = len(string_pool_builder)
+        string_pool_builder.extend(bytecode)
+        string_pool_builder.append(0)
+    return pool_offsets[bytecode]
+
+def assign_node_payloads(py_nodes, string_pool_builder, pool_offsets, pool_dictionary=None):
+    """
+    Appends each terminal's compiled bytecode to the string pool and records the per-node payload fields.
+    """
+    for py_node in py_nodes:
+        expanded_text_offset = NULL_OFFSET
+        if py_node.is_terminal:
+            expanded_text_offset = add_to_string_pool(py_node.bytecode, string_pool_builder, pool_offsets, pool_dictionary,
+                                                     py_node.keep_len if py_node.autocorrect else None)
+
+        py_node.c_struct_data = {
+            "expanded_text_offset": expanded_text_offset,
+            "expanded_len_chars": py_node.expanded_len_chars,
+            "is_terminal": 1 if py_node.is_terminal else 0,
+            "preserve_trigger": 1 if py_node.preserve_trigger else 0,
+        }
+
+def assign_edge_labels(py_nodes, string_pool_builder):
+    """
+    Radix mode: appends each edge label to the string pool (unterminated, since
+    its length is stored) and records label_offset/label_len. Identical labels
+    are stored once.
+    """
+    label_offsets = {}
+    for py_node in py_nodes:
+        label = py_node.edge_label.encode("utf-8")
+        if len(label) > 255:
+            print(f"Error: Edge label '{py_node.edge_label}' is longer than 255 bytes.", file=sys.stderr)
+            sys.exit(1)
+        label_offset = NULL_OFFSET
+        if label:
+            if label not in label_offsets:
+                label_offsets[label] = len(string_pool_builder)
+                string_pool_builder.extend(label)
+            label_offset = label_offsets[label]
+        py_node.c_struct_data["label_offset"] = label_offset
+        py_node.c_struct_data["label_len"] = len(label)
+
+def build_aho_corasick_links(bfs_nodes):
+    """
+    Computes Aho-Corasick failure and output links over the goto trie. The
+    failure link of a node points to the node for its longest proper suffix
+    that is also a trie prefix; the output link points to the nearest terminal
+    along the failure chain. bfs_nodes must start with the root and list
+    parents before children.
+    """
+    root = bfs_nodes[0]
+    root.ac_fail, root.ac_output, root.ac_depth = root, None, 0
+    for py_node in bfs_nodes:
+        for char, child in py_node.children.items():
+            child.ac_depth = py_node.ac_depth + 1
+            if child.ac_depth > 255:
+                print("Error: Short codes longer than 255 characters are not supported in Aho-Corasick mode.", file=sys.stderr)
+                sys.exit(1)
+            fail = py_node.ac_fail
+            while fail is not root and char not in fail.children:
+                fail = fail.ac_fail
+            child.ac_fail = fail.children[char] if py_node is not root and char in fail.children else root
+            child.ac_output = child.ac_fail if child.ac_fail.is_terminal else child.ac_fail.ac_output
+
+def aho_corasick_link_rows(row_nodes):
+    """Returns the per-node (fail, output, depth) arrays, indexed like the node table; rows without a node get inert links."""
+    row_index = {id(py_node): i for i, py_node in enumerate(row_nodes) if py_node is not None}
+    fail, output, depth = [], [], []
+    for py_node in row_nodes:
+        if py_node is None:
+            fail.append(0)
+            output.append(NULL_INDEX)
+            depth.append(0)
+            continue
+        fail.append(row_index[id(py_node.ac_fail)])
+        output.append(row_index[id(py_node.ac_output)] if py_node.ac_output is not None else NULL_INDEX)
+        depth.append(py_node.ac_depth)
+    return fail, output, depth
 
-    c_trie_nodes = [None] * len(node_q)
-    for py_node in node_q:
-        c_trie_nodes[node_map[id(py_node)]] = py_node
+def completion_rank(py_node):
+    """Sort key for completions: higher weight first, then shorter and alphabetically earlier short codes."""
+    return (-py_node.weight, len(py_node.short_code), py_node.short_code)
 
+def build_dictionary_masks(bfs_nodes):
+    """Records in each node which dictionaries define a short code at or below it, children before parents."""
+    for py_node in reversed(bfs_nodes):
+        mask = 0
+        if py_node.is_terminal:
+            for definition in [py_node, *py_node.variants]:
+                mask |= 1 << definition.dictionary
+        for child in py_node.children.values():
+            mask |= child.dictionary_mask
+        py_node.dictionary_mask = mask
+
+def link_dictionary_variants(row_nodes, node_rows):
+    """
+    Appends the lower-priority definitions of every short code as node rows
+    that no edge leads to, chained from the trie node through next_variant in
+    priority order. The rows are appended to row_nodes as None, so per-node
+    tables give them inert entries.
+    """
+    for i in range(len(row_nodes)):
+        py_node, row = row_nodes[i], node_rows[i]
+        row["next_variant"] = NULL_INDEX
+        row["dictionary"] = py_node.dictionary if py_node is not None else 0
+        row["dictionary_mask"] = py_node.dictionary_mask if py_node is not None else 0
+        for variant in (py_node.variants if py_node is not None else []):
+            row["next_variant"] = len(node_rows)
+            row = dict(empty_node_row(), **variant.c_struct_data, dictionary=variant.dictionary)
+            node_rows.append(row)
+            row_nodes.append(None)
+
+def build_top_completions(bfs_nodes, k):
+    """
+    Stores in each node the k best terminals of its subtree. Children are
+    finished before their parents by walking the BFS order backwards, and each
+    node only merges its children's lists, so the whole pass is linear.
+    Autocorrect entries are never completed to: they fix a whole typed word.
+    """
+    for py_node in reversed(bfs_nodes):
+        candidates = [py_node] if py_node.is_terminal and not py_node.autocorrect else []
+        for child in py_node.children.values():
+            candidates.extend(child.top_completions)
+        py_node.top_completions = sorted(candidates, key=completion_rank)[:k]
+
+def top_completion_rows(row_nodes, k):
+    """Returns the fixed-stride table of completion node indices, padded with NULL_INDEX."""
+    row_index = {id(py_node): i for i, py_node in enumerate(row_nodes) if py_node is not None}
+    rows = []
+    for py_node in row_nodes:
+        best = [row_index[id(t)] for t in py_node.top_completions] if py_node is not None else []
+        rows.extend(best + [NULL_INDEX] * (k - len(best)))
+    return rows
+
+def short_code_alphabet(expansions):
+    """The distinct bytes short codes are spelled with, in order; fuzzy lookup tries each of them as a correction."""
+    return bytes(sorted({byte for short_code in expansions for byte in short_code.encode('utf-8')}))
+
+def build_hash_tables(c_trie_nodes, node_map):
+    """
+    Builds the per-node chained hash tables used by the default encoding.
+    Entries are pushed onto the front of their chain, coldest first, so the
+    hottest key of each bucket is compared first.
+    """
+    c_hash_tables, c_hash_buckets, c_hash_entries = [], [], []
     for py_node in c_trie_nodes:
         hash_table_index = NULL_INDEX
         if py_node.children:
@@ -236,7 +1137,7 @@ const char *zmk_text_expander_get_string(uint16_t offset) { return NULL; }
             buckets = [NULL_INDEX] * num_buckets
             c_hash_tables.append({"buckets_start_index": buckets_start_index, "num_buckets": num_buckets})
 
-            for char, child_py_node in sorted(py_node.children.items()):
+            for char, child_py_node in sorted(py_node.children.items(), key=lambda item: (item[1].heat, item[0])):
                 hash_val = ord(char) % num_buckets
                 child_node_index = node_map[id(child_py_node)]
                 new_entry_index = len(c_hash_entries)
@@ -244,65 +1145,907 @@ const char *zmk_text_expander_get_string(uint16_t offset) { return NULL; }
                 c_hash_entries.append({"key": char, "child_node_index": child_node_index, "next_entry_index": next_entry_index})
                 buckets[hash_val] = new_entry_index
             c_hash_buckets.extend(buckets)
+        py_node.c_struct_data["hash_table_index"] = hash_table_index
+    return c_hash_tables, c_hash_buckets, c_hash_entries
 
-        expanded_text_offset = NULL_INDEX
-        expanded_len_chars = 0
-        
-        if py_node.is_terminal:
-            current_pool_pos = len(string_pool_builder)
-            if current_pool_pos > 65535:
-                 print("Error: String pool exceeds 64KB limit (uint16_t overflow).", file=sys.stderr)
-                 sys.exit(1)
-            
-            bytecode, expanded_len_chars = compile_text_to_bytecode(py_node.expanded_text)
-            string_pool_builder.extend(bytecode)
-            string_pool_builder.append(0) 
-            expanded_text_offset = current_pool_pos
+def perfect_hash_slot(char_code, seed, num_slots):
+    """Slot of a key within a perfect-hash child table (Must match trie_get_child_index() in src/trie.c)."""
+    return (((char_code * seed) & 0xFFFF) * num_slots) >> 16
 
-        py_node.c_struct_data = {
-            "hash_table_index": hash_table_index,
-            "expanded_text_offset": expanded_text_offset,
-            "expanded_len_chars": expanded_len_chars,
-            "is_terminal": 1 if py_node.is_terminal else 0,
-            "preserve_trigger": 1 if py_node.preserve_trigger else 0,
-        }
+@lru_cache(maxsize=None)
+def find_perfect_hash(char_codes):
+    """
+    Searches for a multiplier that maps every key of a node to its own slot.
+    Tables start minimal (one slot per child) and only grow when no seed
+    separates the keys, which in practice only happens on wide upper nodes.
+    char_codes must be a tuple; nodes with the same key set share one search.
+    Returns (seed, num_slots).
+    """
+    n = len(char_codes)
+    for num_slots in range(n, 256):
+        for seed in range(1, 2 * PERFECT_HASH_SEED_ATTEMPTS, 2):
+            used = set()
+            for code in char_codes:
+                slot = perfect_hash_slot(code, seed, num_slots)
+                if slot in used:
+                    break
+                used.add(slot)
+            else:
+                return seed, num_slots
+    print(f"Error: No perfect hash found for a node with {n} children.", file=sys.stderr)
+    sys.exit(1)
 
-    c_parts = ["#include <zmk/trie.h>\n#include <stddef.h> // For NULL\n\n"]
-    c_parts.append(f"const uint16_t zmk_text_expander_trie_num_nodes = {len(c_trie_nodes)};\n\n")
+def build_perfect_hash_tables(c_trie_nodes, node_map):
+    """Builds collision-free child tables: one probe and one key compare per transition."""
+    c_hash_tables, c_hash_entries = [], []
+    for py_node in c_trie_nodes:
+        hash_table_index = NULL_INDEX
+        if py_node.children:
+            for char in py_node.children:
+                if not 0 < ord(char) < 256:
+                    print(f"Error: Short code character '{char}' cannot be used as a perfect-hash key (must be a single byte).", file=sys.stderr)
+                    sys.exit(1)
 
-    escaped_string_pool = escape_for_c_string(string_pool_builder)
-    c_parts.append(f'const char zmk_text_expander_string_pool[] = "{escaped_string_pool}";\n\n')
+            hash_table_index = len(c_hash_tables)
+            seed, num_slots = find_perfect_hash(tuple(sorted(ord(char) for char in py_node.children)))
+            entries_start_index = len(c_hash_entries)
+            entries = [{"key": None, "child_node_index": NULL_INDEX}] * num_slots
+            for char, child_py_node in py_node.children.items():
+                entries[perfect_hash_slot(ord(char), seed, num_slots)] = {"key": char, "child_node_index": node_map[id(child_py_node)]}
+            c_hash_tables.append({"entries_start_index": entries_start_index, "seed": seed, "num_slots": num_slots})
+            c_hash_entries.extend(entries)
+        py_node.c_struct_data["hash_table_index"] = hash_table_index
+    return c_hash_tables, c_hash_entries
 
-    c_parts.append("const struct trie_node zmk_text_expander_trie_nodes[] = {\n")
-    for py_node in c_trie_nodes:
-        d = py_node.c_struct_data
-        c_parts.append(f"    {{ .hash_table_index = {d['hash_table_index']}, .expanded_text_offset = {d['expanded_text_offset']}, .expanded_len_chars = {d['expanded_len_chars']}, .is_terminal = {d['is_terminal']}, .preserve_trigger = {d['preserve_trigger']} }},\n")
-    c_parts.append("};\n\n")
+def build_bitmap_alphabet(bfs_nodes):
+    """
+    Assigns a bitmap bit to every character used in a short code, in character
+    order, so that a child's rank among its siblings equals the popcount of the
+    bits below its own. Returns {char: bit}.
+    """
+    chars = sorted({char for py_node in bfs_nodes for char in py_node.children})
+    for char in chars:
+        if not 0 < ord(char) < BITMAP_ALPHABET_SIZE:
+            print(f"Error: Short code character '{char}' cannot be encoded in the bitmap trie (must be 7-bit ASCII).", file=sys.stderr)
+            sys.exit(1)
+    if len(chars) > BITMAP_BITS:
+        print(f"Error: Short codes use {len(chars)} distinct characters; the bitmap trie supports at most {BITMAP_BITS}.", file=sys.stderr)
+        sys.exit(1)
+    return {char: bit for bit, char in enumerate(chars)}
 
-    c_parts.append("const struct trie_hash_table zmk_text_expander_hash_tables[] = {\n")
-    for ht in c_hash_tables:
-        c_parts.append(f"    {{ .buckets_start_index = {ht['buckets_start_index']}, .num_buckets = {ht['num_buckets']} }},\n")
-    c_parts.append("};\n\n")
+def build_bitmap_children(bfs_nodes, node_map, alphabet):
+    """Records each node's child bitmap and the index of its first child; bfs_nodes must be ordered by_char."""
+    for py_node in bfs_nodes:
+        child_bitmap, first_child_index = 0, NULL_INDEX
+        if py_node.children:
+            chars = sorted(py_node.children)
+            first_child_index = node_map[id(py_node.children[chars[0]])]
+            for rank, char in enumerate(chars):
+                child_bitmap |= 1 << alphabet[char]
+                assert node_map[id(py_node.children[char])] == first_child_index + rank
+        py_node.c_struct_data["child_bitmap"] = child_bitmap
+        py_node.c_struct_data["first_child_index"] = first_child_index
 
-    c_parts.append("const uint16_t zmk_text_expander_hash_buckets[] = {\n    " + ", ".join(map(str, c_hash_buckets)) + "\n};\n\n")
+def bitmap_alphabet_rows(alphabet):
+    bits = [BITMAP_NO_BIT] * BITMAP_ALPHABET_SIZE
+    for char, bit in alphabet.items():
+        bits[ord(char)] = bit
+    return bits
+
+def build_swar_children(bfs_nodes, node_map):
+    """
+    Packs each node's child keys, in character order, into SWAR_LANES-byte words
+    of their own, so a lookup compares a whole word of keys at once and the
+    matching lane is the child's rank among its siblings. Unused lanes hold 0,
+    which no short code character equals. bfs_nodes must be ordered by_char.
+    Returns the key words.
+    """
+    key_words = []
+    for py_node in bfs_nodes:
+        first_child_index, keys_index = NULL_INDEX, NULL_INDEX
+        if py_node.children:
+            chars = sorted(py_node.children)
+            for char in chars:
+                if not 0 < ord(char) < 256:
+                    print(f"Error: Short code character '{char}' cannot be packed in the SWAR trie (must be a single byte).", file=sys.stderr)
+                    sys.exit(1)
+            first_child_index = node_map[id(py_node.children[chars[0]])]
+            keys_index = len(key_words)
+            for lane0 in range(0, len(chars), SWAR_LANES):
+                key_words.append(sum(ord(char) << (8 * lane) for lane, char in enumerate(chars[lane0:lane0 + SWAR_LANES])))
+            for rank, char in enumerate(chars):
+                assert node_map[id(py_node.children[char])] == first_child_index + rank
+        py_node.c_struct_data["first_child_index"] = first_child_index
+        py_node.c_struct_data["child_keys_index"] = keys_index
+        py_node.c_struct_data["num_children"] = len(py_node.children)
+    return key_words
 
-    c_parts.append("const struct trie_hash_entry zmk_text_expander_hash_entries[] = {\n")
-    for entry in c_hash_entries:
-        escaped_key = entry['key'].replace('\\', '\\\\').replace("'", "\\'")
-        c_parts.append(f"    {{ .key = '{escaped_key}', .child_node_index = {entry['child_node_index']}, .next_entry_index = {entry['next_entry_index']} }},\n")
-    c_parts.append("};\n\n")
+def flat_hash(short_code):
+    hash_value = FLAT_HASH_OFFSET_BASIS
+    for byte in short_code.encode('utf-8'):
+        hash_value = ((hash_value ^ byte) * FLAT_HASH_PRIME) & 0xFFFFFFFF
+    return hash_value
 
-    c_parts.append("const char *zmk_text_expander_get_string(uint16_t offset) {\n")
-    c_parts.append("    if (offset >= sizeof(zmk_text_expander_string_pool)) return NULL;\n")
-    c_parts.append("    return &zmk_text_expander_string_pool[offset];\n}\n")
+def flat_hash_home_slot(hash_value, num_slots):
+    """
+    Slot a short code's probe starts from (Must match home_slot() in src/flat_hash.c).
+    The hash is mixed first: the high bits of FNV-1a barely depend on the last
+    bytes of a short key, which clusters short codes that differ only at the end.
+    """
+    hash_value ^= hash_value >> 16
+    hash_value = (hash_value * FLAT_HASH_MIX) & 0xFFFFFFFF
+    hash_value ^= hash_value >> 13
+    return (hash_value * num_slots) >> 32
+
+def build_flat_hash_table(terminals):
+    """
+    Flat engine: a single open-addressing table of whole short codes, keyed on
+    their hash, with the hash and byte length kept as a fingerprint. The table
+    is at most FLAT_HASH_LOAD_PERCENT full and always has an empty slot, so
+    every probe run ends. Short codes are inserted most used first (by profile
+    heat, then weight), so those are the likeliest to sit in their home slot.
+    Returns the slots: a terminal node, or None.
+    """
+    num_slots = len(terminals) * 100 // FLAT_HASH_LOAD_PERCENT + 1
+    fingerprints = {}
+    for py_node in terminals:
+        key_len = len(py_node.short_code.encode('utf-8'))
+        if key_len > 255:
+            print(f"Error: The short code '{py_node.short_code}' is longer than the flat hash engine supports (255 bytes).", file=sys.stderr)
+            sys.exit(1)
+        fingerprint = (flat_hash(py_node.short_code), key_len)
+        if fingerprint in fingerprints:
+            print(f"Error: The short codes '{fingerprints[fingerprint]}' and '{py_node.short_code}' have the same hash; rename one or use a trie encoding.", file=sys.stderr)
+            sys.exit(1)
+        fingerprints[fingerprint] = py_node.short_code
+        py_node.c_struct_data["key_hash"], py_node.c_struct_data["key_len"] = fingerprint
+
+    slots = [None] * num_slots
+    for py_node in sorted(terminals, key=lambda py_node: (-py_node.heat, *completion_rank(py_node))):
+        slot = flat_hash_home_slot(py_node.c_struct_data["key_hash"], num_slots)
+        while slots[slot] is not None:
+            slot = (slot + 1) % num_slots
+        slots[slot] = py_node
+    return slots
+
+def build_double_array(bfs_nodes):
+    """
+    Packs the trie into BASE/CHECK arrays. The child of slot s for character c
+    lives at slot BASE[s] + c and is valid only if CHECK[that slot] == s, so
+    each transition is one add and one compare. Slots double as node indices;
+    the root is slot 0 and unused slots carry a NULL_INDEX check. Bases are
+    stored with DA_BASE_BIAS added so the first children can sit right after
+    the root even though character codes start well above zero.
+    Returns (slots, base, check) where slots maps slot -> Python node or None.
+    """
+    for py_node in bfs_nodes:
+        for char in py_node.children:
+            if not 0 < ord(char) < 256:
+                print(f"Error: Short code character '{char}' cannot be encoded in the double-array trie (must be a single byte).", file=sys.stderr)
+                sys.exit(1)
+
+    slots, base, check = [bfs_nodes[0]], [DA_BASE_BIAS], [NULL_INDEX]
+    slot_of = {id(bfs_nodes[0]): 0}
+    # The free slots, linked in slot order (-1 ends the list), so the first-fit
+    # search below steps over runs of taken slots at once
+    next_free, prev_free = [-1], [-1]
+    free_head = free_tail = -1
+
+    def ensure(size):
+        nonlocal free_head, free_tail
+        while len(slots) < size:
+            slot = len(slots)
+            slots.append(None)
+            base.append(DA_BASE_BIAS)
+            check.append(NULL_INDEX)
+            next_free.append(-1)
+            prev_free.append(free_tail)
+            if free_tail < 0:
+                free_head = slot
+            else:
+                next_free[free_tail] = slot
+            free_tail = slot
+
+    def take(slot):
+        nonlocal free_head, free_tail
+        before, after = prev_free[slot], next_free[slot]
+        if before < 0:
+            free_head = after
+        else:
+            next_free[before] = after
+        if after < 0:
+            free_tail = before
+        else:
+            prev_free[after] = before
+
+    for py_node in bfs_nodes:
+        if not py_node.children:
+            continue
+        parent_slot = slot_of[id(py_node)]
+        codes = sorted(ord(char) for char in py_node.children)
+        first, other_codes = codes[0], codes[1:]
+
+        # First-fit: slide the first child over free slots until every child fits.
+        pos = free_head
+        while True:
+            if pos < 0:
+                ensure(len(slots) + 1)
+                pos = free_tail
+            b = pos - first
+            if b + codes[-1] >= len(slots):
+                ensure(b + codes[-1] + 1)
+            for code in other_codes:
+                if slots[b + code] is not None:
+                    break
+            else:
+                break  # Every child fits at b
+            pos = next_free[pos]
+
+        base[parent_slot] = b + DA_BASE_BIAS
+        for char, child_py_node in py_node.children.items():
+            child_slot = b + ord(char)
+            slots[child_slot] = child_py_node
+            check[child_slot] = parent_slot
+            slot_of[id(child_py_node)] = child_slot
+            take(child_slot)
+
+    return slots, base, check
+
+def format_char_literal(char):
+    if char is None: return "'\\0'"
+    return "'" + char.replace('\\', '\\\\').replace("'", "\\'") + "'"
+
+def choose_uint_width(max_value, what, min_bits=UINT_WIDTHS[0]):
+    """Returns the narrowest width in UINT_WIDTHS, at least min_bits, whose all-ones sentinel stays above max_value."""
+    for bits in UINT_WIDTHS:
+        if bits >= min_bits and max_value < (1 << bits) - 1:
+            return bits
+    print(f"Error: {what} does not fit in {UINT_WIDTHS[-1]} bits.", file=sys.stderr)
+    sys.exit(1)
+
+def format_index(value):
+    return "NULL_INDEX" if value == NULL_INDEX else str(value)
+
+def format_offset(value):
+    return "NULL_OFFSET" if value == NULL_OFFSET else str(value)
+
+def trie_node_fields(encoding, radix=False, stacked_dictionaries=False):
+    """Fields of struct trie_node for an encoding, in declaration order (Must match include/zmk/trie.h)."""
+    fields = []
+    if encoding in (ENCODING_HASH, ENCODING_PERFECT_HASH):
+        fields.append(("hash_table_index", "index"))
+    elif encoding == ENCODING_BITMAP:
+        fields += [("child_bitmap", "uint64_t"), ("first_child_index", "index")]
+    elif encoding == ENCODING_SWAR:
+        fields += [("first_child_index", "index"), ("child_keys_index", "index"), ("num_children", "uint8_t")]
+    elif encoding == ENCODING_FLAT_HASH:
+        fields += [("key_hash", "uint32_t"), ("key_len", "uint8_t")]
+    fields += [("expanded_text_offset", "offset"), ("expanded_len_chars", "uint16_t"),
+               ("is_terminal", "bool"), ("preserve_trigger", "bool")]
+    if radix:
+        fields += [("label_offset", "offset"), ("label_len", "uint8_t")]
+    if stacked_dictionaries:
+        fields += [("next_variant", "index"), ("dictionary", "uint8_t"), ("dictionary_mask", "uint8_t")]
+    return fields
+
+def empty_node_row():
+    """A node row that no edge leads to and that ends no short code, with every optional field inert."""
+    return {"hash_table_index": NULL_INDEX, "child_bitmap": 0, "first_child_index": NULL_INDEX,
+            "child_keys_index": NULL_INDEX, "num_children": 0, "key_hash": 0, "key_len": 0,
+            "expanded_text_offset": NULL_OFFSET, "expanded_len_chars": 0, "is_terminal": 0, "preserve_trigger": 0,
+            "label_offset": NULL_OFFSET, "label_len": 0,
+            "next_variant": NULL_INDEX, "dictionary": 0, "dictionary_mask": 0}
+
+HASH_TABLE_FIELDS = [("buckets_start_index", "index"), ("num_buckets", "uint8_t")]
+HASH_ENTRY_FIELDS = [("key", "char"), ("child_node_index", "index"), ("next_entry_index", "index")]
+PERFECT_HASH_TABLE_FIELDS = [("entries_start_index", "index"), ("seed", "uint16_t"), ("num_slots", "uint8_t")]
+PERFECT_HASH_ENTRY_FIELDS = [("key", "char"), ("child_node_index", "index")]
+
+class TrieTable:
+    """
+    One generated table: a string, an array of scalars, or an array of structs
+    described by (field, scalar type) pairs. The same rows are emitted either
+    as C source or as the bytes of a flash dictionary image.
+    """
+    def __init__(self, table_id, name, c_type, rows, fields=None, per_line=16):
+        self.table_id = table_id
+        self.name = name
+        self.c_type = c_type
+        self.rows = rows
+        self.fields = fields
+        self.per_line = per_line
+
+def scalar_c_type(scalar_type):
+    return {"index": "trie_index_t", "offset": "trie_offset_t"}.get(scalar_type, scalar_type)
+
+def scalar_size(scalar_type, index_bits, offset_bits):
+    if scalar_type == "index": return index_bits // 8
+    if scalar_type == "offset": return offset_bits // 8
+    return SCALAR_SIZES[scalar_type]
+
+def format_scalar(value, scalar_type):
+    if scalar_type == "index": return format_index(value)
+    if scalar_type == "offset": return format_offset(value)
+    if scalar_type == "char": return format_char_literal(value)
+    if scalar_type == "uint32_t": return f"0x{value:08x}U"
+    if scalar_type == "uint64_t": return f"0x{value:016x}ULL"
+    return str(int(value))
+
+def scalar_column(values, scalar_type, index_bits, offset_bits):
+    """
+    The stored bit patterns of a column of scalars, with the null sentinels
+    widened to all ones. Converted a column at a time: large tables have
+    millions of values.
+    """
+    if scalar_type in ("index", "offset"):
+        null = NULL_INDEX if scalar_type == "index" else NULL_OFFSET
+        ones = (1 << (index_bits if scalar_type == "index" else offset_bits)) - 1
+        return [ones if value == null else value for value in values]
+    if scalar_type == "char":
+        return [ord(value) if value is not None else 0 for value in values]
+    return [int(value) for value in values]
+
+def format_table(table):
+    if table.c_type == "char":
+        return f'const char {table.name}[] = "{escape_for_c_string(table.rows)}";\n\n'
+    if table.fields:
+        lines = ["    { " + ", ".join(f".{name} = {format_scalar(row[name], t)}" for name, t in table.fields) + " },\n"
+                 for row in table.rows]
+        return f"const {table.c_type} {table.name}[] = {{\n" + "".join(lines) + "};\n\n"
+    values = [format_scalar(value, table.c_type) for value in table.rows]
+    lines = [", ".join(values[i:i + table.per_line]) for i in range(0, len(values), table.per_line)]
+    return f"const {scalar_c_type(table.c_type)} {table.name}[] = {{\n    " + ",\n    ".join(lines) + "\n};\n\n"
+
+def pack_table(table, index_bits, offset_bits):
+    """Packs a table little-endian with the natural alignment a C compiler gives the same declaration."""
+    if table.c_type == "char":
+        return bytes(table.rows) + b"\0"
+    if not table.fields:
+        size = scalar_size(table.c_type, index_bits, offset_bits)
+        values = scalar_column(table.rows, table.c_type, index_bits, offset_bits)
+        return struct.pack(f"<{len(values)}{PACK_CODES[size]}", *values)
+
+    # One struct format per row, with the padding as pad bytes
+    code, pos, struct_align = "<", 0, 1
+    for name, scalar_type in table.fields:
+        size = scalar_size(scalar_type, index_bits, offset_bits)
+        code += "x" * (-pos % size) + PACK_CODES[size]
+        pos += -pos % size + size
+        struct_align = max(struct_align, size)
+    row_struct = struct.Struct(code + "x" * (-pos % struct_align))
+
+    columns = [scalar_column([row[name] for row in table.rows], scalar_type, index_bits, offset_bits) for name, scalar_type in table.fields]
+    return b"".join(row_struct.pack(*values) for values in zip(*columns))
+
+def pool_dictionary_tables(dictionary):
+    offsets, blob = [0], bytearray()
+    for sub in dictionary:
+        blob.extend(sub)
+        offsets.append(len(blob))
+    return [TrieTable(TABLE_POOL_DICT, "zmk_text_expander_pool_dict", "char", blob),
+            TrieTable(TABLE_POOL_DICT_OFFSETS, "zmk_text_expander_pool_dict_offsets", "uint16_t", offsets)]
+
+def build_trie_tables(expansions, encoding=ENCODING_HASH, compress_pool=False, radix=False, aho_corasick=False, top_k=0,
+                      stacked_dictionaries=False, fuzzy=False, profile=None, fragments=None, fragment_depth=0):
+    """
+    Builds the trie and lays it out as the tables of the chosen encoding.
+    Fragments ({name: text}) are stored once and called when fragment_depth
+    (the nesting the firmware supports) is above 0, together with passages
+    factored out of the expansions; otherwise references copy them in.
+    A usage profile ({prefix: count}) reorders node rows and hash chains by
+    how often they are used. The bitmap and SWAR encodings need siblings in
+    consecutive rows in character order, so they keep the breadth-first layout.
+    The flat hash engine keeps only the short codes, in a hash table instead
+    of a trie, and places the most used nearest their home slot.
+    Returns (tables, num_nodes, index_max, pool_size, features): index_max is
+    the largest value stored as trie_index_t and pool_size the length of the
+    string pool, which together decide the widths of trie_index_t and
+    trie_offset_t; features is the TextFeatures of the expansions.
+    """
+    if radix and aho_corasick:
+        print("Error: Aho-Corasick mode cannot be combined with the radix trie.", file=sys.stderr)
+        sys.exit(1)
+    if encoding == ENCODING_FLAT_HASH and (radix or aho_corasick or top_k or stacked_dictionaries or fuzzy):
+        print("Error: The flat hash engine only matches whole short codes; it cannot be combined with the radix trie, "
+              "Aho-Corasick, prefix completion, stacked dictionaries or fuzzy matching.", file=sys.stderr)
+        sys.exit(1)
+
+    string_pool_builder = bytearray()
+    pool_offsets = {}
+    pool_dictionary = [] if compress_pool else None
+    fragment_map = compile_fragments(fragments or {}, fragment_depth > 0)
+    fragment_list = sorted((fragment for fragment in fragment_map.values() if fragment.index is not None), key=lambda fragment: fragment.index)
+    row_nodes, node_rows = [], []
+    da_base, da_check, c_hash_tables, c_hash_entries, c_hash_buckets, alphabet, swar_keys = [], [], [], [], [], {}, []
+    index_max = 0
+    terminals = []
+
+    if expansions:
+        root = build_trie_from_expansions(expansions)
+        if radix:
+            collapse_single_child_chains(root)
+        bfs_nodes = order_nodes_bfs(root)
+        layout_nodes = bfs_nodes
+        if profile:
+            assign_node_heat(root, profile)
+            if encoding not in (ENCODING_BITMAP, ENCODING_SWAR, ENCODING_FLAT_HASH):
+                layout_nodes = order_nodes_by_heat(bfs_nodes)
+        if encoding == ENCODING_FLAT_HASH:
+            layout_nodes = [py_node for py_node in bfs_nodes if py_node.is_terminal]
+        if aho_corasick:
+            build_aho_corasick_links(bfs_nodes)
+        if top_k:
+            build_top_completions(bfs_nodes, top_k)
+        variant_nodes = []
+        if stacked_dictionaries:
+            build_dictionary_masks(bfs_nodes)
+            variant_nodes = [variant for py_node in layout_nodes for variant in py_node.variants]
+
+        terminals = [py_node for py_node in layout_nodes + variant_nodes if py_node.is_terminal]
+        compile_terminals(terminals, fragment_map)
+        if fragment_depth > 0:
+            depth = max((fragment_call_depth(py_node.bytecode, fragment_map) for py_node in terminals), default=0)
+            if depth > fragment_depth:
+                print(f"Error: Fragments are nested {depth} deep; the firmware follows at most {fragment_depth} "
+                      "(CONFIG_ZMK_TEXT_EXPANDER_FRAGMENT_DEPTH).", file=sys.stderr)
+                sys.exit(1)
+            fragment_list += factor_repeated_fragments(terminals, fragment_list)
+
+        if compress_pool:
+            bytecodes = [segment for bytecode in [py_node.bytecode for py_node in terminals] + [fragment.bytecode for fragment in fragment_list]
+                         for segment in split_fragment_calls(bytecode) if isinstance(segment, bytes)]
+            pool_dictionary = finalize_pool_dictionary(bytecodes)
+
+        assign_node_payloads(layout_nodes + variant_nodes, string_pool_builder, pool_offsets, pool_dictionary)
+        if radix:
+            assign_edge_labels(layout_nodes, string_pool_builder)
+
+        if encoding == ENCODING_DOUBLE_ARRAY:
+            slots, da_base, da_check = build_double_array(layout_nodes)
+            row_nodes = slots
+            node_rows = [py_node.c_struct_data if py_node is not None else empty_node_row() for py_node in slots]
+            index_max = max(len(node_rows), max(da_base))
+        elif encoding == ENCODING_PERFECT_HASH:
+            node_map = {id(py_node): i for i, py_node in enumerate(layout_nodes)}
+            c_hash_tables, c_hash_entries = build_perfect_hash_tables(layout_nodes, node_map)
+            row_nodes = layout_nodes
+            node_rows = [py_node.c_struct_data for py_node in layout_nodes]
+            index_max = max(len(node_rows), len(c_hash_tables), len(c_hash_entries))
+        elif encoding == ENCODING_BITMAP:
+            node_map = {id(py_node): i for i, py_node in enumerate(layout_nodes)}
+            alphabet = build_bitmap_alphabet(layout_nodes)
+            build_bitmap_children(layout_nodes, node_map, alphabet)
+            row_nodes = layout_nodes
+            node_rows = [py_node.c_struct_data for py_node in layout_nodes]
+            index_max = len(node_rows)
+        elif encoding == ENCODING_SWAR:
+            node_map = {id(py_node): i for i, py_node in enumerate(layout_nodes)}
+            swar_keys = build_swar_children(layout_nodes, node_map)
+            row_nodes = layout_nodes
+            node_rows = [py_node.c_struct_data for py_node in layout_nodes]
+            index_max = max(len(node_rows), len(swar_keys))
+        elif encoding == ENCODING_FLAT_HASH:
+            slots = build_flat_hash_table(layout_nodes)
+            row_nodes = slots
+            node_rows = [py_node.c_struct_data if py_node is not None else empty_node_row() for py_node in slots]
+            index_max = len(node_rows)
+        else:
+            node_map = {id(py_node): i for i, py_node in enumerate(layout_nodes)}
+            c_hash_tables, c_hash_buckets, c_hash_entries = build_hash_tables(layout_nodes, node_map)
+            row_nodes = layout_nodes
+            node_rows = [py_node.c_struct_data for py_node in layout_nodes]
+            index_max = max(len(node_rows), len(c_hash_tables), len(c_hash_entries), len(c_hash_buckets))
+
+        if stacked_dictionaries:
+            link_dictionary_variants(row_nodes, node_rows)
+            index_max = max(index_max, len(node_rows))
+
+    fragment_offsets = [add_to_string_pool(fragment.bytecode, string_pool_builder, pool_offsets, pool_dictionary) for fragment in fragment_list]
+
+    tables = [TrieTable(TABLE_STRING_POOL, "zmk_text_expander_string_pool", "char", string_pool_builder)]
+    if pool_dictionary is not None:
+        tables += pool_dictionary_tables(pool_dictionary)
+    if fragment_depth > 0:
+        tables.append(TrieTable(TABLE_FRAGMENT_OFFSETS, "zmk_text_expander_fragment_offsets", "offset", fragment_offsets))
+    tables.append(TrieTable(TABLE_NODES, "zmk_text_expander_trie_nodes", "struct trie_node", node_rows, trie_node_fields(encoding, radix, stacked_dictionaries)))
+
+    if encoding == ENCODING_DOUBLE_ARRAY:
+        tables.append(TrieTable(TABLE_DA_BASE, "zmk_text_expander_da_base", "index", da_base))
+        tables.append(TrieTable(TABLE_DA_CHECK, "zmk_text_expander_da_check", "index", da_check))
+    elif encoding == ENCODING_PERFECT_HASH:
+        tables.append(TrieTable(TABLE_HASH_TABLES, "zmk_text_expander_hash_tables", "struct trie_hash_table", c_hash_tables, PERFECT_HASH_TABLE_FIELDS))
+        tables.append(TrieTable(TABLE_HASH_ENTRIES, "zmk_text_expander_hash_entries", "struct trie_hash_entry", c_hash_entries, PERFECT_HASH_ENTRY_FIELDS))
+    elif encoding == ENCODING_BITMAP:
+        tables.append(TrieTable(TABLE_BITMAP_ALPHABET, "zmk_text_expander_bitmap_bit_of", "uint8_t", bitmap_alphabet_rows(alphabet)))
+    elif encoding == ENCODING_SWAR:
+        tables.append(TrieTable(TABLE_SWAR_KEYS, "zmk_text_expander_swar_keys", "uint32_t", swar_keys, per_line=8))
+    elif encoding == ENCODING_FLAT_HASH:
+        pass  # The node table is the whole dictionary
+    else:
+        tables.append(TrieTable(TABLE_HASH_TABLES, "zmk_text_expander_hash_tables", "struct trie_hash_table", c_hash_tables, HASH_TABLE_FIELDS))
+        tables.append(TrieTable(TABLE_HASH_BUCKETS, "zmk_text_expander_hash_buckets", "index", c_hash_buckets))
+        tables.append(TrieTable(TABLE_HASH_ENTRIES, "zmk_text_expander_hash_entries", "struct trie_hash_entry", c_hash_entries, HASH_ENTRY_FIELDS))
+
+    if aho_corasick:
+        fail, output, depth = aho_corasick_link_rows(row_nodes)
+        tables.append(TrieTable(TABLE_AC_FAIL, "zmk_text_expander_ac_fail", "index", fail))
+        tables.append(TrieTable(TABLE_AC_OUTPUT, "zmk_text_expander_ac_output", "index", output))
+        tables.append(TrieTable(TABLE_AC_DEPTH, "zmk_text_expander_ac_depth", "uint8_t", depth))
+    if top_k:
+        tables.append(TrieTable(TABLE_TOP_COMPLETIONS, "zmk_text_expander_top_completions", "index", top_completion_rows(row_nodes, top_k), per_line=top_k))
+    if fuzzy:
+        tables.append(TrieTable(TABLE_SHORT_CODE_ALPHABET, "zmk_text_expander_short_code_alphabet", "char", short_code_alphabet(expansions)))
+
+    return tables, len(node_rows), index_max, len(string_pool_builder), scan_text_features(terminals, fragment_list)
+
+class TableBlob:
+    """
+    The tables of at least min_table_bytes, packed as in a flash dictionary
+    image into one file that the generated C source includes with the
+    assembler's .incbin. The compiler takes far longer over the initializers
+    of a large dictionary than the build script takes to generate them.
+    """
+    def __init__(self, path, tables, index_bits, offset_bits, min_table_bytes=BLOB_MIN_TABLE_BYTES):
+        self.path = Path(path).resolve()
+        self.data = bytearray()
+        # table_id -> (offset, size) in data
+        self.spans = {}
+        for table in tables:
+            packed = pack_table(table, index_bits, offset_bits)
+            if len(packed) >= min_table_bytes:
+                self.spans[table.table_id] = (len(self.data), len(packed))
+                self.data.extend(packed)
 
+def format_blob_table(table, blob):
+    offset, size = blob.spans[table.table_id]
+    path = escape_for_c_string(blob.path.as_posix().encode('utf-8'))
+    lines = [f'.section .rodata.{table.name},"a"', f".balign {BLOB_TABLE_ALIGN}", f".global {table.name}",
+             f".type {table.name}, %object", f"{table.name}:", f'.incbin "{path}", {offset}, {size}',
+             f".size {table.name}, {size}", ".previous"]
+    asm = "".join(f'    "{escape_for_c_string(line.encode("utf-8"))}\\n"\n' for line in lines)
+    return f"// {table.name}: {size} bytes of {blob.path.name}\n__asm__(\n{asm});\n\n"
+
+def generate_static_trie_c_code(tables, num_nodes, blob=None):
+    """The tables as C source; those in blob (a TableBlob) are included from its file."""
+    spans = blob.spans if blob is not None else {}
+    c_parts = ["#include <zmk/trie.h>\n#include <stddef.h> // For NULL\n\n"]
+    c_parts.append(f"const trie_index_t zmk_text_expander_trie_num_nodes = {num_nodes};\n\n")
+    for table in tables:
+        c_parts.append(format_blob_table(table, blob) if table.table_id in spans else format_table(table))
+        if table.table_id == TABLE_POOL_DICT_OFFSETS:
+            c_parts.append(f"const uint8_t zmk_text_expander_pool_dict_count = {len(table.rows) - 1};\n\n")
+        elif table.table_id == TABLE_FRAGMENT_OFFSETS:
+            c_parts.append(f"const uint16_t zmk_text_expander_fragment_count = {len(table.rows)};\n\n")
+
+    c_parts.append("const char *zmk_text_expander_get_string(trie_offset_t offset) {\n")
+    if TABLE_STRING_POOL in spans:
+        c_parts.append(f"    if (offset >= {spans[TABLE_STRING_POOL][1]}) return NULL;\n")
+    else:
+        c_parts.append("    if (offset >= sizeof(zmk_text_expander_string_pool)) return NULL;\n")
+    c_parts.append("    return &zmk_text_expander_string_pool[offset];\n}\n")
     return "".join(c_parts)
 
+def generate_trie_image(tables, num_nodes, index_bits, offset_bits, max_short_len, encoding, flags, top_k):
+    """Packs the tables into a relocatable flash dictionary image; see include/zmk/trie_image.h."""
+    header_size = struct.calcsize(IMAGE_HEADER_FORMAT)
+    directory = [(0, 0)] * TABLE_COUNT
+    payload = bytearray()
+    for table in tables:
+        data = pack_table(table, index_bits, offset_bits)
+        payload.extend(bytes(-(header_size + len(payload)) % IMAGE_TABLE_ALIGN))
+        directory[table.table_id] = (header_size + len(payload), len(data))
+        payload.extend(data)
+
+    layout = IMAGE_ENCODING_IDS[encoding] | (flags << 8) | (index_bits << 16) | (offset_bits << 24)
+    header = struct.pack(IMAGE_HEADER_FORMAT[:-1], IMAGE_MAGIC, IMAGE_VERSION, header_size, layout,
+                         header_size + len(payload), num_nodes, max_short_len, top_k, 0, zlib.crc32(payload),
+                         *[value for entry in directory for value in entry])
+    return header + struct.pack("<I", zlib.crc32(header)) + bytes(payload)
+
+def load_layout(path):
+    """
+    Reads the characters a host layout can type from the keycode_lut in its
+    C source (src/layouts/). Returns {char: needs_shift}.
+    """
+    try:
+        source = Path(path).read_text(encoding="utf-8")
+    except OSError as e:
+        print(f"Error: Cannot read the layout '{path}': {e}", file=sys.stderr)
+        sys.exit(1)
+    layout = {char: False for char in LAYOUT_EXTRA_CHARS}
+    for literal, mapping in re.findall(r"\[IDX\('(\\.|[^'\\])'\)\]\s*=\s*MAP_([SU])\(", source):
+        layout[literal[-1]] = mapping == "S"
+    if len(layout) == len(LAYOUT_EXTRA_CHARS):
+        print(f"Error: No keycode_lut entries found in the layout '{path}'.", file=sys.stderr)
+        sys.exit(1)
+    return layout
+
+def unicode_input_cost(os_name, codepoint):
+    """
+    Key presses, HID reports and typing delays the OS driver takes for one
+    Unicode character, from reaching it to the next character: the Alt+numpad
+    decimal code, Option+hex (at least four digits) or Ctrl+Shift+U, hex and
+    Enter.
+    """
+    if os_name == OS_WIN:
+        digits = len(str(codepoint))
+        return 1 + digits, 2 + 2 * digits, 4 + 2 * digits
+    if os_name == OS_MAC:
+        digits = max(4, len(f"{codepoint:x}"))
+        return 1 + digits, 2 + 2 * digits, 4 + 2 * digits
+    digits = len(f"{codepoint:x}")
+    return 4 + digits, 6 + 2 * digits, 8 + 2 * digits
+
+def typing_cost(expansion, layout, default_os, typing_delay):
+    """
+    Replays the expansion engine's state machine for one expansion triggered
+    by a key that is typed first (a space, say), so the short code and that
+    key are backspaced. Times are averages: the random jitter on each typing
+    delay cancels out. Returns a dict for the typing report.
+    """
+    delay = max(MIN_TYPING_DELAY_MS, min(typing_delay, MAX_TYPING_DELAY_MS))
+    backspaces = len(expansion.short_code.encode("utf-8")) - expansion.keep_len + 1
+    key_presses, reports, delays = backspaces, 2 * backspaces, 2 * backspaces + 1
+    time_ms = EXPANSION_START_DELAY_MS
+    os_name, shift_active, characters, untypable = default_os, False, 0, []
+
+    for char in expansion.text:
+        if char in OS_BY_COMMAND:
+            os_name = OS_BY_COMMAND[char]
+            continue
+        characters += 1
+        if ord(char) >= 0x80:
+            presses, char_reports, char_delays = unicode_input_cost(os_name, ord(char))
+            key_presses += presses
+            reports += char_reports
+            delays += char_delays
+            continue
+        time_ms += CHAR_PRESS_DELAY_MS
+        delays += 2
+        if char not in layout:
+            if char not in untypable:
+                untypable.append(char)
+            continue
+        if layout[char] and not shift_active:
+            key_presses += 1
+        shift_active = layout[char]
+        key_presses += 1
+        reports += 2
+
+    if shift_active:
+        reports += 1
+    if expansion.preserve_trigger:
+        key_presses += 1
+        reports += 2
+        delays += 2
+
+    return {
+        "short_code": expansion.short_code,
+        "dictionary": expansion.dictionary,
+        "characters": characters,
+        "backspaces": backspaces,
+        "key_presses": key_presses,
+        "hid_reports": reports,
+        "time_ms": time_ms + delays * delay,
+        "untypable": untypable,
+    }
+
+def write_typing_report(path, features, layout_path, default_os, typing_delay, budget_ms):
+    """
+    Writes the typing cost of every expansion, slowest first, as JSON. Returns
+    False if an expansion has a character the layout cannot type, or takes
+    longer than budget_ms (0 for no limit).
+    """
+    layout = load_layout(layout_path)
+    costs = sorted((typing_cost(expansion, layout, default_os, typing_delay) for expansion in features.expansions),
+                   key=lambda cost: (-cost["time_ms"], cost["short_code"], cost["dictionary"]))
+    report = {
+        "layout": Path(layout_path).stem,
+        "default_os": default_os,
+        "typing_delay_ms": typing_delay,
+        "budget_ms": budget_ms,
+        "expansions": costs,
+    }
+    with open(path, 'w', encoding='utf-8') as f:
+        json.dump(report, f, indent=2, ensure_ascii=False)
+        f.write("\n")
+
+    ok = True
+    for cost in costs:
+        if cost["untypable"]:
+            chars = ", ".join(repr(char) for char in cost["untypable"])
+            print(f"Error: The expansion of '{cost['short_code']}' contains {chars}, which the {report['layout']} layout cannot type.", file=sys.stderr)
+            ok = False
+        if budget_ms and cost["time_ms"] > budget_ms:
+            print(f"Error: The expansion of '{cost['short_code']}' takes about {cost['time_ms']} ms to type, over the {budget_ms} ms budget.", file=sys.stderr)
+            ok = False
+    return ok
+
+def write_depfile(path, target, dependencies):
+    """Writes a Makefile style depfile, so the build reruns the script when a file it read changes."""
+    def escape(name):
+        return str(name).replace("\\", "/").replace("$", "$$").replace("#", "\\#").replace(" ", "\\ ")
+    with open(path, 'w', encoding='utf-8') as f:
+        f.write(f"{escape(target)}: " + " \\\n  ".join(escape(dependency) for dependency in dependencies) + "\n")
+
+def c_struct_size(field_sizes):
+    """sizeof() of a struct of scalar fields, with natural alignment."""
+    pos, struct_align = 0, 1
+    for size in field_sizes:
+        pos += -pos % size + size
+        struct_align = max(struct_align, size)
+    return pos + -pos % struct_align
+
+def hash_chain_stats(tables, encoding):
+    """
+    Load factor (stored keys per slot) and longest probe sequence of the
+    encoding's hash tables, or (None, None) for encodings without any.
+    """
+    by_id = {table.table_id: table for table in tables}
+    if encoding == ENCODING_HASH:
+        buckets, entries = by_id[TABLE_HASH_BUCKETS].rows, by_id[TABLE_HASH_ENTRIES].rows
+        longest = 0
+        for entry_index in buckets:
+            chain = 0
+            while entry_index != NULL_INDEX:
+                chain += 1
+                entry_index = entries[entry_index]["next_entry_index"]
+            longest = max(longest, chain)
+        return (len(entries) / len(buckets) if buckets else 0.0), longest
+    if encoding == ENCODING_PERFECT_HASH:
+        num_slots = sum(row["num_slots"] for row in by_id[TABLE_HASH_TABLES].rows)
+        num_entries = sum(1 for row in by_id[TABLE_HASH_ENTRIES].rows if row["child_node_index"] != NULL_INDEX)
+        return (num_entries / num_slots if num_slots else 0.0), int(num_entries > 0)
+    if encoding == ENCODING_FLAT_HASH:
+        slots = by_id[TABLE_NODES].rows
+        probes = [(slot - flat_hash_home_slot(row["key_hash"], len(slots))) % len(slots) + 1
+                  for slot, row in enumerate(slots) if row["is_terminal"]]
+        return (len(probes) / len(slots) if slots else 0.0), max(probes, default=0)
+    return None, None
+
+def write_footprint_report(path, tables, num_nodes, encoding, index_bits, offset_bits, max_short_len, num_entries,
+                           ram_options, flash_budget):
+    """
+    Writes the flash taken by every generated table, the RAM of the buffers in
+    struct text_expander_data that the dictionary and configuration size, and
+    statistics on how densely the tables are used, as JSON. Kernel objects in
+    the struct are not counted; CONFIG_ZMK_TEXT_EXPANDER_RAM_BUDGET checks its
+    full size when the firmware is compiled. Returns False if the tables take
+    more than flash_budget bytes (0 for no limit).
+    """
+    table_bytes = {table.name: len(pack_table(table, index_bits, offset_bits)) for table in tables}
+    flash_total = sum(table_bytes.values())
+
+    short_len = max_short_len + 1 if max_short_len > 0 else DEFAULT_MAX_SHORT_LEN
+    if encoding == ENCODING_FLAT_HASH:
+        cursor_size = c_struct_size([4, 1])
+    else:
+        cursor_size = c_struct_size([index_bits // 8, 1] + ([1] if ram_options["radix"] else []))
+    ram = {
+        "current_short": short_len,
+        "cursors": (short_len + 1) * cursor_size,
+        "event_msgq_buffer": ram_options["event_queue_size"] * TEXT_EXPANDER_EVENT_SIZE,
+    }
+    if ram_options["overlay"]:
+        ram["overlay_cursors"] = (short_len + 1) * OVERLAY_CURSOR_SIZE
+    if ram_options["case_preserving"]:
+        ram["current_short_upper"] = short_len
+    if ram_options["undo"]:
+        ram["last_short_code"] = short_len
+
+    pool_bytes = table_bytes["zmk_text_expander_string_pool"]
+    load_factor, longest_chain = hash_chain_stats(tables, encoding)
+    report = {
+        "encoding": encoding,
+        "index_bits": index_bits,
+        "offset_bits": offset_bits,
+        "max_short_len": short_len,
+        "entries": num_entries,
+        "flash": {"tables": table_bytes, "total": flash_total, "budget": flash_budget},
+        "ram": {"buffers": ram, "total": sum(ram.values())},
+        "stats": {
+            "nodes": num_nodes,
+            "nodes_per_entry": round(num_nodes / num_entries, 3) if num_entries else 0,
+            "bucket_load_factor": round(load_factor, 3) if load_factor is not None else None,
+            "longest_chain": longest_chain,
+            "pool_bytes_per_entry": round(pool_bytes / num_entries, 1) if num_entries else 0,
+            "flash_bytes_per_entry": round(flash_total / num_entries, 1) if num_entries else 0,
+        },
+    }
+    with open(path, 'w', encoding='utf-8') as f:
+        json.dump(report, f, indent=2)
+        f.write("\n")
+
+    if flash_budget and flash_total > flash_budget:
+        print(f"Error: The dictionary tables take {flash_total} bytes of flash, over the {flash_budget} byte budget.", file=sys.stderr)
+        for name, size in sorted(table_bytes.items(), key=lambda item: -item[1]):
+            print(f"       {name}: {size} bytes", file=sys.stderr)
+        return False
+    return True
+
+def generate_trie_header(longest_short_len, index_bits, offset_bits, num_nodes, features):
+    return f"""
+#pragma once
+// Automatically generated file. Do not edit.
+#include <stdint.h>
+
+#define ZMK_TEXT_EXPANDER_GENERATED_MAX_SHORT_LEN {longest_short_len}
+#define ZMK_TEXT_EXPANDER_GENERATED_NUM_NODES {num_nodes}
+
+// What the expansions need typed; see include/zmk/expansion_features.h
+#define ZMK_TEXT_EXPANDER_GENERATED_HAS_UNICODE {int(features.unicode)}
+#define ZMK_TEXT_EXPANDER_GENERATED_HAS_CMD_WIN {int(OP_CMD_WIN in features.os_commands)}
+#define ZMK_TEXT_EXPANDER_GENERATED_HAS_CMD_MAC {int(OP_CMD_MAC in features.os_commands)}
+#define ZMK_TEXT_EXPANDER_GENERATED_HAS_CMD_LINUX {int(OP_CMD_LINUX in features.os_commands)}
+#define ZMK_TEXT_EXPANDER_GENERATED_HAS_NEWLINE {int(features.newline)}
+#define ZMK_TEXT_EXPANDER_GENERATED_HAS_TAB {int(features.tab)}
+#define ZMK_TEXT_EXPANDER_GENERATED_MAX_EXPANSION_LEN {features.max_expansion_len}
+
+typedef uint{index_bits}_t trie_index_t;
+typedef uint{offset_bits}_t trie_offset_t;
+#define ZMK_TEXT_EXPANDER_GENERATED_INDEX_MAX UINT{index_bits}_MAX
+#define ZMK_TEXT_EXPANDER_GENERATED_OFFSET_MAX UINT{offset_bits}_MAX
+"""
+
 if __name__ == "__main__":
     parser = argparse.ArgumentParser(description="Generate ZMK Text Expander trie C code from DeviceTree.")
     parser.add_argument("build_dir", help="The build directory containing zephyr.dts")
     parser.add_argument("output_c", help="Output C file path")
     parser.add_argument("output_h", help="Output H file path")
+    parser.add_argument("--encoding", choices=ENCODINGS, default=ENCODING_HASH,
+                        help="Layout of the generated trie tables (must match the Kconfig trie encoding)")
+    parser.add_argument("--radix", action="store_true",
+                        help="Collapse single-child chains into labelled edges (path-compressed trie)")
+    parser.add_argument("--aho-corasick", action="store_true",
+                        help="Emit failure and output links so short codes match at any position")
+    parser.add_argument("--top-k", type=int, default=0, metavar="K",
+                        help="Precompute the K best completions of every prefix (0 disables)")
+    parser.add_argument("--compress-pool", action="store_true",
+                        help="Store expansions compressed against a generated substring dictionary")
+    parser.add_argument("--stacked-dictionaries", action="store_true",
+                        help="Keep every dictionary's definition of a short code, selectable at runtime")
+    parser.add_argument("--fuzzy", action="store_true",
+                        help="Emit the short code alphabet used to correct one-character typos")
+    parser.add_argument("--fragment-depth", type=int, default=0, metavar="DEPTH",
+                        help="Store fragments once and call them, nested at most DEPTH deep (0 copies them into every expansion)")
+    parser.add_argument("--profile", metavar="PATH",
+                        help="Usage profile from the device, used to lay out frequently used nodes first")
+    parser.add_argument("--image", metavar="PATH",
+                        help="Write the tables to a flash dictionary image instead of the C file")
+    parser.add_argument("--min-index-bits", type=int, choices=UINT_WIDTHS, default=UINT_WIDTHS[0],
+                        help="Smallest width for trie_index_t, so later images can grow without a firmware rebuild")
+    parser.add_argument("--min-offset-bits", type=int, choices=UINT_WIDTHS, default=UINT_WIDTHS[0],
+                        help="Smallest width for trie_offset_t")
+    parser.add_argument("--reserve-short-len", type=int, default=0, metavar="N",
+                        help="Size the short code buffer for at least N characters")
+    parser.add_argument("--typing-report", metavar="PATH",
+                        help="Write the keystrokes, HID reports and typing time of every expansion to a JSON report")
+    parser.add_argument("--layout", metavar="PATH",
+                        help="Host layout source (src/layouts/*.c) whose characters the typing report checks")
+    parser.add_argument("--default-os", choices=[OS_WIN, OS_MAC, OS_LINUX], default=OS_WIN,
+                        help="Unicode input method used until an expansion switches it")
+    parser.add_argument("--typing-delay", type=int, default=10, metavar="MS",
+                        help="CONFIG_ZMK_TEXT_EXPANDER_TYPING_DELAY, for the typing report")
+    parser.add_argument("--typing-budget", type=int, default=0, metavar="MS",
+                        help="Fail if an expansion takes longer than MS to type (0 disables)")
+    parser.add_argument("--import", dest="import_files", action="append", default=[], metavar="PATH",
+                        help="Import the expansions of a CSV, JSON or espanso YAML file (may be repeated)")
+    parser.add_argument("--import-base", default=".", metavar="DIR",
+                        help="Directory the dictionary-files in the devicetree are relative to")
+    parser.add_argument("--blob", metavar="PATH",
+                        help="Write large tables to PATH and include them with .incbin instead of as C initializers")
+    parser.add_argument("--depfile", metavar="PATH",
+                        help="Write the files the dictionary was read from to a Makefile style depfile")
+    parser.add_argument("--footprint-report", metavar="PATH",
+                        help="Write the flash taken by every table, the RAM of the short code buffers and table statistics to a JSON report")
+    parser.add_argument("--flash-budget", type=int, default=0, metavar="BYTES",
+                        help="Fail if the tables take more than BYTES of flash (0 disables)")
+    parser.add_argument("--event-queue-size", type=int, default=16, metavar="N",
+                        help="CONFIG_ZMK_TEXT_EXPANDER_EVENT_QUEUE_SIZE, for the footprint report")
+    parser.add_argument("--overlay", action="store_true",
+                        help="Count the runtime overlay's cursors in the footprint report")
+    parser.add_argument("--case-preserving", action="store_true",
+                        help="Count the case preserving buffer in the footprint report")
     
     args = parser.parse_args()
 
@@ -316,17 +2059,57 @@ if __name__ == "__main__":
         sys.exit(1)
 
     dts_path = dts_files[0]
-    expansions = parse_dts_for_expansions(str(dts_path))
+    expansions, fragments, expander_properties, imported = parse_dts_for_expansions(str(dts_path), args.import_files, args.import_base)
+    if args.depfile:
+        write_depfile(args.depfile, args.output_c, [dts_path, *imported])
+    profile = parse_usage_profile(args.profile) if args.profile else None
+
+    tables, num_nodes, index_max, pool_size, features = build_trie_tables(expansions, args.encoding, args.compress_pool, args.radix, args.aho_corasick, args.top_k,
+                                                                          args.stacked_dictionaries, args.fuzzy, profile, fragments, args.fragment_depth)
+    index_bits = choose_uint_width(index_max, "Trie index", args.min_index_bits)
+    offset_bits = choose_uint_width(pool_size, "String pool offset", args.min_offset_bits)
+    longest_short_len = len(max(expansions.keys(), key=len)) if expansions else 0
 
-    c_code = generate_static_trie_c_code(expansions)
+    if args.image:
+        if longest_short_len > args.reserve_short_len:
+            print(f"Error: Short code length {longest_short_len} exceeds the {args.reserve_short_len} characters reserved for a flash dictionary.", file=sys.stderr)
+            sys.exit(1)
+        flags = ((IMAGE_FLAG_RADIX if args.radix else 0)
+                 | (IMAGE_FLAG_AHO_CORASICK if args.aho_corasick else 0)
+                 | (IMAGE_FLAG_COMPRESSED_POOL if args.compress_pool else 0)
+                 | (IMAGE_FLAG_PREFIX_COMPLETION if args.top_k else 0)
+                 | (IMAGE_FLAG_STACKED_DICTIONARIES if args.stacked_dictionaries else 0)
+                 | (IMAGE_FLAG_FUZZY_MATCH if args.fuzzy else 0)
+                 | (IMAGE_FLAG_FRAGMENTS if args.fragment_depth else 0))
+        image = generate_trie_image(tables, num_nodes, index_bits, offset_bits, longest_short_len, args.encoding, flags, args.top_k)
+        with open(args.image, 'wb') as f:
+            f.write(image)
+        c_code = "// The dictionary tables are read from the flash dictionary image at runtime.\n"
+    elif args.blob:
+        blob = TableBlob(args.blob, tables, index_bits, offset_bits)
+        with open(args.blob, 'wb') as f:
+            f.write(blob.data)
+        c_code = generate_static_trie_c_code(tables, num_nodes, blob)
+    else:
+        c_code = generate_static_trie_c_code(tables, num_nodes)
     with open(args.output_c, 'w', encoding='utf-8') as f:
         f.write(c_code)
 
-    longest_short_len = len(max(expansions.keys(), key=len)) if expansions else 0
-    h_file_content = f"""
-#pragma once
-// Automatically generated file. Do not edit.
-#define ZMK_TEXT_EXPANDER_GENERATED_MAX_SHORT_LEN {longest_short_len}
-"""
+    h_file_content = generate_trie_header(max(longest_short_len, args.reserve_short_len), index_bits, offset_bits, num_nodes, features)
     with open(args.output_h, 'w', encoding='utf-8') as f:
         f.write(h_file_content)
+
+    if args.footprint_report:
+        ram_options = {"radix": args.radix, "event_queue_size": args.event_queue_size, "overlay": args.overlay,
+                       "case_preserving": args.case_preserving, "undo": "undo-keycodes" in expander_properties}
+        if not write_footprint_report(args.footprint_report, tables, num_nodes, args.encoding, index_bits, offset_bits,
+                                      max(longest_short_len, args.reserve_short_len), len(features.expansions),
+                                      ram_options, args.flash_budget):
+            sys.exit(1)
+
+    if args.typing_report:
+        if not args.layout:
+            print("Error: --typing-report needs the host layout (--layout).", file=sys.stderr)
+            sys.exit(1)
+        if not write_typing_report(args.typing_report, features, args.layout, args.default_os, args.typing_delay, args.typing_budget):
+            sys.exit(1)
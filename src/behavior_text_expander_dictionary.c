@@ -0,0 +1,63 @@
+#define DT_DRV_COMPAT zmk_behavior_text_expander_dictionary
+
+#include <zephyr/device.h>
+#include <zephyr/kernel.h>
+#include <drivers/behavior.h>
+#include <zephyr/logging/log.h>
+#include <zmk/behavior.h>
+#include <zmk/trie.h>
+#include <dt-bindings/zmk/text_expander.h>
+
+LOG_MODULE_REGISTER(text_expander_dictionary, LOG_LEVEL_DBG);
+
+#if DT_HAS_COMPAT_STATUS_OKAY(DT_DRV_COMPAT)
+
+static int text_expander_dictionary_binding_pressed(struct zmk_behavior_binding *binding,
+                                                    struct zmk_behavior_binding_event binding_event) {
+    uint8_t mask = (uint8_t)binding->param2;
+    uint8_t enabled = trie_get_enabled_dictionaries();
+
+    switch (binding->param1) {
+    case TXT_DICT_ON:
+        enabled |= mask;
+        break;
+    case TXT_DICT_OFF:
+        enabled &= ~mask;
+        break;
+    case TXT_DICT_TOGGLE:
+        enabled ^= mask;
+        break;
+    case TXT_DICT_SET:
+        enabled = mask;
+        break;
+    default:
+        LOG_ERR("Unknown dictionary command %u", binding->param1);
+        return -ENOTSUP;
+    }
+
+    LOG_DBG("Enabled dictionaries: 0x%02x", enabled);
+    trie_set_enabled_dictionaries(enabled);
+    return ZMK_BEHAVIOR_OPAQUE;
+}
+
+static int text_expander_dictionary_binding_released(struct zmk_behavior_binding *binding,
+                                                     struct zmk_behavior_binding_event binding_event) {
+    return ZMK_BEHAVIOR_OPAQUE;
+}
+
+static const struct behavior_driver_api text_expander_dictionary_driver_api = {
+    .binding_pressed = text_expander_dictionary_binding_pressed,
+    .binding_released = text_expander_dictionary_binding_released,
+};
+
+static int text_expander_dictionary_init(const struct device *dev) {
+    return 0;
+}
+
+#define TEXT_EXPANDER_DICTIONARY_INST(n)                                                          \
+    BEHAVIOR_DT_INST_DEFINE(n, text_expander_dictionary_init, NULL, NULL, NULL, POST_KERNEL,      \
+                            CONFIG_KERNEL_INIT_PRIORITY_DEFAULT, &text_expander_dictionary_driver_api);
+
+DT_INST_FOREACH_STATUS_OKAY(TEXT_EXPANDER_DICTIONARY_INST)
+
+#endif
@@ -2,6 +2,7 @@
 #include <zephyr/sys/util.h>
 
 #include <ctype.h>
+#include <string.h>
 #include <zephyr/logging/log.h>
 #include <zephyr/random/random.h>
 #include <zmk/hid.h>
@@ -17,6 +18,7 @@ LOG_MODULE_REGISTER(expansion_engine, LOG_LEVEL_DBG);
 #define EXPANSION_START_DELAY_MS 10
 #define CHAR_PRESS_DELAY_MS 1
 
+#if EXPANSION_DRIVER_WIN
 /**
  * @brief Converts a 32-bit unsigned integer to decimal string.
  * @param val Value to convert (for Unicode: valid range 0-0x10FFFF for codepoints)
@@ -49,7 +51,9 @@ static void u32_to_str_dec(uint32_t val, char *buf, size_t buf_size) {
     }
     buf[out_idx] = '\0';
 }
+#endif
 
+#if EXPANSION_DRIVER_MAC || EXPANSION_DRIVER_LINUX
 /**
  * @brief Converts a 32-bit unsigned integer to hexadecimal string.
  * @param val Value to convert (for Unicode: valid range 0x0000-0x10FFFF)
@@ -90,6 +94,178 @@ static void u32_to_str_hex(uint32_t val, char *buf, size_t buf_size, bool zero_p
     }
     buf[out_idx] = '\0';
 }
+#endif
+
+/**
+ * @brief Starts reading an expansion's bytecode.
+ * @param reader The reader to initialize
+ * @param text Bytecode from the string pool, or plain text held in RAM
+ *
+ * Plain text never contains EXP_OP_DICT or EXP_OP_CALL, so RAM strings such
+ * as a short code restored by undo can go through the same reader as pool
+ * entries.
+ */
+void text_reader_init(struct text_reader *reader, const char *text) {
+    reader->src = text;
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_COMPRESS_STRING_POOL
+    reader->ref = NULL;
+    reader->ref_len = 0;
+#endif
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_FRAGMENTS
+    reader->depth = 0;
+#endif
+#ifdef TEXT_READER_DECODES
+    reader->lookahead_len = 0;
+#endif
+}
+
+#ifdef TEXT_READER_DECODES
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_FRAGMENTS
+/**
+ * @brief Continues reading inside a fragment.
+ * @param reader The reader, positioned just after the fragment reference
+ * @param index Index of the fragment to type
+ *
+ * A bad index or a nesting deeper than the return stack skips the reference;
+ * the build script rejects dictionaries that would need either.
+ */
+static void text_reader_call(struct text_reader *reader, uint8_t index) {
+    if (index >= zmk_text_expander_fragment_count) {
+        LOG_WRN("Invalid fragment reference %d in string pool", index);
+        return;
+    }
+    if (reader->depth == ARRAY_SIZE(reader->return_stack)) {
+        LOG_WRN("Fragments nested deeper than %d, skipping fragment %d", (int)ARRAY_SIZE(reader->return_stack), index);
+        return;
+    }
+    const char *fragment = zmk_text_expander_get_string(zmk_text_expander_fragment_offsets[index]);
+    if (!fragment) {
+        LOG_WRN("Fragment %d is outside the string pool", index);
+        return;
+    }
+    reader->return_stack[reader->depth++] = reader->src;
+    reader->src = fragment;
+}
+#endif
+
+/**
+ * @brief Decodes the next byte of a pool entry.
+ * @param reader The reader to advance
+ * @return The decoded byte; 0 once the end of the entry is reached
+ *
+ * Dictionary references are followed lazily: only a pointer into the
+ * dictionary entry and its remaining length are kept. The end of a fragment
+ * returns to the entry that called it.
+ */
+static uint8_t text_reader_decode_next(struct text_reader *reader) {
+    while (true) {
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_COMPRESS_STRING_POOL
+        if (reader->ref_len > 0) {
+            reader->ref_len--;
+            return (uint8_t)*reader->ref++;
+        }
+#endif
+
+        uint8_t byte = (uint8_t)*reader->src;
+        if (byte == 0) {
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_FRAGMENTS
+            if (reader->depth > 0) {
+                reader->src = reader->return_stack[--reader->depth];
+                continue;
+            }
+#endif
+            // Stay on the terminator so that further reads keep returning it
+            return 0;
+        }
+        reader->src++;
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_FRAGMENTS
+        if (byte == EXP_OP_CALL) {
+            text_reader_call(reader, (uint8_t)*reader->src++);
+            continue;
+        }
+#endif
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_COMPRESS_STRING_POOL
+        if (byte != EXP_OP_DICT) {
+            return byte;
+        }
+
+        uint8_t index = (uint8_t)*reader->src++;
+        if (index == EXP_DICT_LITERAL_ESCAPE) {
+            return EXP_OP_DICT;
+        }
+        if (index >= zmk_text_expander_pool_dict_count) {
+            LOG_WRN("Invalid dictionary reference %d in string pool", index);
+            continue;
+        }
+        uint16_t start = zmk_text_expander_pool_dict_offsets[index];
+        reader->ref = &zmk_text_expander_pool_dict[start];
+        reader->ref_len = (uint8_t)(zmk_text_expander_pool_dict_offsets[index + 1] - start);
+#else
+        return byte;
+#endif
+    }
+}
+
+/**
+ * @brief Returns a byte ahead of the read position without consuming it.
+ * @param reader The reader
+ * @param ahead Distance from the read position, below TEXT_READER_LOOKAHEAD
+ * @return The byte, or 0 past the end of the text
+ *
+ * Like indexing a plain string, callers must not look past a 0 they have seen.
+ */
+uint8_t text_reader_peek(struct text_reader *reader, uint8_t ahead) {
+    if (ahead >= TEXT_READER_LOOKAHEAD) {
+        return 0;
+    }
+    while (reader->lookahead_len <= ahead) {
+        reader->lookahead[reader->lookahead_len++] = text_reader_decode_next(reader);
+    }
+    return reader->lookahead[ahead];
+}
+
+void text_reader_skip(struct text_reader *reader, uint8_t count) {
+    while (count-- > 0) {
+        if (reader->lookahead_len > 0) {
+            reader->lookahead_len--;
+            memmove(reader->lookahead, reader->lookahead + 1, reader->lookahead_len);
+        } else {
+            text_reader_decode_next(reader);
+        }
+    }
+}
+
+/**
+ * @brief Consumes prefix from the reader if the text starts with it.
+ * @return true if the prefix matched; the reader is left past it. On a
+ *         mismatch the reader position is unspecified and must be reset.
+ */
+bool text_reader_consume_prefix(struct text_reader *reader, const char *prefix, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (text_reader_peek(reader, 0) != (uint8_t)prefix[i]) {
+            return false;
+        }
+        text_reader_skip(reader, 1);
+    }
+    return true;
+}
+#else
+uint8_t text_reader_peek(struct text_reader *reader, uint8_t ahead) {
+    return (uint8_t)reader->src[ahead];
+}
+
+void text_reader_skip(struct text_reader *reader, uint8_t count) {
+    reader->src += count;
+}
+
+bool text_reader_consume_prefix(struct text_reader *reader, const char *prefix, size_t len) {
+    if (strncmp(reader->src, prefix, len) != 0) {
+        return false;
+    }
+    reader->src += len;
+    return true;
+}
+#endif
 
 static void handle_start_backspace(struct expansion_work *exp_work);
 static void handle_backspace_press(struct expansion_work *exp_work);
@@ -102,18 +278,23 @@ static void handle_finish(struct expansion_work *exp_work);
 static void handle_replay_key_press(struct expansion_work *exp_work);
 static void handle_replay_key_release(struct expansion_work *exp_work);
 
+#if EXPANSION_DRIVER_WIN
 static void win_start_unicode_typing(struct expansion_work *exp_work);
 static void handle_win_uni_press_alt(struct expansion_work *exp_work);
 static void handle_win_uni_type_numpad_press(struct expansion_work *exp_work);
 static void handle_win_uni_type_numpad_release(struct expansion_work *exp_work);
 static void handle_win_uni_release_alt(struct expansion_work *exp_work);
+#endif
 
+#if EXPANSION_DRIVER_MAC
 static void macos_start_unicode_typing(struct expansion_work *exp_work);
 static void handle_mac_uni_press_option(struct expansion_work *exp_work);
 static void handle_mac_uni_type_hex_press(struct expansion_work *exp_work);
 static void handle_mac_uni_type_hex_release(struct expansion_work *exp_work);
 static void handle_mac_uni_release_option(struct expansion_work *exp_work);
+#endif
 
+#if EXPANSION_DRIVER_LINUX
 static void linux_start_unicode_typing(struct expansion_work *exp_work);
 static void handle_linux_uni_press_ctrl_shift(struct expansion_work *exp_work);
 static void handle_linux_uni_press_u(struct expansion_work *exp_work);
@@ -123,14 +304,25 @@ static void handle_linux_uni_type_hex_press(struct expansion_work *exp_work);
 static void handle_linux_uni_type_hex_release(struct expansion_work *exp_work);
 static void handle_linux_uni_press_terminator(struct expansion_work *exp_work);
 static void handle_linux_uni_release_terminator(struct expansion_work *exp_work);
+#endif
 
 
+#if EXPANSION_DRIVER_WIN
 static uint32_t get_numpad_keycode(char digit);
+#endif
+#if EXPANSION_DRIVER_MAC || EXPANSION_DRIVER_LINUX
 static uint32_t get_hex_keycode(char hex_digit);
+#endif
 
+#if EXPANSION_DRIVER_WIN
 const struct os_typing_driver win_driver = { .start_unicode_typing = win_start_unicode_typing };
+#endif
+#if EXPANSION_DRIVER_MAC
 const struct os_typing_driver mac_driver = { .start_unicode_typing = macos_start_unicode_typing };
+#endif
+#if EXPANSION_DRIVER_LINUX
 const struct os_typing_driver linux_driver = { .start_unicode_typing = linux_start_unicode_typing };
+#endif
 
 static k_timeout_t get_typing_delay() {
     uint32_t delay = TYPING_DELAY;
@@ -222,9 +414,8 @@ void cancel_current_expansion(struct expansion_work *work_item, bool partial_und
     if (partial_undo && work_item->characters_typed > 0) {
         LOG_INF("Canceling and initiating partial undo of %d chars", work_item->characters_typed);
         work_item->backspace_count = work_item->characters_typed;
-        work_item->expanded_text = "";
+        text_reader_init(&work_item->text, "");
         work_item->trigger_keycode_to_replay = 0;
-        work_item->text_index = 0;
         work_item->current_keycode = 0;
         work_item->state = EXPANSION_STATE_START_BACKSPACE;
         k_work_reschedule(&work_item->work, K_MSEC(1));
@@ -233,7 +424,7 @@ void cancel_current_expansion(struct expansion_work *work_item, bool partial_und
         // Reset to consistent idle state
         work_item->state = EXPANSION_STATE_IDLE;
         work_item->current_keycode = 0;
-        work_item->text_index = 0;
+        text_reader_init(&work_item->text, "");
         work_item->backspace_count = 0;
         work_item->characters_typed = 0;
         work_item->trigger_keycode_to_replay = 0;
@@ -251,15 +442,18 @@ static void handle_idle(struct expansion_work *exp_work) {
     // No-op
 }
 
+#if EXPANSION_TYPES_UNICODE
 static void handle_unicode_start(struct expansion_work *exp_work) {
     if (expander_data.os_driver && expander_data.os_driver->start_unicode_typing) {
         expander_data.os_driver->start_unicode_typing(exp_work);
     }
 }
+#endif
 
 typedef void (*expansion_state_handler_t)(struct expansion_work *exp_work);
 
-static const expansion_state_handler_t state_handlers[] = {
+// States of the Unicode drivers the dictionary does not need are left NULL
+static const expansion_state_handler_t state_handlers[EXPANSION_STATE_COUNT] = {
     [EXPANSION_STATE_IDLE] = handle_idle,
     [EXPANSION_STATE_START_BACKSPACE] = handle_start_backspace,
     [EXPANSION_STATE_BACKSPACE_PRESS] = handle_backspace_press,
@@ -271,15 +465,22 @@ static const expansion_state_handler_t state_handlers[] = {
     [EXPANSION_STATE_FINISH] = handle_finish,
     [EXPANSION_STATE_REPLAY_KEY_PRESS] = handle_replay_key_press,
     [EXPANSION_STATE_REPLAY_KEY_RELEASE] = handle_replay_key_release,
+#if EXPANSION_TYPES_UNICODE
     [EXPANSION_STATE_UNICODE_START] = handle_unicode_start,
+#endif
+#if EXPANSION_DRIVER_WIN
     [EXPANSION_STATE_WIN_UNI_PRESS_ALT] = handle_win_uni_press_alt,
     [EXPANSION_STATE_WIN_UNI_TYPE_NUMPAD_PRESS] = handle_win_uni_type_numpad_press,
     [EXPANSION_STATE_WIN_UNI_TYPE_NUMPAD_RELEASE] = handle_win_uni_type_numpad_release,
     [EXPANSION_STATE_WIN_UNI_RELEASE_ALT] = handle_win_uni_release_alt,
+#endif
+#if EXPANSION_DRIVER_MAC
     [EXPANSION_STATE_MAC_UNI_PRESS_OPTION] = handle_mac_uni_press_option,
     [EXPANSION_STATE_MAC_UNI_TYPE_HEX_PRESS] = handle_mac_uni_type_hex_press,
     [EXPANSION_STATE_MAC_UNI_TYPE_HEX_RELEASE] = handle_mac_uni_type_hex_release,
     [EXPANSION_STATE_MAC_UNI_RELEASE_OPTION] = handle_mac_uni_release_option,
+#endif
+#if EXPANSION_DRIVER_LINUX
     [EXPANSION_STATE_LINUX_UNI_PRESS_CTRL_SHIFT] = handle_linux_uni_press_ctrl_shift,
     [EXPANSION_STATE_LINUX_UNI_PRESS_U] = handle_linux_uni_press_u,
     [EXPANSION_STATE_LINUX_UNI_RELEASE_U] = handle_linux_uni_release_u,
@@ -288,12 +489,12 @@ static const expansion_state_handler_t state_handlers[] = {
     [EXPANSION_STATE_LINUX_UNI_TYPE_HEX_RELEASE] = handle_linux_uni_type_hex_release,
     [EXPANSION_STATE_LINUX_UNI_PRESS_TERMINATOR] = handle_linux_uni_press_terminator,
     [EXPANSION_STATE_LINUX_UNI_RELEASE_TERMINATOR] = handle_linux_uni_release_terminator,
+#endif
 };
 
-// Compile-time assertion: ensure state_handlers array covers all states
-// This prevents accidental omissions when adding new expansion states
-BUILD_ASSERT(ARRAY_SIZE(state_handlers) == EXPANSION_STATE_LINUX_UNI_RELEASE_TERMINATOR + 1,
-             "state_handlers array must have entries for all expansion states");
+// Undo and the backspace count track expansions in 16 bits
+BUILD_ASSERT(ZMK_TEXT_EXPANDER_GENERATED_MAX_EXPANSION_LEN <= UINT16_MAX,
+             "The longest expansion has more characters than undo can take back");
 
 /**
  * @brief Main work handler for the expansion state machine.
@@ -349,18 +550,66 @@ static void handle_start_typing(struct expansion_work *exp_work) {
     handle_type_char_start(exp_work);
 }
 
+/**
+ * @brief Applies the short code's capitalization to one expansion character.
+ * @param exp_work The expansion work context
+ * @param c ASCII character about to be typed
+ * @return c, capitalized if the case mode asks for it
+ *
+ * Capitalize mode ends at the expansion's first letter.
+ */
+static char apply_expansion_case(struct expansion_work *exp_work, char c) {
+    bool is_lower = c >= 'a' && c <= 'z';
+    if (exp_work->case_mode == EXPANSION_CASE_NONE || !(is_lower || (c >= 'A' && c <= 'Z'))) {
+        return c;
+    }
+    if (exp_work->case_mode == EXPANSION_CASE_CAPITALIZE) {
+        exp_work->case_mode = EXPANSION_CASE_NONE;
+    }
+    return is_lower ? c - 'a' + 'A' : c;
+}
+
+#if EXPANSION_USES_OS_COMMANDS
+/**
+ * @brief Switches the Unicode input method for the rest of the expansion.
+ * @param command EXP_OP_CMD_WIN, EXP_OP_CMD_MAC or EXP_OP_CMD_LINUX
+ *
+ * Without Unicode characters in the dictionary there is no driver to switch
+ * to, and the command is only skipped.
+ */
+static void select_os_driver(uint8_t command) {
+    switch (command) {
+#if EXPANSION_DRIVER_WIN
+        case EXP_OP_CMD_WIN: expander_data.os_driver = &win_driver; break;
+#endif
+#if EXPANSION_DRIVER_MAC
+        case EXP_OP_CMD_MAC: expander_data.os_driver = &mac_driver; break;
+#endif
+#if EXPANSION_DRIVER_LINUX
+        case EXP_OP_CMD_LINUX: expander_data.os_driver = &linux_driver; break;
+#endif
+        default: break;
+    }
+}
+#endif
+
 /**
  * @brief Handles the start of character typing in an expansion.
  * @param exp_work The expansion work context
  * 
  * Processes the current character from expanded text:
  * - OS command bytecodes to switch Unicode input method
- * - ASCII characters using keycode mapping
+ * - ASCII characters using keycode mapping, in the short code's case
  * - UTF-8 multi-byte sequences for Unicode characters
+ * OS commands and UTF-8 decoding are only compiled in if the dictionary
+ * uses them (see expansion_features.h); other bytes above 0x7F are skipped.
+ *
+ * Bytes come from the text reader, which decodes a compressed pool only as
+ * far as the current character needs.
  */
 static void handle_type_char_start(struct expansion_work *exp_work) {
-    const char *text = exp_work->expanded_text;
-    uint8_t current_byte = (uint8_t)text[exp_work->text_index];
+    struct text_reader *text = &exp_work->text;
+    uint8_t current_byte = text_reader_peek(text, 0);
 
     if (current_byte == 0) {
         exp_work->state = EXPANSION_STATE_FINISH;
@@ -368,31 +617,25 @@ static void handle_type_char_start(struct expansion_work *exp_work) {
         return;
     }
 
-    if (current_byte == EXP_OP_CMD_WIN) {
-        expander_data.os_driver = &win_driver;
-        exp_work->text_index++;
-        k_work_reschedule(&exp_work->work, K_NO_WAIT);
-        return;
-    } else if (current_byte == EXP_OP_CMD_MAC) {
-        expander_data.os_driver = &mac_driver;
-        exp_work->text_index++;
+#if EXPANSION_USES_OS_COMMANDS
+    if (current_byte <= EXP_OP_CMD_LINUX) {
+        select_os_driver(current_byte);
+        text_reader_skip(text, 1);
         k_work_reschedule(&exp_work->work, K_NO_WAIT);
         return;
-    } else if (current_byte == EXP_OP_CMD_LINUX) {
-        expander_data.os_driver = &linux_driver;
-        exp_work->text_index++;
-        k_work_reschedule(&exp_work->work, K_NO_WAIT);
-        return;
-    } 
-    
-    uint8_t first_byte = text[exp_work->text_index];
+    }
+#endif
+
+    uint8_t first_byte = current_byte;
 
     if (first_byte < 0x80) {
-        exp_work->current_keycode = char_to_keycode(first_byte, &exp_work->current_char_needs_shift);
+        char c = apply_expansion_case(exp_work, first_byte);
+        exp_work->current_keycode = char_to_keycode(c, &exp_work->current_char_needs_shift);
         exp_work->state = EXPANSION_STATE_TYPE_CHAR_KEY_PRESS;
         k_work_reschedule(&exp_work->work, K_MSEC(CHAR_PRESS_DELAY_MS));
         return;
     } else {
+#if EXPANSION_TYPES_UNICODE
         uint32_t codepoint = 0;
         int utf8_len = 0;
 
@@ -410,12 +653,12 @@ static void handle_type_char_start(struct expansion_work *exp_work) {
         if (utf8_len > 0) {
             for (int i = 1; i < utf8_len; i++) {
                 // Bounds check: ensure we don't read beyond the string
-                if (text[exp_work->text_index + i] == '\0') {
+                uint8_t cont_byte = text_reader_peek(text, i);
+                if (cont_byte == '\0') {
                     LOG_WRN("Malformed UTF-8: unexpected end of string");
                     codepoint = 0;
                     break;
                 }
-                uint8_t cont_byte = text[exp_work->text_index + i];
                 if ((cont_byte & 0xC0) == 0x80) {
                     codepoint |= (cont_byte & 0x3F) << (6 * (utf8_len - 1 - i));
                 } else {
@@ -426,14 +669,15 @@ static void handle_type_char_start(struct expansion_work *exp_work) {
             }
             if (codepoint != 0) {
                 exp_work->unicode_codepoint = codepoint;
-                exp_work->text_index += utf8_len; 
+                text_reader_skip(text, utf8_len);
                 exp_work->state = EXPANSION_STATE_UNICODE_START;
                 k_work_reschedule(&exp_work->work, get_typing_delay());
                 return;
             }
         }
-        
-        exp_work->text_index++;
+#endif
+
+        text_reader_skip(text, 1);
         exp_work->state = EXPANSION_STATE_TYPE_CHAR_START;
         k_work_reschedule(&exp_work->work, K_NO_WAIT);
         return;
@@ -462,7 +706,7 @@ static void handle_type_char_key_release(struct expansion_work *exp_work) {
         exp_work->current_keycode = 0;
     }
     if (exp_work->state != EXPANSION_STATE_UNICODE_START) {
-       exp_work->text_index++;
+       text_reader_skip(&exp_work->text, 1);
     }
 
     exp_work->characters_typed++;
@@ -492,6 +736,7 @@ static void handle_replay_key_release(struct expansion_work *exp_work) {
     exp_work->state = EXPANSION_STATE_IDLE;
 }
 
+#if EXPANSION_DRIVER_WIN
 static void win_start_unicode_typing(struct expansion_work *exp_work) {
     // Convert to decimal string
     u32_to_str_dec(exp_work->unicode_codepoint, exp_work->unicode_hex_buffer, sizeof(exp_work->unicode_hex_buffer));
@@ -530,7 +775,9 @@ static void handle_win_uni_release_alt(struct expansion_work *exp_work) {
     exp_work->state = EXPANSION_STATE_TYPE_CHAR_START;
     k_work_reschedule(&exp_work->work, get_typing_delay());
 }
+#endif
 
+#if EXPANSION_DRIVER_MAC
 static void macos_start_unicode_typing(struct expansion_work *exp_work) {
     // Convert to hex string (pad to 4)
     u32_to_str_hex(exp_work->unicode_codepoint, exp_work->unicode_hex_buffer, sizeof(exp_work->unicode_hex_buffer), true);
@@ -569,7 +816,9 @@ static void handle_mac_uni_release_option(struct expansion_work *exp_work) {
     exp_work->state = EXPANSION_STATE_TYPE_CHAR_START;
     k_work_reschedule(&exp_work->work, get_typing_delay());
 }
+#endif
 
+#if EXPANSION_DRIVER_LINUX
 static void linux_start_unicode_typing(struct expansion_work *exp_work) {
     // Convert to hex string (no padding)
     u32_to_str_hex(exp_work->unicode_codepoint, exp_work->unicode_hex_buffer, sizeof(exp_work->unicode_hex_buffer), false);
@@ -628,7 +877,9 @@ static void handle_linux_uni_release_terminator(struct expansion_work *exp_work)
     exp_work->state = EXPANSION_STATE_TYPE_CHAR_START;
     k_work_reschedule(&exp_work->work, get_typing_delay());
 }
+#endif
 
+#if EXPANSION_DRIVER_WIN
 static uint32_t get_numpad_keycode(char digit) {
     switch (digit) {
         case '0': return HID_USAGE_KEY_KEYPAD_0_AND_INSERT;
@@ -644,7 +895,9 @@ static uint32_t get_numpad_keycode(char digit) {
         default:  return 0;
     }
 }
+#endif
 
+#if EXPANSION_DRIVER_MAC || EXPANSION_DRIVER_LINUX
 static uint32_t get_hex_keycode(char hex_digit) {
     char d = tolower(hex_digit);
     if (d >= '0' && d <= '9') {
@@ -656,15 +909,22 @@ static uint32_t get_hex_keycode(char hex_digit) {
     }
     return 0;
 }
+#endif
 
 int start_expansion(struct expansion_work *work_item, const char *expanded_text, uint16_t len_to_delete, uint16_t trigger_keycode) {
-    LOG_INF("Starting expansion: text='%s', backspaces=%d, replay_keycode=0x%04X", expanded_text, len_to_delete, trigger_keycode);
+    struct text_reader text;
+    text_reader_init(&text, expanded_text);
+    return start_expansion_from_reader(work_item, &text, len_to_delete, trigger_keycode, EXPANSION_CASE_NONE);
+}
+
+int start_expansion_from_reader(struct expansion_work *work_item, const struct text_reader *text, uint16_t len_to_delete, uint16_t trigger_keycode, enum expansion_case case_mode) {
+    LOG_INF("Starting expansion: text='%s', backspaces=%d, replay_keycode=0x%04X", text->src, len_to_delete, trigger_keycode);
     cancel_current_expansion(work_item, false);
 
-    work_item->expanded_text = expanded_text;
+    work_item->text = *text;
     work_item->trigger_keycode_to_replay = trigger_keycode;
     work_item->backspace_count = len_to_delete;
-    work_item->text_index = 0;
+    work_item->case_mode = case_mode;
     work_item->shift_mod_active = false;
     work_item->current_keycode = 0;
     work_item->characters_typed = 0;
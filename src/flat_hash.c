@@ -0,0 +1,161 @@
+#include <zephyr/logging/log.h>
+#include <zmk/trie.h>
+#include <stddef.h>
+#include <string.h>
+
+LOG_MODULE_REGISTER(flat_hash, LOG_LEVEL_DBG);
+
+// FNV-1a over the bytes of the short code (Must match scripts/gen_trie.py)
+#define FLAT_HASH_OFFSET_BASIS 0x811C9DC5U
+#define FLAT_HASH_PRIME 0x01000193U
+#define FLAT_HASH_MIX 0x85EBCA6BU
+
+static inline uint32_t hash_step(uint32_t hash, char c) {
+    return (hash ^ (uint8_t)c) * FLAT_HASH_PRIME;
+}
+
+/**
+ * @brief Returns the slot the probe for a hash starts from.
+ * @param hash FNV-1a hash of the short code
+ * @param num_slots Number of rows in the table
+ * @return Slot index below num_slots
+ *
+ * The hash is mixed before it is mapped onto the table: the high bits of
+ * FNV-1a barely depend on the last bytes of a short key, so short codes that
+ * differ only at the end would otherwise share a probe run.
+ */
+static inline trie_index_t home_slot(uint32_t hash, trie_index_t num_slots) {
+    hash ^= hash >> 16;
+    hash *= FLAT_HASH_MIX;
+    hash ^= hash >> 13;
+    // Maps the hash onto [0, num_slots) with a multiply instead of a division
+    return (trie_index_t)(((uint64_t)hash * num_slots) >> 32);
+}
+
+/**
+ * @brief Finds the row of a whole short code from its hash and length.
+ * @param hash FNV-1a hash of the short code
+ * @param len Length of the short code in bytes
+ * @return Pointer to the short code's row, or NULL if there is none
+ *
+ * Probes linearly from the home slot until the fingerprint matches or an
+ * empty row ends the run. The build script keeps the table at most 70% full
+ * and places the most used short codes first, so a trigger usually costs a
+ * single probe. The probe count is bounded anyway, in case a flash
+ * dictionary image has no empty row.
+ */
+static const struct trie_node *find_short_code(uint32_t hash, uint8_t len) {
+    trie_index_t num_slots = zmk_text_expander_trie_num_nodes;
+    if (num_slots == 0 || len == 0) {
+        return NULL;
+    }
+
+    trie_index_t slot = home_slot(hash, num_slots);
+    for (trie_index_t probes = 0; probes < num_slots; probes++) {
+        const struct trie_node *node = &zmk_text_expander_trie_nodes[slot];
+        if (node->key_len == 0) {
+            return NULL;
+        }
+        if (node->key_hash == hash && node->key_len == len) {
+            return node;
+        }
+        if (++slot == num_slots) {
+            slot = 0;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Looks a whole short code up.
+ * @param key The short code
+ * @return Pointer to its node if it is a short code, NULL otherwise
+ *
+ * The flat hash engine stores no prefixes, so this is the same as trie_search().
+ */
+const struct trie_node *trie_get_node_for_key(const char *key) {
+    if (!key) {
+        return NULL;
+    }
+
+    size_t key_len = strlen(key);
+    if (key_len > UINT8_MAX) {
+        return NULL;
+    }
+
+    uint32_t hash = FLAT_HASH_OFFSET_BASIS;
+    for (size_t i = 0; i < key_len; i++) {
+        hash = hash_step(hash, key[i]);
+    }
+    return find_short_code(hash, (uint8_t)key_len);
+}
+
+/**
+ * @brief Rewinds a cursor to the empty string.
+ * @param cursor The cursor to reset
+ */
+void trie_cursor_reset(struct trie_cursor *cursor) {
+    cursor->hash = FLAT_HASH_OFFSET_BASIS;
+    cursor->depth = 0;
+}
+
+/**
+ * @brief Advances a cursor by one typed character.
+ * @param cursor The cursor to advance
+ * @param c The character that was typed
+ * @return Always true, since any text may still turn into a short code as far
+ *         as the flat hash engine can tell
+ *
+ * Folds c into the rolling hash in constant time. Like the trie cursor, it
+ * cannot be rolled back; callers that need to undo a character keep a copy
+ * of the previous cursor instead.
+ */
+bool trie_cursor_advance(struct trie_cursor *cursor, char c) {
+    cursor->hash = hash_step(cursor->hash, c);
+    if (cursor->depth < UINT8_MAX) {
+        cursor->depth++;
+    }
+    return true;
+}
+
+/**
+ * @brief Returns the short code the consumed characters spell, if any.
+ * @param cursor The cursor to inspect
+ * @return Pointer to the short code's node, or NULL
+ *
+ * This is where the flat hash engine does its lookup: one table probe in the
+ * common case, however long the short code.
+ */
+const struct trie_node *trie_cursor_get_terminal(const struct trie_cursor *cursor) {
+    return find_short_code(cursor->hash, cursor->depth);
+}
+
+/**
+ * @brief Returns how many consumed characters the short code found by
+ * trie_cursor_get_terminal() covers.
+ * @param cursor The cursor to inspect
+ * @return Short code length in bytes, 0 if there is no match
+ */
+uint8_t trie_cursor_get_match_len(const struct trie_cursor *cursor) {
+    return trie_cursor_get_terminal(cursor) ? cursor->depth : 0;
+}
+
+/**
+ * @brief Returns how many characters the cursor has consumed.
+ * @param cursor The cursor to inspect
+ * @return Length in bytes
+ */
+uint8_t trie_cursor_get_prefix_len(const struct trie_cursor *cursor) {
+    return cursor->depth;
+}
+
+const struct trie_node *trie_search(const char *key) {
+    LOG_DBG("trie_search called for key: \"%s\"", key);
+    const struct trie_node *node = trie_get_node_for_key(key);
+    if (node) {
+        LOG_DBG("Short code found. Search successful.");
+        return node;
+    }
+    LOG_DBG("Short code not found. Search failed.");
+    return NULL;
+}
@@ -110,8 +110,12 @@ uint32_t char_to_keycode(char c, bool *needs_shift) {
     unsigned char uc = (unsigned char)c;
 
     if (uc < KEYCODE_LUT_OFFSET || uc >= (KEYCODE_LUT_OFFSET + KEYCODE_LUT_SIZE)) {
+#if EXPANSION_TYPES_NEWLINE
         if (c == '\n') { return HID_USAGE_KEY_KEYBOARD_RETURN_ENTER; }
+#endif
+#if EXPANSION_TYPES_TAB
         if (c == '\t') { return HID_USAGE_KEY_KEYBOARD_TAB; }
+#endif
         if (c == '\b') { return HID_USAGE_KEY_KEYBOARD_DELETE_BACKSPACE; }
         LOG_WRN("Character '%c' (0x%02X) out of lookup table range", c, uc);
         return 0;
@@ -82,6 +82,32 @@ static const keycode_map_entry_t keycode_lut[KEYCODE_LUT_SIZE] __attribute__((se
     [IDX('|')] = MAP_S(BACKSLASH_AND_PIPE),
     [IDX('}')] = MAP_S(RIGHT_BRACKET_AND_RIGHT_BRACE),
     [IDX('~')] = MAP_S(GRAVE_ACCENT_AND_TILDE),
+    [IDX('a')] = MAP_U(A), [IDX('A')] = MAP_S(A),
+    [IDX('b')] = MAP_U(B), [IDX('B')] = MAP_S(B),
+    [IDX('c')] = MAP_U(C), [IDX('C')] = MAP_S(C),
+    [IDX('d')] = MAP_U(D), [IDX('D')] = MAP_S(D),
+    [IDX('e')] = MAP_U(E), [IDX('E')] = MAP_S(E),
+    [IDX('f')] = MAP_U(F), [IDX('F')] = MAP_S(F),
+    [IDX('g')] = MAP_U(G), [IDX('G')] = MAP_S(G),
+    [IDX('h')] = MAP_U(H), [IDX('H')] = MAP_S(H),
+    [IDX('i')] = MAP_U(I), [IDX('I')] = MAP_S(I),
+    [IDX('j')] = MAP_U(J), [IDX('J')] = MAP_S(J),
+    [IDX('k')] = MAP_U(K), [IDX('K')] = MAP_S(K),
+    [IDX('l')] = MAP_U(L), [IDX('L')] = MAP_S(L),
+    [IDX('m')] = MAP_U(M), [IDX('M')] = MAP_S(M),
+    [IDX('n')] = MAP_U(N), [IDX('N')] = MAP_S(N),
+    [IDX('o')] = MAP_U(O), [IDX('O')] = MAP_S(O),
+    [IDX('p')] = MAP_U(P), [IDX('P')] = MAP_S(P),
+    [IDX('q')] = MAP_U(Q), [IDX('Q')] = MAP_S(Q),
+    [IDX('r')] = MAP_U(R), [IDX('R')] = MAP_S(R),
+    [IDX('s')] = MAP_U(S), [IDX('S')] = MAP_S(S),
+    [IDX('t')] = MAP_U(T), [IDX('T')] = MAP_S(T),
+    [IDX('u')] = MAP_U(U), [IDX('U')] = MAP_S(U),
+    [IDX('v')] = MAP_U(V), [IDX('V')] = MAP_S(V),
+    [IDX('w')] = MAP_U(W), [IDX('W')] = MAP_S(W),
+    [IDX('x')] = MAP_U(X), [IDX('X')] = MAP_S(X),
+    [IDX('y')] = MAP_U(Y), [IDX('Y')] = MAP_S(Y),
+    [IDX('z')] = MAP_U(Z), [IDX('Z')] = MAP_S(Z),
 };
 
 uint32_t char_to_keycode(char c, bool *needs_shift) {
@@ -91,8 +117,12 @@ uint32_t char_to_keycode(char c, bool *needs_shift) {
     unsigned char uc = (unsigned char)c;
 
     if (uc < KEYCODE_LUT_OFFSET || uc >= (KEYCODE_LUT_OFFSET + KEYCODE_LUT_SIZE)) {
+#if EXPANSION_TYPES_NEWLINE
         if (c == '\n') { return HID_USAGE_KEY_KEYBOARD_RETURN_ENTER; }
+#endif
+#if EXPANSION_TYPES_TAB
         if (c == '\t') { return HID_USAGE_KEY_KEYBOARD_TAB; }
+#endif
         if (c == '\b') { return HID_USAGE_KEY_KEYBOARD_DELETE_BACKSPACE; }
         LOG_WRN("Character '%c' (0x%02X) out of lookup table range", c, uc);
         return 0;
@@ -106,14 +136,6 @@ uint32_t char_to_keycode(char c, bool *needs_shift) {
         return keycode;
     }
 
-    if (c >= 'a' && c <= 'z') {
-        *needs_shift = false;
-        keycode = HID_USAGE_KEY_KEYBOARD_A + (c - 'a');
-    } else if (c >= 'A' && c <= 'Z') {
-        *needs_shift = true;
-        keycode = HID_USAGE_KEY_KEYBOARD_A + (c - 'A');
-    }
-
     LOG_DBG("Converted '%c' to keycode 0x%04X with shift %s", c, keycode, *needs_shift ? "true" : "false");
     return keycode;
 }
@@ -13,6 +13,9 @@
 #include <zmk/keymap.h>
 #include <zmk/text_expander.h>
 #include <zmk/trie.h>
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_FLASH_DICTIONARY
+#include <zmk/trie_image.h>
+#endif
 #include <zmk/expansion_engine.h>
 #include <zmk/keymap_utils.h>
 
@@ -37,15 +40,20 @@ static const uint32_t undo_keycodes[] = DT_INST_PROP_OR(0, undo_keycodes, {});
 
 struct text_expander_data expander_data;
 
+#if CONFIG_ZMK_TEXT_EXPANDER_RAM_BUDGET > 0
+BUILD_ASSERT(sizeof(struct text_expander_data) <= CONFIG_ZMK_TEXT_EXPANDER_RAM_BUDGET,
+             "The text expander state is over CONFIG_ZMK_TEXT_EXPANDER_RAM_BUDGET");
+#endif
+
 static void process_event(struct text_expander_event *ev);
 static bool handle_undo(uint16_t keycode);
-static void handle_alphanumeric(char next_char);
+static void handle_alphanumeric(char next_char, bool upper);
 static void handle_backspace();
 static void handle_auto_expand(uint16_t keycode);
 static void handle_reset_buffer_check();
 static bool trigger_expansion(const char *short_code, enum expansion_context context, uint16_t trigger_keycode);
 #if DT_INST_NODE_HAS_PROP(0, undo_keycodes)
-static void save_undo_state(const char *short_code, size_t short_len, uint16_t expanded_len, uint16_t trigger_keycode, bool is_completion);
+static void save_undo_state(const char *short_code, size_t short_len, uint16_t expanded_len, uint16_t trigger_keycode, uint8_t kept_len);
 #endif
 
 void text_expander_processor_work_handler(struct k_work *work);
@@ -61,7 +69,73 @@ static bool keycode_in_array(uint16_t keycode, const uint32_t* arr, size_t len)
     return false;
 }
 
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_CASE_PRESERVING
+static bool is_case_keycode(uint16_t keycode) {
+    return keycode == HID_USAGE_KEY_KEYBOARD_LEFTSHIFT || keycode == HID_USAGE_KEY_KEYBOARD_RIGHTSHIFT ||
+           keycode == HID_USAGE_KEY_KEYBOARD_CAPS_LOCK;
+}
+
+/**
+ * @brief Follows the Shift keys.
+ * @param ev Key event, seen even while an expansion is being typed so no release is missed
+ *
+ * Caps Lock is left to the host: only Shift makes a typed letter a capital,
+ * and the expansion is typed the same way, so the host's Caps Lock applies to
+ * it as it did to the short code. The lock state the host holds cannot drift
+ * from a count of presses kept here.
+ */
+static void update_case_state(const struct text_expander_event *ev) {
+    uint8_t shift = 0;
+    if (ev->keycode == HID_USAGE_KEY_KEYBOARD_LEFTSHIFT) {
+        shift = MOD_LSFT;
+    } else if (ev->keycode == HID_USAGE_KEY_KEYBOARD_RIGHTSHIFT) {
+        shift = MOD_RSFT;
+    }
+
+    if (ev->pressed) {
+        expander_data.shift_held |= shift;
+    } else {
+        expander_data.shift_held &= ~shift;
+    }
+}
+
+static bool is_typed_upper(char c, uint8_t modifiers) {
+    if (c < 'a' || c > 'z') {
+        return false;
+    }
+    return ((expander_data.shift_held | modifiers) & (MOD_LSFT | MOD_RSFT)) != 0;
+}
+
+/**
+ * @brief Works out how a matched short code was capitalized.
+ * @param start Offset of the short code in current_short
+ * @param len Length of the short code
+ * @return EXPANSION_CASE_UPPER if all of at least two letters were capitals,
+ *         EXPANSION_CASE_CAPITALIZE if the first letter was, else EXPANSION_CASE_NONE
+ */
+static enum expansion_case get_short_code_case(size_t start, size_t len) {
+    uint8_t letters = 0;
+    uint8_t upper = 0;
+    bool first_upper = false;
+
+    for (size_t i = start; i < start + len; i++) {
+        char c = expander_data.current_short[i];
+        if (c < 'a' || c > 'z') {
+            continue;
+        }
+        if (letters == 0) {
+            first_upper = expander_data.current_short_upper[i];
+        }
+        letters++;
+        upper += expander_data.current_short_upper[i];
+    }
 
+    if (letters >= 2 && upper == letters) {
+        return EXPANSION_CASE_UPPER;
+    }
+    return first_upper ? EXPANSION_CASE_CAPITALIZE : EXPANSION_CASE_NONE;
+}
+#endif
 
 /**
  * @brief Resets the current short code buffer to empty state.
@@ -71,21 +145,66 @@ static void reset_current_short(void) {
     LOG_DBG("Resetting current short code. Was: '%s'", expander_data.current_short);
     memset(expander_data.current_short, 0, MAX_SHORT_LEN);
     expander_data.current_short_len = 0;
+    trie_cursor_reset(&expander_data.cursor);
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_OVERLAY
+    trie_overlay_cursor_reset(&expander_data.overlay_cursor);
+#endif
 }
 
 /**
  * @brief Appends a character to the current short code buffer.
  * @param c Character to add
+ * @param upper Whether c was typed as a capital letter
+ * @return true if the buffer still spells a prefix of a stored short code
  * 
  * Adds the character if space is available, otherwise logs a warning.
+ * The trie cursor advances by the same character, and its previous state is
+ * kept so that a backspace can restore it without re-walking the trie. The
+ * overlay cursor, for short codes added at runtime, is kept the same way.
+ * In Aho-Corasick mode a full buffer drops its oldest character instead, since
+ * no match can reach that far back.
  */
-static void add_to_current_short(char c) {
+static bool add_to_current_short(char c, bool upper) {
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_AHO_CORASICK
+    if (expander_data.current_short_len >= MAX_SHORT_LEN - 1) {
+        uint8_t keep = expander_data.current_short_len - 1;
+        memmove(expander_data.current_short, expander_data.current_short + 1, keep);
+        memmove(expander_data.cursor_history, expander_data.cursor_history + 1, keep * sizeof(struct trie_cursor));
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_OVERLAY
+        memmove(expander_data.overlay_history, expander_data.overlay_history + 1, keep * sizeof(struct trie_overlay_cursor));
+#endif
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_CASE_PRESERVING
+        memmove(expander_data.current_short_upper, expander_data.current_short_upper + 1, keep);
+#endif
+        expander_data.current_short_len = keep;
+    }
+#endif
     if (expander_data.current_short_len < MAX_SHORT_LEN - 1) {
+        expander_data.cursor_history[expander_data.current_short_len] = expander_data.cursor;
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_OVERLAY
+        expander_data.overlay_history[expander_data.current_short_len] = expander_data.overlay_cursor;
+        trie_overlay_cursor_advance(&expander_data.overlay_cursor, c);
+#endif
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_CASE_PRESERVING
+        expander_data.current_short_upper[expander_data.current_short_len] = upper;
+#endif
         expander_data.current_short[expander_data.current_short_len++] = c;
         expander_data.current_short[expander_data.current_short_len] = '\0';
+        trie_cursor_advance(&expander_data.cursor, c);
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_USAGE_COUNTERS
+        trie_usage_record_step(&expander_data.cursor);
+#endif
     } else {
         LOG_WRN("Short code buffer full at length %d. Ignoring character '%c'.", expander_data.current_short_len, c);
     }
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_TRIE_FLAT_HASH
+    // The flat hash engine only knows whole short codes
+    return true;
+#elif defined(CONFIG_ZMK_TEXT_EXPANDER_OVERLAY)
+    return expander_data.cursor.node_index != NULL_INDEX || trie_overlay_cursor_is_prefix(&expander_data.overlay_cursor);
+#else
+    return expander_data.cursor.node_index != NULL_INDEX;
+#endif
 }
 
 static int text_expander_keycode_state_changed_listener(const zmk_event_t *eh) {
@@ -97,6 +216,7 @@ static int text_expander_keycode_state_changed_listener(const zmk_event_t *eh) {
     struct text_expander_event ev_msg = {
         .type = TE_EV_KEY_PRESS,
         .keycode = ev->keycode,
+        .modifiers = ev->implicit_modifiers | ev->explicit_modifiers,
         .pressed = ev->state
     };
 
@@ -135,7 +255,11 @@ static void handle_key_press_event(struct text_expander_event *ev) {
 
     char next_char = keycode_to_short_code_char(ev->keycode);
     if (next_char != '\0') {
-        handle_alphanumeric(next_char);
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_CASE_PRESERVING
+        handle_alphanumeric(next_char, is_typed_upper(next_char, ev->modifiers));
+#else
+        handle_alphanumeric(next_char, false);
+#endif
     } else if (ev->keycode == HID_USAGE_KEY_KEYBOARD_DELETE_BACKSPACE) {
         handle_backspace();
     } else if (keycode_in_array(ev->keycode, auto_expand_keycodes, ARRAY_SIZE(auto_expand_keycodes))) {
@@ -144,6 +268,10 @@ static void handle_key_press_event(struct text_expander_event *ev) {
         handle_reset_buffer_check();
     } else if (keycode_in_array(ev->keycode, ignored_keycodes, ARRAY_SIZE(ignored_keycodes))) {
         // Ignore
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_CASE_PRESERVING
+    } else if (is_case_keycode(ev->keycode)) {
+        // Tracked by update_case_state, part of typing the short code
+#endif
     } else {
         handle_reset_buffer_check();
     }
@@ -151,6 +279,12 @@ static void handle_key_press_event(struct text_expander_event *ev) {
 
 static void process_event(struct text_expander_event *ev) {
     // Mutex is already held by the caller (text_expander_processor_work_handler)
+
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_CASE_PRESERVING
+    if (ev->type == TE_EV_KEY_PRESS) {
+        update_case_state(ev);
+    }
+#endif
     
     // Handle reset/undo keys during expansion (now mutex-protected)
     if (expander_data.expansion_work_item.state != EXPANSION_STATE_IDLE) {
@@ -185,10 +319,8 @@ static void process_event(struct text_expander_event *ev) {
                     cleanup_backspaces = current_backspace_count;
                 }
 
-                const char* short_code_to_restore = expander_data.last_short_code;
-                if (expander_data.last_expansion_was_completion) {
-                    short_code_to_restore = "";
-                }
+                // Only the part of the short code that was backspaced is retyped
+                const char* short_code_to_restore = expander_data.last_short_code + expander_data.last_kept_len;
                 reset_current_short();
                 start_expansion(&expander_data.expansion_work_item, short_code_to_restore, cleanup_backspaces, NO_REPLAY_KEY);
                 return;
@@ -234,15 +366,18 @@ static bool handle_undo(uint16_t keycode) {
         expander_data.just_expanded = false;
         if (keycode_in_array(keycode, undo_keycodes, ARRAY_SIZE(undo_keycodes))) {
             
+            // The kept start of the short code is still on screen, as the start of the expansion
+            const char *short_code_to_restore = expander_data.last_short_code + expander_data.last_kept_len;
             uint16_t undo_backspaces = expander_data.last_expanded_len;
+            undo_backspaces -= MIN(undo_backspaces, expander_data.last_kept_len);
             
             if (expander_data.last_trigger_keycode != 0) {
                 undo_backspaces++;
             }
-            LOG_INF("Undo triggered. Restoring '%s', backspacing %d", expander_data.last_short_code, undo_backspaces);
+            LOG_INF("Undo triggered. Restoring '%s', backspacing %d", short_code_to_restore, undo_backspaces);
             
             reset_current_short();
-            start_expansion(&expander_data.expansion_work_item, expander_data.last_short_code, undo_backspaces, NO_REPLAY_KEY);
+            start_expansion(&expander_data.expansion_work_item, short_code_to_restore, undo_backspaces, NO_REPLAY_KEY);
             return true;
         }
     }
@@ -255,21 +390,21 @@ static bool handle_undo(uint16_t keycode) { return false; }
 /**
  * @brief Handles alphanumeric character input and manages aggressive reset mode.
  * @param next_char The character to process
+ * @param upper Whether the character was typed as a capital letter
  * 
- * Adds character to short code buffer. In aggressive reset mode, validates
- * against trie and resets if no matching prefix exists.
+ * Adds character to short code buffer. In aggressive reset mode, resets as
+ * soon as the trie cursor reports that no matching prefix exists.
  */
-static void handle_alphanumeric(char next_char) {
-    add_to_current_short(next_char);
+static void handle_alphanumeric(char next_char, bool upper) {
     #ifdef CONFIG_ZMK_TEXT_EXPANDER_AGGRESSIVE_RESET_MODE
-    if (expander_data.current_short_len > 0) {
-        if (!trie_get_node_for_key(expander_data.current_short)) {
-            reset_current_short();
-            #ifdef CONFIG_ZMK_TEXT_EXPANDER_RESTART_AFTER_RESET_WITH_TRIGGER_CHAR
-            add_to_current_short(next_char);
-            #endif
-        }
+    if (!add_to_current_short(next_char, upper)) {
+        reset_current_short();
+        #ifdef CONFIG_ZMK_TEXT_EXPANDER_RESTART_AFTER_RESET_WITH_TRIGGER_CHAR
+        add_to_current_short(next_char, upper);
+        #endif
     }
+    #else
+    add_to_current_short(next_char, upper);
     #endif
 }
 
@@ -289,6 +424,10 @@ static void handle_backspace() {
         }
         
         expander_data.current_short[expander_data.current_short_len] = '\0';
+        expander_data.cursor = expander_data.cursor_history[expander_data.current_short_len];
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_OVERLAY
+        expander_data.overlay_cursor = expander_data.overlay_history[expander_data.current_short_len];
+#endif
     }
 }
 
@@ -313,48 +452,139 @@ static void handle_reset_buffer_check() {
  * @param trigger_keycode The keycode that triggered the expansion (e.g., Space)
  * @return true if expansion was triggered, false if short code not found
  * 
- * Looks up the short code in the trie, determines if it's a completion or replacement,
- * saves undo state, and starts the expansion engine.
+ * Takes the node from the live trie cursor, determines if it's a completion or
+ * replacement, saves undo state, and starts the expansion engine. In
+ * Aho-Corasick mode the match may be a suffix of short_code; only that suffix
+ * is replaced. With prefix completion, a manual trigger on a prefix that is not
+ * itself a short code expands the best-ranked short code starting with it.
+ * With fuzzy matching, a manual trigger on text that is neither corrects a
+ * single typo, replacing everything typed.
+ * With case preservation, the short code's capitalization is applied to the
+ * expansion as it is typed.
+ * Autocorrect entries keep the start they share with the short code on
+ * screen, so only the differing tail is backspaced and retyped.
+ * Short codes added to the overlay at runtime take precedence over the
+ * generated ones; they match the whole typed buffer.
  */
 static bool trigger_expansion(const char *short_code, enum expansion_context context, uint16_t trigger_keycode) {
-    const struct trie_node *node = trie_search(short_code);
-    if (!node) return false;
-
-    const char *expanded_ptr = zmk_text_expander_get_string(node->expanded_text_offset);
+    const struct trie_node *node = trie_cursor_get_terminal(&expander_data.cursor);
+    size_t short_len = trie_cursor_get_match_len(&expander_data.cursor);
+    // Whether the typed text is the matched short code (or a prefix of it)
+    bool typed_short_code = true;
+    const char *expanded_ptr = NULL;
+    uint16_t expanded_len_chars = 0;
+    bool preserve_trigger = false;
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_OVERLAY
+    struct trie_overlay_match added;
+    if (trie_overlay_cursor_get_match(&expander_data.overlay_cursor, &added) &&
+        added.short_len <= expander_data.current_short_len) {
+        node = NULL;
+        short_len = added.short_len;
+        expanded_ptr = added.expanded_text;
+        expanded_len_chars = added.expanded_len_chars;
+        preserve_trigger = added.preserve_trigger;
+    }
+#endif
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_PREFIX_COMPLETION
+    // A manual trigger on an unfinished short code expands its best completion
+    if (!node && !expanded_ptr && context == EXPAND_FROM_MANUAL_TRIGGER &&
+        trie_cursor_get_completions(&expander_data.cursor, &node, 1) == 1) {
+        short_len = trie_cursor_get_prefix_len(&expander_data.cursor);
+    }
+#endif
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_FUZZY_MATCH
+    // Typos are only corrected on request: on an auto trigger, ordinary words
+    // one letter away from a short code would be rewritten too
+    if (!node && !expanded_ptr && context == EXPAND_FROM_MANUAL_TRIGGER) {
+        uint32_t steps;
+        uint32_t start_cycles = k_cycle_get_32();
+        node = trie_search_fuzzy(expander_data.current_short, expander_data.current_short_len, &steps);
+        LOG_DBG("Fuzzy lookup took %u steps, %u us", steps, k_cyc_to_us_floor32(k_cycle_get_32() - start_cycles));
+        short_len = expander_data.current_short_len;
+        typed_short_code = false;
+    }
+#endif
+    if (node) {
+        expanded_ptr = zmk_text_expander_get_string(node->expanded_text_offset);
+        expanded_len_chars = node->expanded_len_chars;
+        preserve_trigger = node->preserve_trigger;
+    }
     if (!expanded_ptr) return false;
 
-    size_t short_len = strlen(short_code);
-    uint16_t len_to_delete = short_len + (context == EXPAND_FROM_AUTO_TRIGGER ? 1 : 0);
-    const char *text_for_engine = expanded_ptr;
-
-    bool is_completion = (strncmp(expanded_ptr, short_code, short_len) == 0);
-
-    if (is_completion) {
-        text_for_engine = expanded_ptr + short_len;
-        len_to_delete = (context == EXPAND_FROM_AUTO_TRIGGER ? 1 : 0);
+    if (short_len == 0 || short_len > expander_data.current_short_len) {
+        // The match starts in characters that have already left the buffer
+        return false;
+    }
+    size_t short_start = expander_data.current_short_len - short_len;
+    short_code += short_start;
+
+    // Bytes of the typed short code that stay on screen as the start of the expansion
+    uint8_t kept_len = 0;
+    struct text_reader text_for_engine;
+    if ((uint8_t)expanded_ptr[0] == EXP_OP_KEEP) {
+        kept_len = (uint8_t)expanded_ptr[1];
+        if (!typed_short_code || kept_len > short_len) {
+            // The kept bytes are the entry's own short code, which is not what is on screen
+            return false;
+        }
+        text_reader_init(&text_for_engine, expanded_ptr + 2);
+    } else {
+        // The reader decodes the pool in place, so the completion check walks the
+        // same stream the engine will type from.
+        text_reader_init(&text_for_engine, expanded_ptr);
+        if (text_reader_consume_prefix(&text_for_engine, short_code, short_len)) {
+            kept_len = short_len;
+        } else {
+            text_reader_init(&text_for_engine, expanded_ptr);
+        }
+    }
+    uint16_t len_to_delete = short_len - kept_len + (context == EXPAND_FROM_AUTO_TRIGGER ? 1 : 0);
+
+    enum expansion_case case_mode = EXPANSION_CASE_NONE;
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_CASE_PRESERVING
+    case_mode = get_short_code_case(short_start, short_len);
+    if (kept_len > 0 && case_mode == EXPANSION_CASE_CAPITALIZE) {
+        // The capital is already on screen in the typed prefix
+        case_mode = EXPANSION_CASE_NONE;
     }
+#endif
 
-    uint16_t keycode_to_replay = node->preserve_trigger ? trigger_keycode : NO_REPLAY_KEY;
+    uint16_t keycode_to_replay = preserve_trigger ? trigger_keycode : NO_REPLAY_KEY;
 
     #if DT_INST_NODE_HAS_PROP(0, undo_keycodes)
-    save_undo_state(short_code, short_len, node->expanded_len_chars, keycode_to_replay, is_completion);
+    save_undo_state(short_code, short_len, expanded_len_chars, keycode_to_replay, kept_len);
     #endif
 
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_USAGE_COUNTERS
+    if (node) {
+        trie_usage_record_expansion(node);
+    }
+#endif
+
     reset_current_short();
-    start_expansion(&expander_data.expansion_work_item, text_for_engine, len_to_delete, keycode_to_replay);
+    start_expansion_from_reader(&expander_data.expansion_work_item, &text_for_engine, len_to_delete, keycode_to_replay, case_mode);
     return true;
 }
 
 #if DT_INST_NODE_HAS_PROP(0, undo_keycodes)
-static void save_undo_state(const char *short_code, size_t short_len, uint16_t expanded_len, uint16_t trigger_keycode, bool is_completion) {
+static void save_undo_state(const char *short_code, size_t short_len, uint16_t expanded_len, uint16_t trigger_keycode, uint8_t kept_len) {
     memset(expander_data.last_short_code, 0, MAX_SHORT_LEN);
     size_t copy_len = short_len >= MAX_SHORT_LEN ? MAX_SHORT_LEN - 1 : short_len;
     memcpy(expander_data.last_short_code, short_code, copy_len);
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_CASE_PRESERVING
+    // Undo retypes the short code the way it was typed
+    const bool *upper = expander_data.current_short_upper + (short_code - expander_data.current_short);
+    for (size_t i = 0; i < copy_len; i++) {
+        if (upper[i]) {
+            expander_data.last_short_code[i] += 'A' - 'a';
+        }
+    }
+#endif
     
     expander_data.last_expanded_len = expanded_len; 
     expander_data.last_trigger_keycode = trigger_keycode;
     expander_data.just_expanded = true;
-    expander_data.last_expansion_was_completion = is_completion;
+    expander_data.last_kept_len = kept_len < copy_len ? kept_len : copy_len;
 }
 #endif
 
@@ -390,9 +620,22 @@ static int text_expander_init(const struct device *dev) {
 
     k_mutex_init(&expander_data.mutex);
     k_msgq_init(&expander_data.event_msgq, expander_data.event_msgq_buffer, sizeof(struct text_expander_event), KEY_EVENT_QUEUE_SIZE);
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_FLASH_DICTIONARY
+    if (trie_image_load() != 0) {
+        LOG_ERR("Text expansion disabled: no usable dictionary image");
+    }
+#endif
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_NODE_CACHE
+    trie_node_cache_init();
+#endif
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_STACKED_DICTIONARIES
+    trie_set_enabled_dictionaries(DT_INST_PROP_OR(0, enabled_dictionaries, UINT8_MAX));
+#endif
     reset_current_short();
 
-    #if CONFIG_ZMK_TEXT_EXPANDER_DEFAULT_OS_LINUX
+    #if !EXPANSION_TYPES_UNICODE
+        // Pure ASCII dictionary: no Unicode input driver is built
+    #elif CONFIG_ZMK_TEXT_EXPANDER_DEFAULT_OS_LINUX
         extern const struct os_typing_driver linux_driver;
         expander_data.os_driver = &linux_driver;
     #elif CONFIG_ZMK_TEXT_EXPANDER_DEFAULT_OS_MACOS
@@ -0,0 +1,260 @@
+#include <errno.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/shell/shell.h>
+#include <zmk/text_expander.h>
+#include <zmk/trie.h>
+
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_USAGE_COUNTERS
+// Worst case every byte of the prefix is written as \xHH
+#define ESCAPED_PREFIX_SIZE (4 * ZMK_TEXT_EXPANDER_GENERATED_MAX_SHORT_LEN + 1)
+
+/**
+ * @brief Prints one line of the usage profile read by scripts/gen_trie.py --profile.
+ *
+ * Bytes outside printable ASCII, and backslashes, are written as \xHH so
+ * that the prefix stays a single whitespace-free field.
+ */
+static void print_usage_line(const char *prefix, size_t prefix_len, uint16_t visits, uint16_t hits, void *user) {
+    const struct shell *sh = user;
+    char escaped[ESCAPED_PREFIX_SIZE];
+    size_t len = 0;
+
+    for (size_t i = 0; i < prefix_len; i++) {
+        uint8_t byte = (uint8_t)prefix[i];
+        if (byte > ' ' && byte < 0x7F && byte != '\\') {
+            escaped[len++] = (char)byte;
+        } else {
+            len += snprintf(escaped + len, sizeof(escaped) - len, "\\x%02x", byte);
+        }
+    }
+    escaped[len] = '\0';
+
+    shell_print(sh, "%s %u %u", escaped, visits, hits);
+}
+
+static int cmd_profile_dump(const struct shell *sh, size_t argc, char **argv) {
+    shell_print(sh, "# text expander usage profile: <prefix> <visits> <hits>");
+    k_mutex_lock(&expander_data.mutex, K_FOREVER);
+    trie_usage_foreach(print_usage_line, (void *)sh);
+    k_mutex_unlock(&expander_data.mutex);
+    return 0;
+}
+
+static int cmd_profile_reset(const struct shell *sh, size_t argc, char **argv) {
+    k_mutex_lock(&expander_data.mutex, K_FOREVER);
+    trie_usage_reset();
+    k_mutex_unlock(&expander_data.mutex);
+    shell_print(sh, "Usage counters cleared");
+    return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_text_expander_profile,
+    SHELL_CMD(dump, NULL, "Print the usage profile for CONFIG_ZMK_TEXT_EXPANDER_USAGE_PROFILE", cmd_profile_dump),
+    SHELL_CMD(reset, NULL, "Clear the usage counters", cmd_profile_reset),
+    SHELL_SUBCMD_SET_END);
+
+#define PROFILE_CMD SHELL_CMD(profile, &sub_text_expander_profile, "Short code usage counters", NULL),
+#else
+#define PROFILE_CMD
+#endif
+
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_NODE_CACHE
+static int cmd_cache_stats(const struct shell *sh, size_t argc, char **argv) {
+    struct trie_node_cache_stats stats;
+
+    k_mutex_lock(&expander_data.mutex, K_FOREVER);
+    trie_node_cache_get_stats(&stats);
+    k_mutex_unlock(&expander_data.mutex);
+
+    uint64_t lookups = (uint64_t)stats.hits + stats.misses;
+    shell_print(sh, "Cached %u of %u nodes (%u edges)", stats.nodes, (unsigned int)zmk_text_expander_trie_num_nodes,
+                stats.edges);
+    shell_print(sh, "Edge lookups: %u hits, %u misses, %u%% hit ratio", (unsigned int)stats.hits, (unsigned int)stats.misses,
+                lookups ? (unsigned int)(stats.hits * 100ULL / lookups) : 0);
+    return 0;
+}
+
+static int cmd_cache_reset(const struct shell *sh, size_t argc, char **argv) {
+    k_mutex_lock(&expander_data.mutex, K_FOREVER);
+    trie_node_cache_reset_stats();
+    k_mutex_unlock(&expander_data.mutex);
+    shell_print(sh, "Node cache counters cleared");
+    return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_text_expander_cache,
+    SHELL_CMD(reset, NULL, "Clear the hit and miss counters", cmd_cache_reset),
+    SHELL_SUBCMD_SET_END);
+
+#define CACHE_CMD SHELL_CMD(cache, &sub_text_expander_cache, "RAM node cache hit ratio", cmd_cache_stats),
+#else
+#define CACHE_CMD
+#endif
+
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_OVERLAY
+static void print_overlay_entry(const char *short_code, const char *expanded_text, bool preserve_trigger, void *user) {
+    shell_print((const struct shell *)user, "%s%s -> %s", short_code, preserve_trigger ? "" : " (-n)", expanded_text);
+}
+
+/**
+ * @brief Refuses to change or save the overlay while an expansion is typed, since the
+ * engine may be reading its text from the overlay pool.
+ */
+static bool overlay_busy(const struct shell *sh) {
+    if (expander_data.expansion_work_item.state != EXPANSION_STATE_IDLE) {
+        shell_error(sh, "An expansion is being typed, try again");
+        return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Joins the text arguments with spaces and resolves \n, \t and \\.
+ * @return false if the text does not fit in buf
+ */
+static bool join_overlay_text(char *buf, size_t size, size_t argc, char **argv) {
+    size_t len = 0;
+
+    for (size_t i = 0; i < argc; i++) {
+        for (const char *p = argv[i]; *p; p++) {
+            char c = *p;
+            if (c == '\\' && (p[1] == 'n' || p[1] == 't' || p[1] == '\\')) {
+                p++;
+                c = *p == 'n' ? '\n' : *p == 't' ? '\t' : '\\';
+            }
+            if (len + 1 >= size) {
+                return false;
+            }
+            buf[len++] = c;
+        }
+        if (i + 1 < argc) {
+            if (len + 1 >= size) {
+                return false;
+            }
+            buf[len++] = ' ';
+        }
+    }
+    buf[len] = '\0';
+    return true;
+}
+
+static int cmd_overlay_add(const struct shell *sh, size_t argc, char **argv) {
+    static char text[CONFIG_ZMK_TEXT_EXPANDER_OVERLAY_POOL_SIZE];
+    bool preserve_trigger = true;
+
+    argc--;
+    argv++;
+    if (argc > 0 && strcmp(argv[0], "-n") == 0) {
+        preserve_trigger = false;
+        argc--;
+        argv++;
+    }
+    if (argc < 2) {
+        shell_error(sh, "Usage: text_expander overlay add [-n] <short code> <text>");
+        return -EINVAL;
+    }
+    // Short codes are matched in lowercase, like the ones in the devicetree
+    for (char *p = argv[0]; *p; p++) {
+        if (*p >= 'A' && *p <= 'Z') {
+            *p += 'a' - 'A';
+        }
+    }
+    if (!join_overlay_text(text, sizeof(text), argc - 1, argv + 1)) {
+        shell_error(sh, "Text longer than the overlay pool");
+        return -ENOMEM;
+    }
+
+    k_mutex_lock(&expander_data.mutex, K_FOREVER);
+    int err = overlay_busy(sh) ? -EBUSY : trie_overlay_add(argv[0], text, preserve_trigger);
+    k_mutex_unlock(&expander_data.mutex);
+
+    if (err == -EINVAL) {
+        shell_error(sh, "Short codes are 1 to %d printable characters without spaces; "
+                    "the text may not contain control characters other than newline and tab",
+                    CONFIG_ZMK_TEXT_EXPANDER_OVERLAY_MAX_SHORT_LEN);
+    } else if (err == -ENOMEM) {
+        shell_error(sh, "Overlay full (CONFIG_ZMK_TEXT_EXPANDER_OVERLAY_MAX_ENTRIES, CONFIG_ZMK_TEXT_EXPANDER_OVERLAY_POOL_SIZE)");
+    } else if (err == 0) {
+        shell_print(sh, "Added %s", argv[0]);
+    }
+    return err;
+}
+
+static int cmd_overlay_remove(const struct shell *sh, size_t argc, char **argv) {
+    k_mutex_lock(&expander_data.mutex, K_FOREVER);
+    int err = overlay_busy(sh) ? -EBUSY : trie_overlay_remove(argv[1]);
+    k_mutex_unlock(&expander_data.mutex);
+
+    if (err == -ENOENT) {
+        shell_error(sh, "No overlay expansion for %s", argv[1]);
+    } else if (err == 0) {
+        shell_print(sh, "Removed %s", argv[1]);
+    }
+    return err;
+}
+
+static int cmd_overlay_list(const struct shell *sh, size_t argc, char **argv) {
+    struct trie_overlay_stats stats;
+
+    k_mutex_lock(&expander_data.mutex, K_FOREVER);
+    trie_overlay_foreach(print_overlay_entry, (void *)sh);
+    trie_overlay_get_stats(&stats);
+    k_mutex_unlock(&expander_data.mutex);
+
+    shell_print(sh, "%u of %u expansions, %u of %u pool bytes used (%u reclaimable)", stats.entries,
+                CONFIG_ZMK_TEXT_EXPANDER_OVERLAY_MAX_ENTRIES, stats.pool_used, CONFIG_ZMK_TEXT_EXPANDER_OVERLAY_POOL_SIZE,
+                stats.pool_free);
+    return 0;
+}
+
+static int cmd_overlay_clear(const struct shell *sh, size_t argc, char **argv) {
+    k_mutex_lock(&expander_data.mutex, K_FOREVER);
+    int err = overlay_busy(sh) ? -EBUSY : 0;
+    if (err == 0) {
+        trie_overlay_clear();
+        shell_print(sh, "Overlay cleared");
+    }
+    k_mutex_unlock(&expander_data.mutex);
+    return err;
+}
+
+static int cmd_overlay_save(const struct shell *sh, size_t argc, char **argv) {
+    k_mutex_lock(&expander_data.mutex, K_FOREVER);
+    if (overlay_busy(sh)) {
+        k_mutex_unlock(&expander_data.mutex);
+        return -EBUSY;
+    }
+    int err = trie_overlay_save();
+    k_mutex_unlock(&expander_data.mutex);
+
+    if (err) {
+        shell_error(sh, "Saving failed: %d", err);
+    } else {
+        shell_print(sh, "Overlay saved");
+    }
+    return err;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_text_expander_overlay,
+    SHELL_CMD_ARG(add, NULL, "[-n] <short code> <text>: add or replace an expansion; -n does not replay the trigger key",
+                  cmd_overlay_add, 3, SHELL_OPT_ARGS_MAX),
+    SHELL_CMD_ARG(remove, NULL, "<short code>: remove an expansion", cmd_overlay_remove, 2, 0),
+    SHELL_CMD(list, NULL, "List the expansions and the pool usage", cmd_overlay_list),
+    SHELL_CMD(clear, NULL, "Remove every expansion", cmd_overlay_clear),
+    SHELL_CMD(save, NULL, "Write pending changes to flash now", cmd_overlay_save),
+    SHELL_SUBCMD_SET_END);
+
+#define OVERLAY_CMD SHELL_CMD(overlay, &sub_text_expander_overlay, "Expansions added at runtime", NULL),
+#else
+#define OVERLAY_CMD
+#endif
+
+// Subcommands of the features enabled in this build
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_text_expander,
+    PROFILE_CMD
+    CACHE_CMD
+    OVERLAY_CMD
+    SHELL_SUBCMD_SET_END);
+
+SHELL_CMD_REGISTER(text_expander, &sub_text_expander, "Text expander commands", NULL);
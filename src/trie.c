@@ -1,17 +1,305 @@
 #include <zephyr/logging/log.h>
 #include <zmk/trie.h>
 #include <stddef.h>
+#include <string.h>
+#include <zephyr/sys/util.h>
+#include <zmk/expansion_ops.h>
 
 LOG_MODULE_REGISTER(trie, LOG_LEVEL_DBG);
 
-static const struct trie_node *get_node(uint16_t index) {
+static const struct trie_node *get_node(trie_index_t index) {
     if (index >= zmk_text_expander_trie_num_nodes) {
-        LOG_WRN("Node index %u out of bounds.", index);
+        LOG_WRN("Node index %u out of bounds.", (unsigned int)index);
         return NULL;
     }
     return &zmk_text_expander_trie_nodes[index];
 }
 
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_STACKED_DICTIONARIES
+static uint8_t enabled_dictionaries = UINT8_MAX;
+
+/**
+ * @brief Selects the dictionaries whose short codes match.
+ * @param mask Bit d enables dictionary d
+ *
+ * Takes effect on the next lookup; a cursor keeps its position, since the
+ * trie is the same whichever dictionaries are enabled.
+ */
+void trie_set_enabled_dictionaries(uint8_t mask) {
+    enabled_dictionaries = mask;
+}
+
+uint8_t trie_get_enabled_dictionaries(void) {
+    return enabled_dictionaries;
+}
+#endif
+
+/**
+ * @brief Returns the definition a node stands for under the enabled dictionaries.
+ * @param node A trie node, or NULL
+ * @return The node or one of its lower-priority variants, or NULL if the node
+ *         ends no short code of an enabled dictionary
+ *
+ * The variant chain holds at most one row per dictionary, so this is bounded
+ * by TRIE_DICTIONARY_COUNT whatever the size of the dictionaries.
+ */
+static const struct trie_node *get_enabled_terminal(const struct trie_node *node) {
+    if (!node || !node->is_terminal) {
+        return NULL;
+    }
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_STACKED_DICTIONARIES
+    while (!(enabled_dictionaries & (1U << node->dictionary))) {
+        if (node->next_variant == NULL_INDEX) {
+            return NULL;
+        }
+        node = get_node(node->next_variant);
+        if (!node) {
+            return NULL;
+        }
+    }
+#endif
+    return node;
+}
+
+/**
+ * @brief Follows a single edge of the trie in the generated tables.
+ * @param node_index Index of the node to leave
+ * @param c The edge character
+ * @return Index of the child reached through c, or NULL_INDEX if there is none
+ *
+ * This is the only place that knows how child tables are laid out; both the
+ * whole-key lookup and the incremental cursor are built on top of it,
+ * through trie_get_child_index().
+ */
+#if defined(CONFIG_ZMK_TEXT_EXPANDER_TRIE_DOUBLE_ARRAY)
+static trie_index_t lookup_child(trie_index_t node_index, char c) {
+    // Double-array: the child slot is BASE + c, and CHECK proves who owns it.
+    // Node indices are slot numbers, so every slot has a node record. A base
+    // that lands below zero wraps around and fails the bounds check.
+    if (node_index >= zmk_text_expander_trie_num_nodes) {
+        return NULL_INDEX;
+    }
+
+    uint32_t slot = (uint32_t)zmk_text_expander_da_base[node_index] + (uint8_t)c - TRIE_DA_BASE_BIAS;
+    if (slot >= zmk_text_expander_trie_num_nodes || zmk_text_expander_da_check[slot] != node_index) {
+        return NULL_INDEX;
+    }
+    return (trie_index_t)slot;
+}
+#elif defined(CONFIG_ZMK_TEXT_EXPANDER_TRIE_BITMAP)
+static trie_index_t lookup_child(trie_index_t node_index, char c) {
+    // The child's rank among its siblings is the number of present children
+    // with a lower bit, so one table load, one AND and one popcount find it.
+    const struct trie_node *node = get_node(node_index);
+    if (!node || (uint8_t)c >= TRIE_BITMAP_ALPHABET_SIZE) {
+        return NULL_INDEX;
+    }
+
+    uint8_t bit = zmk_text_expander_bitmap_bit_of[(uint8_t)c];
+    if (bit == TRIE_BITMAP_NO_BIT) {
+        return NULL_INDEX;
+    }
+
+    uint64_t mask = (uint64_t)1 << bit;
+    if (!(node->child_bitmap & mask)) {
+        return NULL_INDEX;
+    }
+    return (trie_index_t)(node->first_child_index + __builtin_popcountll(node->child_bitmap & (mask - 1)));
+}
+#elif defined(CONFIG_ZMK_TEXT_EXPANDER_TRIE_SWAR)
+#define SWAR_LOW_BITS 0x01010101U
+#define SWAR_HIGH_BITS 0x80808080U
+
+static trie_index_t lookup_child(trie_index_t node_index, char c) {
+    // XOR with c broadcast to every lane zeroes the lane holding c, and
+    // (x - 0x01..) & ~x & 0x80.. flags zero lanes. A borrow can only flag
+    // lanes above a real zero, so the lowest flag is exact. Padding lanes are
+    // 0, which matches only c == '\0' and is caught by the rank check.
+    const struct trie_node *node = get_node(node_index);
+    if (!node) {
+        return NULL_INDEX;
+    }
+
+    const uint32_t *keys = &zmk_text_expander_swar_keys[node->child_keys_index];
+    uint32_t pattern = SWAR_LOW_BITS * (uint8_t)c;
+    for (uint8_t lane = 0; lane < node->num_children; lane += TRIE_SWAR_LANES) {
+        uint32_t x = *keys++ ^ pattern;
+        uint32_t zero_lanes = (x - SWAR_LOW_BITS) & ~x & SWAR_HIGH_BITS;
+        if (zero_lanes) {
+            uint8_t rank = lane + (__builtin_ctz(zero_lanes) >> 3);
+            return rank < node->num_children ? (trie_index_t)(node->first_child_index + rank) : NULL_INDEX;
+        }
+    }
+    return NULL_INDEX;
+}
+#elif defined(CONFIG_ZMK_TEXT_EXPANDER_TRIE_PERFECT_HASH)
+static trie_index_t lookup_child(trie_index_t node_index, char c) {
+    // The build script picked a multiplier per node that gives every child
+    // its own slot, so there is exactly one probe and one compare.
+    const struct trie_node *node = get_node(node_index);
+    if (!node || node->hash_table_index == NULL_INDEX) {
+        return NULL_INDEX;
+    }
+
+    const struct trie_hash_table *ht = &zmk_text_expander_hash_tables[node->hash_table_index];
+    uint16_t hash = (uint16_t)((uint8_t)c * ht->seed);
+    uint16_t slot = (uint16_t)(((uint32_t)hash * ht->num_slots) >> 16);
+
+    const struct trie_hash_entry *entry = &zmk_text_expander_hash_entries[ht->entries_start_index + slot];
+    return entry->key == c ? entry->child_node_index : NULL_INDEX;
+}
+#else
+static trie_index_t lookup_child(trie_index_t node_index, char c) {
+    const struct trie_node *node = get_node(node_index);
+    if (!node || node->hash_table_index == NULL_INDEX) {
+        return NULL_INDEX;
+    }
+
+    const struct trie_hash_table *ht = &zmk_text_expander_hash_tables[node->hash_table_index];
+    if (ht->num_buckets == 0) {
+        return NULL_INDEX;
+    }
+
+    uint8_t bucket_index = (uint8_t)((unsigned char)c % ht->num_buckets);
+    trie_index_t entry_index = zmk_text_expander_hash_buckets[ht->buckets_start_index + bucket_index];
+
+    while (entry_index != NULL_INDEX) {
+        const struct trie_hash_entry *entry = &zmk_text_expander_hash_entries[entry_index];
+        if (entry->key == c) {
+            return entry->child_node_index;
+        }
+        entry_index = entry->next_entry_index;
+    }
+
+    return NULL_INDEX;
+}
+#endif
+
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_NODE_CACHE
+// The outgoing edges of nodes [0, node_cache_count) are copied to RAM. The
+// keys of node i are node_cache_keys[node_cache_edge_start[i]] up to
+// node_cache_edge_start[i + 1], and node_cache_children holds their targets.
+// The build script lays out the top levels of the trie, or the most used
+// nodes when given a usage profile, in the lowest rows.
+static trie_index_t node_cache_count;
+static uint16_t node_cache_edge_start[CONFIG_ZMK_TEXT_EXPANDER_NODE_CACHE_NODES + 1];
+static char node_cache_keys[CONFIG_ZMK_TEXT_EXPANDER_NODE_CACHE_EDGES];
+static trie_index_t node_cache_children[CONFIG_ZMK_TEXT_EXPANDER_NODE_CACHE_EDGES];
+static uint32_t node_cache_hits;
+static uint32_t node_cache_misses;
+
+/**
+ * @brief Copies the outgoing edges of a node to the end of the cache.
+ * @param node_index The node to cache
+ * @param num_edges Edges cached so far; advanced past the node's edges
+ * @return false if they do not all fit, in which case the cache is unchanged
+ *
+ * Probes every byte, so it works whatever the trie encoding.
+ */
+static bool cache_node_edges(trie_index_t node_index, uint16_t *num_edges) {
+    uint16_t end = *num_edges;
+    for (int c = 1; c <= UINT8_MAX; c++) {
+        trie_index_t child = lookup_child(node_index, (char)c);
+        if (child == NULL_INDEX) {
+            continue;
+        }
+        if (end == CONFIG_ZMK_TEXT_EXPANDER_NODE_CACHE_EDGES) {
+            return false;
+        }
+        node_cache_keys[end] = (char)c;
+        node_cache_children[end++] = child;
+    }
+    *num_edges = end;
+    return true;
+}
+
+/**
+ * @brief Fills the node cache from the dictionary.
+ *
+ * Caches the lowest rows in order until the node or edge budget runs out,
+ * so that a node is cached exactly when its index is below node_cache_count.
+ * Must run once the tables are bound, before any lookup.
+ */
+void trie_node_cache_init(void) {
+    trie_index_t max_nodes = MIN(zmk_text_expander_trie_num_nodes, CONFIG_ZMK_TEXT_EXPANDER_NODE_CACHE_NODES);
+    trie_index_t count = 0;
+    uint16_t num_edges = 0;
+
+    node_cache_count = 0;
+    node_cache_edge_start[0] = 0;
+    while (count < max_nodes && cache_node_edges(count, &num_edges)) {
+        node_cache_edge_start[++count] = num_edges;
+    }
+    node_cache_count = count;
+    trie_node_cache_reset_stats();
+    LOG_INF("Node cache holds %u of %u nodes, %u edges", (unsigned int)count,
+            (unsigned int)zmk_text_expander_trie_num_nodes, num_edges);
+}
+
+void trie_node_cache_get_stats(struct trie_node_cache_stats *stats) {
+    stats->hits = node_cache_hits;
+    stats->misses = node_cache_misses;
+    stats->nodes = node_cache_count;
+    stats->edges = node_cache_edge_start[node_cache_count];
+}
+
+void trie_node_cache_reset_stats(void) {
+    node_cache_hits = 0;
+    node_cache_misses = 0;
+}
+#endif
+
+/**
+ * @brief Follows a single edge of the trie.
+ * @param node_index Index of the node to leave
+ * @param c The edge character
+ * @return Index of the child reached through c, or NULL_INDEX if there is none
+ *
+ * Edges of cached nodes are looked up in RAM without touching the
+ * generated tables.
+ */
+trie_index_t trie_get_child_index(trie_index_t node_index, char c) {
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_NODE_CACHE
+    if (node_index < node_cache_count) {
+        node_cache_hits++;
+        uint16_t start = node_cache_edge_start[node_index];
+        const char *key = memchr(&node_cache_keys[start], (uint8_t)c, node_cache_edge_start[node_index + 1] - start);
+        return key ? node_cache_children[key - node_cache_keys] : NULL_INDEX;
+    }
+    node_cache_misses++;
+#endif
+    return lookup_child(node_index, c);
+}
+
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_AHO_CORASICK
+/**
+ * @brief Aho-Corasick transition: follows failure links until c can be consumed.
+ * @return The state for the longest suffix of the text so far plus c that is
+ *         a prefix of some short code; the root if there is none
+ *
+ * Each typed character adds at most one to the depth and every failure link
+ * removes at least one, so the loop is constant time amortized.
+ */
+static trie_index_t ac_step(trie_index_t state, char c) {
+    while (true) {
+        trie_index_t child = trie_get_child_index(state, c);
+        if (child != NULL_INDEX) {
+            return child;
+        }
+        if (state == 0) {
+            return 0;
+        }
+        state = zmk_text_expander_ac_fail[state];
+    }
+}
+#endif
+
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_TRIE_RADIX
+static const char *get_edge_label(const struct trie_node *node) {
+    return node->label_len > 0 ? zmk_text_expander_get_string(node->label_offset) : "";
+}
+#endif
+
 /**
  * @brief Traverse the trie to find the node corresponding to a given key.
  * @param key The key string to search for
@@ -19,18 +307,14 @@ static const struct trie_node *get_node(uint16_t index) {
  * 
  * Performance: Uses actual key length for iteration instead of hardcoded bound.
  * Safety: 256-char maximum enforced to prevent infinite loops on malformed keys.
+ * In a radix trie a key that ends inside an edge label has no node of its own
+ * and yields NULL; each label is compared in one memcmp.
  */
 const struct trie_node *trie_get_node_for_key(const char *key) {
     if (!key || zmk_text_expander_trie_num_nodes == 0) {
         return NULL;
     }
 
-    const struct trie_node *current_node = get_node(0);
-    if (!current_node) {
-        LOG_ERR("Root node (index 0) is invalid.");
-        return NULL;
-    }
-
     // Optimization: use actual key length for loop bound
     // Safety: cap at 256 chars to prevent infinite loops on malformed keys
     size_t key_len = strlen(key);
@@ -38,46 +322,475 @@ const struct trie_node *trie_get_node_for_key(const char *key) {
         LOG_WRN("Key length %zu exceeds safety limit of 256 chars", key_len);
         key_len = 256;
     }
-    
-    for (size_t i = 0; i < key_len; i++) {
-        char current_char = key[i];
 
-        if (current_node->hash_table_index == NULL_INDEX) {
+    trie_index_t node_index = 0;
+    for (size_t i = 0; i < key_len && node_index != NULL_INDEX; i++) {
+        node_index = trie_get_child_index(node_index, key[i]);
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_TRIE_RADIX
+        const struct trie_node *node = node_index == NULL_INDEX ? NULL : get_node(node_index);
+        if (!node) {
             return NULL;
         }
-
-        const struct trie_hash_table *ht = &zmk_text_expander_hash_tables[current_node->hash_table_index];
-        if (ht->num_buckets == 0) {
+        if (key_len - i - 1 < node->label_len ||
+            memcmp(key + i + 1, get_edge_label(node), node->label_len) != 0) {
             return NULL;
         }
+        i += node->label_len;
+#endif
+    }
+
+    return node_index == NULL_INDEX ? NULL : get_node(node_index);
+}
+
+/**
+ * @brief Rewinds a cursor to the root of the trie.
+ * @param cursor The cursor to reset
+ */
+void trie_cursor_reset(struct trie_cursor *cursor) {
+    cursor->node_index = zmk_text_expander_trie_num_nodes > 0 ? 0 : NULL_INDEX;
+    cursor->depth = 0;
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_TRIE_RADIX
+    cursor->label_pos = 0;
+#endif
+}
+
+/**
+ * @brief Advances a cursor by one typed character.
+ * @param cursor The cursor to advance
+ * @param c The character that was typed
+ * @return true if the consumed characters are still a prefix of some short code
+ *
+ * Costs one edge lookup regardless of how long the short code already is. Once
+ * the cursor has fallen off the trie it stays off until it is reset; callers
+ * that need to undo a character keep a copy of the previous cursor instead.
+ * Inside a radix edge label a character costs a single byte compare.
+ */
+bool trie_cursor_advance(struct trie_cursor *cursor, char c) {
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_TRIE_RADIX
+    const struct trie_node *node = cursor->node_index == NULL_INDEX ? NULL : get_node(cursor->node_index);
+    if (!node) {
+        cursor->node_index = NULL_INDEX;
+    } else if (cursor->label_pos < node->label_len) {
+        if (get_edge_label(node)[cursor->label_pos] == c) {
+            cursor->label_pos++;
+        } else {
+            cursor->node_index = NULL_INDEX;
+        }
+    } else {
+        cursor->node_index = trie_get_child_index(cursor->node_index, c);
+        cursor->label_pos = 0;
+    }
+#elif defined(CONFIG_ZMK_TEXT_EXPANDER_AHO_CORASICK)
+    if (cursor->node_index != NULL_INDEX) {
+        cursor->node_index = ac_step(cursor->node_index, c);
+    }
+#else
+    if (cursor->node_index != NULL_INDEX) {
+        cursor->node_index = trie_get_child_index(cursor->node_index, c);
+    }
+#endif
+#if defined(CONFIG_ZMK_TEXT_EXPANDER_STACKED_DICTIONARIES) && !defined(CONFIG_ZMK_TEXT_EXPANDER_AHO_CORASICK)
+    // A prefix that only disabled dictionaries continue is a dead end
+    if (cursor->node_index != NULL_INDEX &&
+        !(zmk_text_expander_trie_nodes[cursor->node_index].dictionary_mask & enabled_dictionaries)) {
+        cursor->node_index = NULL_INDEX;
+    }
+#endif
+    if (cursor->depth < UINT8_MAX) {
+        cursor->depth++;
+    }
+    return cursor->node_index != NULL_INDEX;
+}
+
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_AHO_CORASICK
+/**
+ * @brief Returns the node of the longest short code the typed text ends with.
+ * @param cursor The cursor to inspect
+ * @return Index of a terminal node, or NULL_INDEX
+ */
+static trie_index_t ac_get_match_index(const struct trie_cursor *cursor) {
+    trie_index_t index = cursor->node_index;
+    // Output links lead to ever shorter suffixes; skip those no enabled dictionary defines
+    while (index != NULL_INDEX && !get_enabled_terminal(get_node(index))) {
+        index = zmk_text_expander_ac_output[index];
+    }
+    return index;
+}
+#endif
+
+/**
+ * @brief Returns the node the cursor rests on if it completes a short code.
+ * @param cursor The cursor to inspect
+ * @return Pointer to a terminal trie node, or NULL
+ *
+ * In Aho-Corasick mode this is the longest short code that the typed text
+ * ends with; trie_cursor_get_match_len() tells how many characters it spans.
+ */
+const struct trie_node *trie_cursor_get_terminal(const struct trie_cursor *cursor) {
+    if (cursor->node_index == NULL_INDEX) {
+        return NULL;
+    }
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_AHO_CORASICK
+    trie_index_t match_index = ac_get_match_index(cursor);
+    return match_index == NULL_INDEX ? NULL : get_enabled_terminal(get_node(match_index));
+#else
+    const struct trie_node *node = get_node(cursor->node_index);
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_TRIE_RADIX
+    if (node && cursor->label_pos < node->label_len) {
+        return NULL;
+    }
+#endif
+    return get_enabled_terminal(node);
+#endif
+}
+
+/**
+ * @brief Returns how many of the consumed characters the terminal found by
+ * trie_cursor_get_terminal() covers, counted back from the last one.
+ * @param cursor The cursor to inspect
+ * @return Short code length in bytes, 0 if there is no match
+ */
+uint8_t trie_cursor_get_match_len(const struct trie_cursor *cursor) {
+    if (cursor->node_index == NULL_INDEX) {
+        return 0;
+    }
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_AHO_CORASICK
+    trie_index_t match_index = ac_get_match_index(cursor);
+    return match_index == NULL_INDEX ? 0 : zmk_text_expander_ac_depth[match_index];
+#else
+    return trie_cursor_get_terminal(cursor) ? cursor->depth : 0;
+#endif
+}
+
+/**
+ * @brief Returns how many of the consumed characters the cursor position spells.
+ * @param cursor The cursor to inspect
+ * @return Length of the prefix the cursor stands for, 0 once it fell off
+ *
+ * This is every consumed character, except in Aho-Corasick mode where only the
+ * longest suffix that is still a prefix of a short code counts.
+ */
+uint8_t trie_cursor_get_prefix_len(const struct trie_cursor *cursor) {
+    if (cursor->node_index == NULL_INDEX) {
+        return 0;
+    }
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_AHO_CORASICK
+    return zmk_text_expander_ac_depth[cursor->node_index];
+#else
+    return cursor->depth;
+#endif
+}
+
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_PREFIX_COMPLETION
+/**
+ * @brief Lists the best short codes that start with the cursor's prefix.
+ * @param cursor The cursor whose position is the prefix
+ * @param results Receives up to max_results terminal nodes, best first
+ * @param max_results Capacity of results; at most TRIE_TOP_K are returned
+ * @return Number of nodes written
+ *
+ * The build script ranked every node's subtree ahead of time, so this is a
+ * copy out of a fixed-stride table, whatever the size of the dictionary. A
+ * cursor inside a radix edge label shares the completions of the node the
+ * label leads to, since every short code through the edge ends below it.
+ */
+uint8_t trie_cursor_get_completions(const struct trie_cursor *cursor, const struct trie_node **results, uint8_t max_results) {
+    if (cursor->node_index == NULL_INDEX || cursor->node_index >= zmk_text_expander_trie_num_nodes) {
+        return 0;
+    }
+
+    const trie_index_t *ranked = &zmk_text_expander_top_completions[(size_t)cursor->node_index * TRIE_TOP_K];
+    uint8_t count = 0;
+    for (uint8_t i = 0; i < TRIE_TOP_K && count < max_results && ranked[i] != NULL_INDEX; i++) {
+        const struct trie_node *node = get_enabled_terminal(get_node(ranked[i]));
+        if (node) {
+            results[count++] = node;
+        }
+    }
+    return count;
+}
 
-        uint8_t bucket_index = (uint8_t)((unsigned char)current_char % ht->num_buckets);
+/**
+ * @brief Lists the best short codes that start with prefix.
+ * @param prefix The typed prefix
+ * @param results Receives up to max_results terminal nodes, best first
+ * @param max_results Capacity of results; at most TRIE_TOP_K are returned
+ * @return Number of nodes written; 0 if no short code starts with prefix
+ */
+uint8_t trie_get_completions(const char *prefix, const struct trie_node **results, uint8_t max_results) {
+    if (!prefix) {
+        return 0;
+    }
+
+    struct trie_cursor cursor;
+    trie_cursor_reset(&cursor);
+    size_t prefix_len = strlen(prefix);
+    for (size_t i = 0; i < prefix_len; i++) {
+        trie_cursor_advance(&cursor, prefix[i]);
+    }
+
+    // In Aho-Corasick mode the cursor may have settled on a suffix of prefix
+    if (trie_cursor_get_prefix_len(&cursor) != prefix_len) {
+        return 0;
+    }
+    return trie_cursor_get_completions(&cursor, results, max_results);
+}
+#endif
+
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_FUZZY_MATCH
+// Shorter keys are within one edit of too many short codes for a correction to be a good guess
+#define FUZZY_MIN_KEY_LEN 3
 
-        uint16_t entry_index = zmk_text_expander_hash_buckets[ht->buckets_start_index + bucket_index];
+struct fuzzy_search {
+    const struct trie_node *match;
+    bool ambiguous;
+    // Set when a step was needed after the whole budget was spent
+    bool out_of_budget;
+    uint32_t steps;
+};
+
+static bool fuzzy_search_done(const struct fuzzy_search *search) {
+    return search->ambiguous || search->out_of_budget;
+}
 
-        bool found_child = false;
-        while (entry_index != NULL_INDEX) {
-            const struct trie_hash_entry *entry = &zmk_text_expander_hash_entries[entry_index];
-            if (entry->key == current_char) {
-                current_node = get_node(entry->child_node_index);
-                found_child = true;
-                break;
+/**
+ * @brief Advances a cursor by one character, if the budget has a step left.
+ * @return false if the budget is spent, leaving the cursor where it was
+ */
+static bool fuzzy_step(struct fuzzy_search *search, struct trie_cursor *cursor, char c) {
+    if (search->steps >= CONFIG_ZMK_TEXT_EXPANDER_FUZZY_MATCH_BUDGET) {
+        search->out_of_budget = true;
+        return false;
+    }
+    search->steps++;
+    trie_cursor_advance(cursor, c);
+    return true;
+}
+
+// Autocorrect entries fix the word they spell; they are not corrections of other typos
+static bool is_autocorrect_entry(const struct trie_node *node) {
+    const char *text = zmk_text_expander_get_string(node->expanded_text_offset);
+    return text && (uint8_t)text[0] == EXP_OP_KEEP;
+}
+
+/**
+ * @brief Follows the rest of a key exactly and records the short code it spells.
+ * @param search The search state
+ * @param cursor Cursor for the corrected part of the key
+ * @param rest The characters after the correction
+ * @param rest_len Length of rest
+ */
+static void fuzzy_finish(struct fuzzy_search *search, struct trie_cursor cursor, const char *rest, size_t rest_len) {
+    for (size_t i = 0; i < rest_len && cursor.node_index != NULL_INDEX; i++) {
+        if (!fuzzy_step(search, &cursor, rest[i])) {
+            return;
+        }
+    }
+
+    const struct trie_node *node = trie_cursor_get_terminal(&cursor);
+    if (node && node != search->match && !is_autocorrect_entry(node)) {
+        search->ambiguous = search->match != NULL;
+        search->match = node;
+    }
+}
+
+static void fuzzy_try_char(struct fuzzy_search *search, struct trie_cursor cursor, char c, const char *rest, size_t rest_len) {
+    if (fuzzy_step(search, &cursor, c) && cursor.node_index != NULL_INDEX) {
+        fuzzy_finish(search, cursor, rest, rest_len);
+    }
+}
+
+/**
+ * @brief Looks up the short code a key misspells by one edit.
+ * @param key The typed characters, which must not be a short code themselves
+ * @param key_len Length of key
+ * @param steps Receives the cursor steps the search took, if not NULL
+ * @return The only short code one substitution, transposition, insertion or
+ *         deletion away from key, or NULL if there is none or more than one
+ *
+ * Every candidate shares the exactly typed prefix before its edit, so the
+ * walk keeps one cursor for that prefix and only tries corrections while it
+ * is still on the trie; substitutions and insertions try each character of
+ * the short code alphabet. The work is counted in cursor steps and capped at
+ * CONFIG_ZMK_TEXT_EXPANDER_FUZZY_MATCH_BUDGET, checked before every step: a
+ * search that needs more reports no match rather than a possibly ambiguous
+ * one, while one that finishes on the last step of the budget stands.
+ */
+const struct trie_node *trie_search_fuzzy(const char *key, size_t key_len, uint32_t *steps) {
+    if (steps) {
+        *steps = 0;
+    }
+    if (!key || key_len < FUZZY_MIN_KEY_LEN || zmk_text_expander_trie_num_nodes == 0) {
+        return NULL;
+    }
+
+    const char *alphabet = zmk_text_expander_short_code_alphabet;
+    struct fuzzy_search search = {0};
+    struct trie_cursor prefix;
+    trie_cursor_reset(&prefix);
+
+    for (size_t i = 0; i <= key_len && prefix.node_index != NULL_INDEX; i++) {
+        const char *rest = key + i;
+        size_t rest_len = key_len - i;
+
+        // Insertion: a character is missing before key[i]
+        for (const char *c = alphabet; *c && !fuzzy_search_done(&search); c++) {
+            fuzzy_try_char(&search, prefix, *c, rest, rest_len);
+        }
+        if (i == key_len || fuzzy_search_done(&search)) {
+            break;
+        }
+
+        // Deletion: key[i] was typed by mistake
+        if (!fuzzy_search_done(&search)) {
+            fuzzy_finish(&search, prefix, rest + 1, rest_len - 1);
+        }
+
+        // Substitution: key[i] stands for another character
+        for (const char *c = alphabet; *c && !fuzzy_search_done(&search); c++) {
+            if (*c != key[i]) {
+                fuzzy_try_char(&search, prefix, *c, rest + 1, rest_len - 1);
             }
-            entry_index = entry->next_entry_index;
         }
 
-        if (!found_child) {
-            return NULL;
+        // Transposition: key[i] and key[i + 1] were swapped
+        if (rest_len >= 2 && key[i] != key[i + 1] && !fuzzy_search_done(&search)) {
+            struct trie_cursor swapped = prefix;
+            if (fuzzy_step(&search, &swapped, key[i + 1]) && swapped.node_index != NULL_INDEX) {
+                fuzzy_try_char(&search, swapped, key[i], rest + 2, rest_len - 2);
+            }
         }
+
+        if (fuzzy_search_done(&search) || !fuzzy_step(&search, &prefix, key[i])) {
+            break;
+        }
+    }
+
+    if (steps) {
+        *steps = search.steps;
     }
+    if (search.ambiguous) {
+        LOG_DBG("Fuzzy lookup for \"%.*s\" is ambiguous after %u steps", (int)key_len, key, search.steps);
+        return NULL;
+    }
+    if (search.out_of_budget) {
+        LOG_WRN("Fuzzy lookup for \"%.*s\" ran out of budget", (int)key_len, key);
+        return NULL;
+    }
+    return search.match;
+}
+#endif
+
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_USAGE_COUNTERS
+// Saturating per-row counters of how often typing entered a node and how often a row was expanded
+static uint16_t node_visits[MAX(ZMK_TEXT_EXPANDER_GENERATED_NUM_NODES, 1)];
+static uint16_t node_hits[MAX(ZMK_TEXT_EXPANDER_GENERATED_NUM_NODES, 1)];
 
-    return current_node;
+static void count_usage(uint16_t *counters, trie_index_t index) {
+    if (index < ARRAY_SIZE(node_visits) && counters[index] < UINT16_MAX) {
+        counters[index]++;
+    }
+}
+
+/**
+ * @brief Counts the node a typed character led the cursor into.
+ * @param cursor The cursor just advanced by trie_cursor_advance()
+ *
+ * Only called for real keystrokes, so lookups made on the trigger path do not
+ * skew the profile.
+ */
+void trie_usage_record_step(const struct trie_cursor *cursor) {
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_TRIE_RADIX
+    // Characters inside an edge label stay on the node they entered
+    if (cursor->label_pos != 0) {
+        return;
+    }
+#endif
+    count_usage(node_visits, cursor->node_index);
+}
+
+void trie_usage_record_expansion(const struct trie_node *node) {
+    count_usage(node_hits, (trie_index_t)(node - zmk_text_expander_trie_nodes));
+}
+
+void trie_usage_reset(void) {
+    memset(node_visits, 0, sizeof(node_visits));
+    memset(node_hits, 0, sizeof(node_hits));
+}
+
+/**
+ * @brief Reports the counters of every node typing has reached, depth first.
+ * @param cb Called with the characters leading to the node, its visits and its
+ *           expansions, including those of its lower-priority definitions
+ * @param user Passed through to cb
+ *
+ * Children are found by probing every byte, which is slow but keeps this
+ * independent of the encoding; it is only meant for the shell. The probes go
+ * straight to the generated tables, so they do not count as node cache hits
+ * or misses.
+ */
+void trie_usage_foreach(trie_usage_cb cb, void *user) {
+    char prefix[ZMK_TEXT_EXPANDER_GENERATED_MAX_SHORT_LEN + 1];
+    trie_index_t path[ZMK_TEXT_EXPANDER_GENERATED_MAX_SHORT_LEN + 1];
+    uint8_t path_len[ZMK_TEXT_EXPANDER_GENERATED_MAX_SHORT_LEN + 1];
+    uint16_t next_char[ZMK_TEXT_EXPANDER_GENERATED_MAX_SHORT_LEN + 1];
+    int top = 0;
+
+    if (zmk_text_expander_trie_num_nodes == 0) {
+        return;
+    }
+    path[0] = 0;
+    path_len[0] = 0;
+    next_char[0] = 1;
+
+    while (top >= 0) {
+        if (next_char[top] > UINT8_MAX) {
+            top--;
+            continue;
+        }
+        char c = (char)next_char[top]++;
+        trie_index_t child = lookup_child(path[top], c);
+        const struct trie_node *node = child == NULL_INDEX ? NULL : get_node(child);
+        if (!node) {
+            continue;
+        }
+
+        size_t len = path_len[top];
+        size_t label_len = 0;
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_TRIE_RADIX
+        label_len = node->label_len;
+#endif
+        if (len + 1 + label_len > ZMK_TEXT_EXPANDER_GENERATED_MAX_SHORT_LEN || top + 1 >= (int)ARRAY_SIZE(path)) {
+            continue;
+        }
+        prefix[len++] = c;
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_TRIE_RADIX
+        memcpy(prefix + len, get_edge_label(node), label_len);
+        len += label_len;
+#endif
+
+        uint32_t hits = node_hits[child];
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_STACKED_DICTIONARIES
+        for (trie_index_t v = node->next_variant; v < ARRAY_SIZE(node_hits); v = zmk_text_expander_trie_nodes[v].next_variant) {
+            hits += node_hits[v];
+        }
+#endif
+        if (node_visits[child] > 0 || hits > 0) {
+            cb(prefix, len, node_visits[child], MIN(hits, UINT16_MAX), user);
+        }
+
+        top++;
+        path[top] = child;
+        path_len[top] = len;
+        next_char[top] = 1;
+    }
 }
+#endif
 
 const struct trie_node *trie_search(const char *key) {
     LOG_DBG("trie_search called for key: \"%s\"", key);
-    const struct trie_node *node = trie_get_node_for_key(key);
-    if (node && node->is_terminal) {
+    const struct trie_node *node = get_enabled_terminal(trie_get_node_for_key(key));
+    if (node) {
         LOG_DBG("Node found for key and it is a terminal node. Search successful.");
         return node;
     }
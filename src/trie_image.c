@@ -0,0 +1,310 @@
+#include <errno.h>
+#include <stddef.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/sys/crc.h>
+#ifdef CONFIG_FLASH_SIMULATOR
+#include <zephyr/drivers/flash/flash_simulator.h>
+#endif
+
+#include <zmk/trie.h>
+#include <zmk/trie_image.h>
+
+LOG_MODULE_REGISTER(trie_image, LOG_LEVEL_DBG);
+
+#define TRIE_IMAGE_PARTITION text_expander_partition
+
+#ifndef CONFIG_FLASH_SIMULATOR
+// Only the chosen zephyr,flash device is mapped at CONFIG_FLASH_BASE_ADDRESS; external SPI/QSPI flash cannot be read in place
+BUILD_ASSERT(DT_SAME_NODE(DT_MTD_FROM_FIXED_PARTITION(DT_NODELABEL(TRIE_IMAGE_PARTITION)), DT_CHOSEN(zephyr_flash)),
+             "text_expander_partition must be on the zephyr,flash device");
+#endif
+
+trie_index_t zmk_text_expander_trie_num_nodes;
+const struct trie_node *zmk_text_expander_trie_nodes;
+#if defined(CONFIG_ZMK_TEXT_EXPANDER_TRIE_DOUBLE_ARRAY)
+const trie_index_t *zmk_text_expander_da_base;
+const trie_index_t *zmk_text_expander_da_check;
+#elif defined(CONFIG_ZMK_TEXT_EXPANDER_TRIE_BITMAP)
+const uint8_t *zmk_text_expander_bitmap_bit_of;
+#elif defined(CONFIG_ZMK_TEXT_EXPANDER_TRIE_SWAR)
+const uint32_t *zmk_text_expander_swar_keys;
+#elif defined(CONFIG_ZMK_TEXT_EXPANDER_TRIE_FLAT_HASH)
+// The node table is the whole dictionary
+#elif defined(CONFIG_ZMK_TEXT_EXPANDER_TRIE_PERFECT_HASH)
+const struct trie_hash_table *zmk_text_expander_hash_tables;
+const struct trie_hash_entry *zmk_text_expander_hash_entries;
+#else
+const struct trie_hash_table *zmk_text_expander_hash_tables;
+const struct trie_hash_entry *zmk_text_expander_hash_entries;
+const trie_index_t *zmk_text_expander_hash_buckets;
+#endif
+const char *zmk_text_expander_string_pool;
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_AHO_CORASICK
+const trie_index_t *zmk_text_expander_ac_fail;
+const trie_index_t *zmk_text_expander_ac_output;
+const uint8_t *zmk_text_expander_ac_depth;
+#endif
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_PREFIX_COMPLETION
+const trie_index_t *zmk_text_expander_top_completions;
+#endif
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_FUZZY_MATCH
+const char *zmk_text_expander_short_code_alphabet;
+#endif
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_COMPRESS_STRING_POOL
+const char *zmk_text_expander_pool_dict;
+const uint16_t *zmk_text_expander_pool_dict_offsets;
+uint8_t zmk_text_expander_pool_dict_count;
+#endif
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_FRAGMENTS
+const trie_offset_t *zmk_text_expander_fragment_offsets;
+uint16_t zmk_text_expander_fragment_count;
+#endif
+
+static uint32_t string_pool_size;
+
+// Element size of every table this configuration uses; 0 for tables it does not.
+static const size_t table_element_sizes[TRIE_TABLE_COUNT] = {
+    [TRIE_TABLE_NODES] = sizeof(struct trie_node),
+    [TRIE_TABLE_STRING_POOL] = sizeof(char),
+#if defined(CONFIG_ZMK_TEXT_EXPANDER_TRIE_DOUBLE_ARRAY)
+    [TRIE_TABLE_DA_BASE] = sizeof(trie_index_t),
+    [TRIE_TABLE_DA_CHECK] = sizeof(trie_index_t),
+#elif defined(CONFIG_ZMK_TEXT_EXPANDER_TRIE_BITMAP)
+    [TRIE_TABLE_BITMAP_ALPHABET] = sizeof(uint8_t),
+#elif defined(CONFIG_ZMK_TEXT_EXPANDER_TRIE_SWAR)
+    [TRIE_TABLE_SWAR_KEYS] = sizeof(uint32_t),
+#elif defined(CONFIG_ZMK_TEXT_EXPANDER_TRIE_FLAT_HASH)
+    // No tables besides the nodes
+#elif defined(CONFIG_ZMK_TEXT_EXPANDER_TRIE_PERFECT_HASH)
+    [TRIE_TABLE_HASH_TABLES] = sizeof(struct trie_hash_table),
+    [TRIE_TABLE_HASH_ENTRIES] = sizeof(struct trie_hash_entry),
+#else
+    [TRIE_TABLE_HASH_TABLES] = sizeof(struct trie_hash_table),
+    [TRIE_TABLE_HASH_ENTRIES] = sizeof(struct trie_hash_entry),
+    [TRIE_TABLE_HASH_BUCKETS] = sizeof(trie_index_t),
+#endif
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_COMPRESS_STRING_POOL
+    [TRIE_TABLE_POOL_DICT] = sizeof(char),
+    [TRIE_TABLE_POOL_DICT_OFFSETS] = sizeof(uint16_t),
+#endif
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_FRAGMENTS
+    [TRIE_TABLE_FRAGMENT_OFFSETS] = sizeof(trie_offset_t),
+#endif
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_AHO_CORASICK
+    [TRIE_TABLE_AC_FAIL] = sizeof(trie_index_t),
+    [TRIE_TABLE_AC_OUTPUT] = sizeof(trie_index_t),
+    [TRIE_TABLE_AC_DEPTH] = sizeof(uint8_t),
+#endif
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_PREFIX_COMPLETION
+    [TRIE_TABLE_TOP_COMPLETIONS] = sizeof(trie_index_t),
+#endif
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_FUZZY_MATCH
+    [TRIE_TABLE_SHORT_CODE_ALPHABET] = sizeof(char),
+#endif
+};
+
+/**
+ * @brief Returns the memory-mapped contents of the dictionary partition.
+ *
+ * @param size Receives the partition size.
+ * @return A pointer to the first byte of the partition.
+ */
+static const uint8_t *get_partition_memory(size_t *size) {
+    *size = FIXED_PARTITION_SIZE(TRIE_IMAGE_PARTITION);
+#ifdef CONFIG_FLASH_SIMULATOR
+    // native_sim keeps the simulated flash (optionally backed by a file) in RAM.
+    size_t mock_size;
+    const uint8_t *base = flash_simulator_get_memory(FIXED_PARTITION_DEVICE(TRIE_IMAGE_PARTITION), &mock_size);
+    return base + FIXED_PARTITION_OFFSET(TRIE_IMAGE_PARTITION);
+#else
+    return (const uint8_t *)(CONFIG_FLASH_BASE_ADDRESS + FIXED_PARTITION_OFFSET(TRIE_IMAGE_PARTITION));
+#endif
+}
+
+/**
+ * @brief Checks that a table lies inside the image and holds a whole number of elements.
+ *
+ * @return The number of elements, or -1 if the table is malformed.
+ */
+static int32_t get_table_count(const struct trie_image_header *header, enum trie_image_table_id id) {
+    const struct trie_image_table *table = &header->tables[id];
+    size_t element_size = table_element_sizes[id];
+
+    if (element_size == 0) {
+        return table->size == 0 ? 0 : -1;
+    }
+    if (table->offset % TRIE_IMAGE_TABLE_ALIGN != 0 || table->offset < header->header_size ||
+        table->offset > header->image_size || table->size > header->image_size - table->offset ||
+        table->size % element_size != 0) {
+        return -1;
+    }
+    return (int32_t)(table->size / element_size);
+}
+
+static bool check_table_count(const struct trie_image_header *header, enum trie_image_table_id id, uint32_t expected) {
+    int32_t count = get_table_count(header, id);
+    if (count < 0 || (uint32_t)count != expected) {
+        LOG_ERR("Dictionary image table %d is malformed", id);
+        return false;
+    }
+    return true;
+}
+
+static bool check_tables(const struct trie_image_header *header) {
+    for (int id = 0; id < TRIE_TABLE_COUNT; id++) {
+        if (get_table_count(header, id) < 0) {
+            LOG_ERR("Dictionary image table %d is malformed", id);
+            return false;
+        }
+    }
+
+    uint32_t num_nodes = header->num_nodes;
+    if (!check_table_count(header, TRIE_TABLE_NODES, num_nodes)) { return false; }
+#if defined(CONFIG_ZMK_TEXT_EXPANDER_TRIE_DOUBLE_ARRAY)
+    if (!check_table_count(header, TRIE_TABLE_DA_BASE, num_nodes) ||
+        !check_table_count(header, TRIE_TABLE_DA_CHECK, num_nodes)) {
+        return false;
+    }
+#elif defined(CONFIG_ZMK_TEXT_EXPANDER_TRIE_BITMAP)
+    if (!check_table_count(header, TRIE_TABLE_BITMAP_ALPHABET, TRIE_BITMAP_ALPHABET_SIZE)) { return false; }
+#endif
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_AHO_CORASICK
+    if (!check_table_count(header, TRIE_TABLE_AC_FAIL, num_nodes) ||
+        !check_table_count(header, TRIE_TABLE_AC_OUTPUT, num_nodes) ||
+        !check_table_count(header, TRIE_TABLE_AC_DEPTH, num_nodes)) {
+        return false;
+    }
+#endif
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_PREFIX_COMPLETION
+    if (!check_table_count(header, TRIE_TABLE_TOP_COMPLETIONS, num_nodes * TRIE_TOP_K)) { return false; }
+#endif
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_COMPRESS_STRING_POOL
+    int32_t num_offsets = get_table_count(header, TRIE_TABLE_POOL_DICT_OFFSETS);
+    if (num_offsets < 1 || num_offsets > UINT8_MAX + 1) {
+        LOG_ERR("Dictionary image has a malformed string pool dictionary");
+        return false;
+    }
+#endif
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_FRAGMENTS
+    if (get_table_count(header, TRIE_TABLE_FRAGMENT_OFFSETS) > UINT8_MAX + 1) {
+        LOG_ERR("Dictionary image has more fragments than EXP_OP_CALL can reference");
+        return false;
+    }
+#endif
+    return true;
+}
+
+int trie_image_load(void) {
+    size_t partition_size;
+    const uint8_t *image = get_partition_memory(&partition_size);
+    const struct trie_image_header *header = (const struct trie_image_header *)image;
+
+    if (partition_size < sizeof(*header) || header->magic != TRIE_IMAGE_MAGIC) {
+        LOG_ERR("No dictionary image found in the text expander partition");
+        return -ENOENT;
+    }
+    if (header->version != TRIE_IMAGE_VERSION || header->header_size != sizeof(*header)) {
+        LOG_ERR("Unsupported dictionary image version %u", header->version);
+        return -ENOTSUP;
+    }
+    if (crc32_ieee(image, offsetof(struct trie_image_header, header_crc)) != header->header_crc) {
+        LOG_ERR("Dictionary image header checksum mismatch");
+        return -EINVAL;
+    }
+    if (header->layout != TRIE_IMAGE_LAYOUT) {
+        LOG_ERR("Dictionary image layout 0x%08x does not match this firmware (0x%08x)", header->layout,
+                (uint32_t)TRIE_IMAGE_LAYOUT);
+        return -ENOTSUP;
+    }
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_PREFIX_COMPLETION
+    if (header->top_k != TRIE_TOP_K) {
+        LOG_ERR("Dictionary image has %u completions per prefix, firmware expects %u", header->top_k, TRIE_TOP_K);
+        return -ENOTSUP;
+    }
+#endif
+    if (header->max_short_len > ZMK_TEXT_EXPANDER_GENERATED_MAX_SHORT_LEN) {
+        LOG_ERR("Dictionary image short codes are up to %u characters, firmware supports %u", header->max_short_len,
+                ZMK_TEXT_EXPANDER_GENERATED_MAX_SHORT_LEN);
+        return -ENOTSUP;
+    }
+    if (header->image_size < sizeof(*header) || header->image_size > partition_size ||
+        header->num_nodes >= NULL_INDEX) {
+        LOG_ERR("Dictionary image size is invalid");
+        return -EINVAL;
+    }
+    if (crc32_ieee(image + header->header_size, header->image_size - header->header_size) != header->payload_crc) {
+        LOG_ERR("Dictionary image checksum mismatch");
+        return -EINVAL;
+    }
+    if (!check_tables(header)) {
+        return -EINVAL;
+    }
+
+    const struct trie_image_table *pool = &header->tables[TRIE_TABLE_STRING_POOL];
+    if (pool->size == 0 || image[pool->offset + pool->size - 1] != '\0') {
+        LOG_ERR("Dictionary image string pool is not terminated");
+        return -EINVAL;
+    }
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_FUZZY_MATCH
+    const struct trie_image_table *alphabet = &header->tables[TRIE_TABLE_SHORT_CODE_ALPHABET];
+    if (alphabet->size == 0 || image[alphabet->offset + alphabet->size - 1] != '\0') {
+        LOG_ERR("Dictionary image short code alphabet is not terminated");
+        return -EINVAL;
+    }
+#endif
+
+#define TABLE_ADDR(id) ((const void *)(image + header->tables[id].offset))
+    zmk_text_expander_trie_nodes = TABLE_ADDR(TRIE_TABLE_NODES);
+    zmk_text_expander_string_pool = TABLE_ADDR(TRIE_TABLE_STRING_POOL);
+    string_pool_size = pool->size;
+#if defined(CONFIG_ZMK_TEXT_EXPANDER_TRIE_DOUBLE_ARRAY)
+    zmk_text_expander_da_base = TABLE_ADDR(TRIE_TABLE_DA_BASE);
+    zmk_text_expander_da_check = TABLE_ADDR(TRIE_TABLE_DA_CHECK);
+#elif defined(CONFIG_ZMK_TEXT_EXPANDER_TRIE_BITMAP)
+    zmk_text_expander_bitmap_bit_of = TABLE_ADDR(TRIE_TABLE_BITMAP_ALPHABET);
+#elif defined(CONFIG_ZMK_TEXT_EXPANDER_TRIE_SWAR)
+    zmk_text_expander_swar_keys = TABLE_ADDR(TRIE_TABLE_SWAR_KEYS);
+#elif defined(CONFIG_ZMK_TEXT_EXPANDER_TRIE_FLAT_HASH)
+    // Only the nodes and the string pool
+#elif defined(CONFIG_ZMK_TEXT_EXPANDER_TRIE_PERFECT_HASH)
+    zmk_text_expander_hash_tables = TABLE_ADDR(TRIE_TABLE_HASH_TABLES);
+    zmk_text_expander_hash_entries = TABLE_ADDR(TRIE_TABLE_HASH_ENTRIES);
+#else
+    zmk_text_expander_hash_tables = TABLE_ADDR(TRIE_TABLE_HASH_TABLES);
+    zmk_text_expander_hash_entries = TABLE_ADDR(TRIE_TABLE_HASH_ENTRIES);
+    zmk_text_expander_hash_buckets = TABLE_ADDR(TRIE_TABLE_HASH_BUCKETS);
+#endif
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_AHO_CORASICK
+    zmk_text_expander_ac_fail = TABLE_ADDR(TRIE_TABLE_AC_FAIL);
+    zmk_text_expander_ac_output = TABLE_ADDR(TRIE_TABLE_AC_OUTPUT);
+    zmk_text_expander_ac_depth = TABLE_ADDR(TRIE_TABLE_AC_DEPTH);
+#endif
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_PREFIX_COMPLETION
+    zmk_text_expander_top_completions = TABLE_ADDR(TRIE_TABLE_TOP_COMPLETIONS);
+#endif
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_FUZZY_MATCH
+    zmk_text_expander_short_code_alphabet = TABLE_ADDR(TRIE_TABLE_SHORT_CODE_ALPHABET);
+#endif
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_COMPRESS_STRING_POOL
+    zmk_text_expander_pool_dict = TABLE_ADDR(TRIE_TABLE_POOL_DICT);
+    zmk_text_expander_pool_dict_offsets = TABLE_ADDR(TRIE_TABLE_POOL_DICT_OFFSETS);
+    zmk_text_expander_pool_dict_count = header->tables[TRIE_TABLE_POOL_DICT_OFFSETS].size / sizeof(uint16_t) - 1;
+#endif
+#ifdef CONFIG_ZMK_TEXT_EXPANDER_FRAGMENTS
+    zmk_text_expander_fragment_offsets = TABLE_ADDR(TRIE_TABLE_FRAGMENT_OFFSETS);
+    zmk_text_expander_fragment_count = header->tables[TRIE_TABLE_FRAGMENT_OFFSETS].size / sizeof(trie_offset_t);
+#endif
+#undef TABLE_ADDR
+    // Published last: until here the trie reads as empty.
+    zmk_text_expander_trie_num_nodes = header->num_nodes;
+
+    LOG_INF("Loaded dictionary image: %u nodes, %u bytes", header->num_nodes, header->image_size);
+    return 0;
+}
+
+const char *zmk_text_expander_get_string(trie_offset_t offset) {
+    if (offset >= string_pool_size) return NULL;
+    return &zmk_text_expander_string_pool[offset];
+}
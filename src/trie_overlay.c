@@ -0,0 +1,456 @@
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#ifdef CONFIG_SETTINGS
+#include <zephyr/settings/settings.h>
+#endif
+
+#include <zmk/text_expander.h>
+#include <zmk/trie_overlay.h>
+
+LOG_MODULE_REGISTER(trie_overlay, LOG_LEVEL_DBG);
+
+#define OVERLAY_MAX_ENTRIES CONFIG_ZMK_TEXT_EXPANDER_OVERLAY_MAX_ENTRIES
+#define OVERLAY_POOL_SIZE CONFIG_ZMK_TEXT_EXPANDER_OVERLAY_POOL_SIZE
+#define OVERLAY_MAX_SHORT_LEN CONFIG_ZMK_TEXT_EXPANDER_OVERLAY_MAX_SHORT_LEN
+
+// The pool holds an entry's short code at offset, followed by its expanded text and a terminator
+struct overlay_entry {
+    uint16_t offset;
+    uint16_t expanded_len_chars;
+    uint8_t short_len;
+    bool preserve_trigger;
+};
+
+// Sorted by short code, bytewise, a short code before the ones it is a prefix of
+static struct overlay_entry entries[OVERLAY_MAX_ENTRIES];
+static uint8_t num_entries;
+static char pool[OVERLAY_POOL_SIZE];
+// Entries are appended at pool_used; removing one leaves a hole of pool_free bytes until compaction
+static uint16_t pool_used;
+static uint16_t pool_free;
+static uint8_t generation;
+
+static void schedule_save(void);
+
+static inline const char *entry_short_code(const struct overlay_entry *entry) {
+    return &pool[entry->offset];
+}
+
+static inline const char *entry_text(const struct overlay_entry *entry) {
+    return &pool[entry->offset + entry->short_len];
+}
+
+static inline uint16_t entry_size(const struct overlay_entry *entry) {
+    return entry->short_len + strlen(entry_text(entry)) + 1;
+}
+
+/**
+ * @brief Returns the byte of an entry's short code at depth.
+ * @return The byte, or -1 past the end of the short code, so that a short
+ *         code sorts before the ones it is a prefix of
+ */
+static inline int key_byte(const struct overlay_entry *entry, uint8_t depth) {
+    return depth < entry->short_len ? (uint8_t)entry_short_code(entry)[depth] : -1;
+}
+
+/**
+ * @brief Binary search among entries that share their first depth bytes.
+ * @param upper Find the first entry whose byte at depth is above c instead of at least c
+ * @return Index in [lo, hi]
+ */
+static uint8_t key_bound(uint8_t lo, uint8_t hi, uint8_t depth, int c, bool upper) {
+    while (lo < hi) {
+        uint8_t mid = lo + (hi - lo) / 2;
+        int byte = key_byte(&entries[mid], depth);
+        if (byte < c || (upper && byte == c)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static int compare_short_codes(const char *a, size_t a_len, const char *b, size_t b_len) {
+    int cmp = memcmp(a, b, MIN(a_len, b_len));
+    if (cmp != 0) {
+        return cmp;
+    }
+    return (a_len > b_len) - (a_len < b_len);
+}
+
+/**
+ * @brief Finds where a short code is or would be inserted.
+ * @param index Set to the entry's index, or to the insertion point
+ * @return true if the short code has an entry
+ */
+static bool find_entry(const char *short_code, size_t short_len, uint8_t *index) {
+    uint8_t lo = 0, hi = num_entries;
+    while (lo < hi) {
+        uint8_t mid = lo + (hi - lo) / 2;
+        int cmp = compare_short_codes(entry_short_code(&entries[mid]), entries[mid].short_len, short_code, short_len);
+        if (cmp == 0) {
+            *index = mid;
+            return true;
+        }
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *index = lo;
+    return false;
+}
+
+static void remove_entry(uint8_t index) {
+    pool_free += entry_size(&entries[index]);
+    memmove(&entries[index], &entries[index + 1], (num_entries - index - 1) * sizeof(entries[0]));
+    num_entries--;
+}
+
+/**
+ * @brief Closes the holes left by removed entries.
+ *
+ * Entries are moved down in pool order, so none is overwritten before it has
+ * been moved. The entry table is small, which keeps the quadratic search for
+ * the next entry cheap.
+ */
+static void compact_pool(void) {
+    uint16_t used = 0;
+    for (uint8_t moved = 0; moved < num_entries; moved++) {
+        struct overlay_entry *next = NULL;
+        for (uint8_t i = 0; i < num_entries; i++) {
+            if (entries[i].offset >= used && (!next || entries[i].offset < next->offset)) {
+                next = &entries[i];
+            }
+        }
+        uint16_t size = entry_size(next);
+        memmove(&pool[used], &pool[next->offset], size);
+        next->offset = used;
+        used += size;
+    }
+    pool_used = used;
+    pool_free = 0;
+}
+
+/**
+ * @brief Rewinds a cursor to the empty string.
+ * @param cursor The cursor to reset
+ */
+void trie_overlay_cursor_reset(struct trie_overlay_cursor *cursor) {
+    cursor->lo = 0;
+    cursor->hi = num_entries;
+    cursor->depth = 0;
+    cursor->generation = generation;
+}
+
+/**
+ * @brief Advances a cursor by one typed character.
+ * @param cursor The cursor to advance
+ * @param c The character that was typed
+ *
+ * Narrows the run of entries to those whose next byte is c: two binary
+ * searches within the run, and nothing once the run is empty. A cursor
+ * that consumed characters before the overlay last changed matches nothing
+ * until it is reset.
+ */
+void trie_overlay_cursor_advance(struct trie_overlay_cursor *cursor, char c) {
+    if (cursor->generation != generation) {
+        if (cursor->depth == 0) {
+            trie_overlay_cursor_reset(cursor);
+        } else {
+            cursor->lo = cursor->hi = 0;
+        }
+    }
+    if (cursor->lo < cursor->hi) {
+        uint8_t lo = key_bound(cursor->lo, cursor->hi, cursor->depth, (uint8_t)c, false);
+        cursor->hi = key_bound(lo, cursor->hi, cursor->depth, (uint8_t)c, true);
+        cursor->lo = lo;
+    }
+    if (cursor->depth < UINT8_MAX) {
+        cursor->depth++;
+    }
+}
+
+/**
+ * @brief Tells whether an overlay short code starts with the consumed text.
+ * @param cursor The cursor to inspect
+ * @return true if typing on may still reach an overlay short code
+ */
+bool trie_overlay_cursor_is_prefix(const struct trie_overlay_cursor *cursor) {
+    return cursor->generation == generation && cursor->lo < cursor->hi;
+}
+
+/**
+ * @brief Looks up the overlay short code the consumed text spells.
+ * @param cursor The cursor to inspect
+ * @param match Filled in with the entry's expansion if there is one
+ * @return true if the consumed text is an overlay short code
+ *
+ * The returned text is plain UTF-8 in RAM, valid until the overlay changes.
+ */
+bool trie_overlay_cursor_get_match(const struct trie_overlay_cursor *cursor, struct trie_overlay_match *match) {
+    if (!trie_overlay_cursor_is_prefix(cursor) || entries[cursor->lo].short_len != cursor->depth) {
+        return false;
+    }
+    const struct overlay_entry *entry = &entries[cursor->lo];
+    match->expanded_text = entry_text(entry);
+    match->expanded_len_chars = entry->expanded_len_chars;
+    match->short_len = entry->short_len;
+    match->preserve_trigger = entry->preserve_trigger;
+    return true;
+}
+
+/**
+ * @brief Adds an expansion, replacing any with the same short code.
+ * @param short_code Lowercase short code of printable ASCII characters
+ * @param expanded_text UTF-8 text to type, without control characters other
+ *        than newline and tab
+ * @param preserve_trigger Whether the trigger key is replayed after the expansion
+ * @return 0 on success, -EINVAL for an invalid short code or text, -ENOMEM if
+ *         the entry table or the pool is full
+ *
+ * Removed entries leave holes in the pool; they are compacted away when an
+ * expansion would not fit otherwise. The change is saved after
+ * CONFIG_ZMK_TEXT_EXPANDER_OVERLAY_SAVE_DEBOUNCE ms, together with any made
+ * in the meantime.
+ */
+int trie_overlay_add(const char *short_code, const char *expanded_text, bool preserve_trigger) {
+    size_t short_len = strlen(short_code);
+    size_t text_len = strlen(expanded_text);
+
+    if (short_len == 0 || short_len > OVERLAY_MAX_SHORT_LEN) {
+        return -EINVAL;
+    }
+    for (size_t i = 0; i < short_len; i++) {
+        char c = short_code[i];
+        if (c <= ' ' || c >= 0x7F || (c >= 'A' && c <= 'Z')) {
+            return -EINVAL;
+        }
+    }
+
+    // Plain text must not contain opcodes, so the text reader can type it as is
+    uint16_t expanded_len_chars = 0;
+    for (size_t i = 0; i < text_len; i++) {
+        uint8_t byte = (uint8_t)expanded_text[i];
+        if (byte < ' ' && byte != '\n' && byte != '\t') {
+            return -EINVAL;
+        }
+        if ((byte & 0xC0) != 0x80) {
+            expanded_len_chars++;
+        }
+    }
+
+    size_t size = short_len + text_len + 1;
+    uint8_t index;
+    bool replacing = find_entry(short_code, short_len, &index);
+    size_t freed = replacing ? entry_size(&entries[index]) : 0;
+    if (!replacing && num_entries == OVERLAY_MAX_ENTRIES) {
+        return -ENOMEM;
+    }
+    if (pool_used - pool_free - freed + size > OVERLAY_POOL_SIZE) {
+        return -ENOMEM;
+    }
+
+    if (replacing) {
+        remove_entry(index);
+    }
+    if (pool_used + size > OVERLAY_POOL_SIZE) {
+        compact_pool();
+    }
+
+    memmove(&entries[index + 1], &entries[index], (num_entries - index) * sizeof(entries[0]));
+    num_entries++;
+    entries[index] = (struct overlay_entry){
+        .offset = pool_used,
+        .expanded_len_chars = expanded_len_chars,
+        .short_len = (uint8_t)short_len,
+        .preserve_trigger = preserve_trigger,
+    };
+    memcpy(&pool[pool_used], short_code, short_len);
+    memcpy(&pool[pool_used + short_len], expanded_text, text_len + 1);
+    pool_used += size;
+
+    generation++;
+    schedule_save();
+    return 0;
+}
+
+/**
+ * @brief Removes the expansion of a short code.
+ * @return 0 on success, -ENOENT if the overlay has no such short code
+ */
+int trie_overlay_remove(const char *short_code) {
+    uint8_t index;
+    if (!find_entry(short_code, strlen(short_code), &index)) {
+        return -ENOENT;
+    }
+    remove_entry(index);
+    generation++;
+    schedule_save();
+    return 0;
+}
+
+void trie_overlay_clear(void) {
+    num_entries = 0;
+    pool_used = 0;
+    pool_free = 0;
+    generation++;
+    schedule_save();
+}
+
+/**
+ * @brief Calls cb for every expansion, in short code order.
+ */
+void trie_overlay_foreach(trie_overlay_cb cb, void *user) {
+    char short_code[OVERLAY_MAX_SHORT_LEN + 1];
+
+    for (uint8_t i = 0; i < num_entries; i++) {
+        const struct overlay_entry *entry = &entries[i];
+        memcpy(short_code, entry_short_code(entry), entry->short_len);
+        short_code[entry->short_len] = '\0';
+        cb(short_code, entry_text(entry), entry->preserve_trigger, user);
+    }
+}
+
+void trie_overlay_get_stats(struct trie_overlay_stats *stats) {
+    stats->entries = num_entries;
+    stats->pool_used = pool_used;
+    stats->pool_free = pool_free;
+}
+
+#ifdef CONFIG_SETTINGS
+static void overlay_save_work_handler(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(overlay_save_work, overlay_save_work_handler);
+
+static void overlay_save_work_handler(struct k_work *work) {
+    k_mutex_lock(&expander_data.mutex, K_FOREVER);
+    // Saving compacts the pool, which would move the text an expansion is typing from
+    if (expander_data.expansion_work_item.state != EXPANSION_STATE_IDLE) {
+        k_work_reschedule(&overlay_save_work, K_MSEC(CONFIG_ZMK_TEXT_EXPANDER_OVERLAY_SAVE_DEBOUNCE));
+    } else {
+        trie_overlay_save();
+    }
+    k_mutex_unlock(&expander_data.mutex);
+}
+
+static void schedule_save(void) {
+    // Changes made within the debounce time are written together, sparing the flash
+    k_work_reschedule(&overlay_save_work, K_MSEC(CONFIG_ZMK_TEXT_EXPANDER_OVERLAY_SAVE_DEBOUNCE));
+}
+
+/**
+ * @brief Writes the overlay to the settings storage now.
+ * @return 0 on success, or the settings subsystem's negative error code
+ *
+ * The pool is compacted first, so only live entries are written: the entry
+ * table and the pool are saved as they are laid out in RAM and read back
+ * into place at boot. Like adding and removing entries, it must not be
+ * called while an expansion is typed.
+ */
+int trie_overlay_save(void) {
+    k_work_cancel_delayable(&overlay_save_work);
+    compact_pool();
+
+    int err = settings_save_one("text_expander/overlay/entries", entries, num_entries * sizeof(entries[0]));
+    if (err == 0) {
+        err = settings_save_one("text_expander/overlay/pool", pool, pool_used);
+    }
+    if (err) {
+        LOG_ERR("Failed to save the expansion overlay: %d", err);
+        return err;
+    }
+    LOG_INF("Saved %d overlay expansions (%d pool bytes)", num_entries, pool_used);
+    return 0;
+}
+
+/**
+ * @brief Checks an overlay read back from storage before it is used.
+ * @return true if the entries are in order and lie within the pool without
+ *         overlapping, as compaction requires
+ */
+static bool overlay_is_valid(void) {
+    for (uint8_t i = 0; i < num_entries; i++) {
+        const struct overlay_entry *entry = &entries[i];
+        if (entry->short_len == 0 || entry->short_len > OVERLAY_MAX_SHORT_LEN ||
+            entry->offset + entry->short_len >= pool_used) {
+            return false;
+        }
+        if (!memchr(entry_text(entry), '\0', pool_used - entry->offset - entry->short_len)) {
+            return false;
+        }
+        if (i > 0 && compare_short_codes(entry_short_code(&entries[i - 1]), entries[i - 1].short_len,
+                                         entry_short_code(entry), entry->short_len) >= 0) {
+            return false;
+        }
+    }
+    for (uint8_t i = 0; i < num_entries; i++) {
+        for (uint8_t j = i + 1; j < num_entries; j++) {
+            if (entries[i].offset < entries[j].offset + entry_size(&entries[j]) &&
+                entries[j].offset < entries[i].offset + entry_size(&entries[i])) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Reads one of the overlay's settings back into place.
+ *
+ * Runs from settings_load() at boot, before any key is processed.
+ */
+static int overlay_settings_set(const char *name, size_t len, settings_read_cb read_cb, void *cb_arg) {
+    const char *next;
+    ssize_t read;
+
+    if (settings_name_steq(name, "entries", &next) && !next) {
+        if (len > sizeof(entries) || len % sizeof(entries[0]) != 0) {
+            return -EINVAL;
+        }
+        read = read_cb(cb_arg, entries, len);
+        if (read < 0) {
+            return read;
+        }
+        num_entries = read / sizeof(entries[0]);
+        return 0;
+    }
+    if (settings_name_steq(name, "pool", &next) && !next) {
+        if (len > sizeof(pool)) {
+            return -EINVAL;
+        }
+        read = read_cb(cb_arg, pool, len);
+        if (read < 0) {
+            return read;
+        }
+        pool_used = read;
+        return 0;
+    }
+    return -ENOENT;
+}
+
+static int overlay_settings_commit(void) {
+    if (!overlay_is_valid()) {
+        LOG_WRN("Saved expansion overlay is inconsistent, discarding it");
+        num_entries = 0;
+        pool_used = 0;
+    }
+    compact_pool();
+    generation++;
+    LOG_INF("Loaded %d overlay expansions", num_entries);
+    return 0;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(text_expander_overlay, "text_expander/overlay", NULL, overlay_settings_set,
+                               overlay_settings_commit, NULL);
+#else
+static void schedule_save(void) {}
+
+int trie_overlay_save(void) {
+    return -ENOTSUP;
+}
+#endif
@@ -0,0 +1,96 @@
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/sys/crc.h>
+#include <zephyr/ztest.h>
+
+#include <zmk/trie.h>
+#include <zmk/trie_image.h>
+
+// Written by scripts/gen_trie.py --image from dictionary.csv
+static const uint8_t dictionary_image[] = {
+#include "dictionary_image.inc"
+};
+
+static uint8_t image[sizeof(dictionary_image)];
+
+static void flash_image(const uint8_t *data, size_t size) {
+    const struct flash_area *area;
+
+    zassert_ok(flash_area_open(FIXED_PARTITION_ID(text_expander_partition), &area));
+    zassert_ok(flash_area_erase(area, 0, area->fa_size));
+    if (size > 0) {
+        zassert_ok(flash_area_write(area, 0, data, size));
+    }
+    flash_area_close(area);
+}
+
+static struct trie_image_header *image_header(void) {
+    return (struct trie_image_header *)image;
+}
+
+static void reseal_header(void) {
+    image_header()->header_crc = crc32_ieee(image, offsetof(struct trie_image_header, header_crc));
+}
+
+static void expect_expansion(const char *short_code, const char *expanded_text) {
+    const struct trie_node *node = trie_search(short_code);
+
+    zassert_not_null(node, "\"%s\" is not a short code", short_code);
+    zassert_str_equal(zmk_text_expander_get_string(node->expanded_text_offset), expanded_text);
+}
+
+static void before_each(void *fixture) {
+    ARG_UNUSED(fixture);
+    // A failed load must leave the trie empty, not bound to the previous image
+    zmk_text_expander_trie_num_nodes = 0;
+    memcpy(image, dictionary_image, sizeof(image));
+}
+
+ZTEST(flash_dictionary, test_loads_image) {
+    flash_image(image, sizeof(image));
+
+    zassert_ok(trie_image_load());
+    zassert_equal(zmk_text_expander_trie_num_nodes, image_header()->num_nodes);
+    expect_expansion("btw", "by the way");
+    expect_expansion("brb", "be right back");
+    expect_expansion("addr", "1 Main Street, Springfield");
+    zassert_is_null(trie_search("bt"));
+    zassert_is_null(trie_search("btwx"));
+}
+
+ZTEST(flash_dictionary, test_rejects_erased_partition) {
+    flash_image(NULL, 0);
+
+    zassert_equal(trie_image_load(), -ENOENT);
+    zassert_equal(zmk_text_expander_trie_num_nodes, 0);
+}
+
+ZTEST(flash_dictionary, test_rejects_bad_header_crc) {
+    image_header()->num_nodes++;
+    flash_image(image, sizeof(image));
+
+    zassert_equal(trie_image_load(), -EINVAL);
+    zassert_equal(zmk_text_expander_trie_num_nodes, 0);
+}
+
+ZTEST(flash_dictionary, test_rejects_bad_payload_crc) {
+    image[image_header()->header_size] ^= 0x01;
+    flash_image(image, sizeof(image));
+
+    zassert_equal(trie_image_load(), -EINVAL);
+    zassert_equal(zmk_text_expander_trie_num_nodes, 0);
+}
+
+ZTEST(flash_dictionary, test_rejects_wrong_layout) {
+    // A well-formed image built for other trie options
+    image_header()->layout ^= (uint32_t)TRIE_IMAGE_FLAG_RADIX << 8;
+    reseal_header();
+    flash_image(image, sizeof(image));
+
+    zassert_equal(trie_image_load(), -ENOTSUP);
+    zassert_equal(zmk_text_expander_trie_num_nodes, 0);
+}
+
+ZTEST_SUITE(flash_dictionary, NULL, NULL, before_each, NULL, NULL);